@@ -1,4 +1,6 @@
 #pragma once
+#include "spinlock.h"
+#include <libs/common/list.h>
 #include <libs/common/types.h>
 
 struct cpuvar;
@@ -16,6 +18,11 @@ struct cpuvar {
     unsigned ipi_pending;
     struct task *idle_task;
     struct task *current_task;
+    struct task *prev_task;  // 直前に実行していたタスク (task_switch_finish関数)
+    list_t runqueues[NUM_TASK_PRIORITIES];  // このCPUの優先度ごとのランキュー
+    uint32_t runqueue_bitmap;               // 空でないランキューの優先度のビットマップ
+    unsigned num_runnable;                  // ランキューに入っているタスクの数
+    spinlock_t runqueue_lock;               // ランキューのロック
     unsigned magic;
 };
 
@@ -50,6 +57,15 @@ void arch_vm_destroy(struct arch_vm *vm);
 error_t arch_vm_map(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
                     unsigned attrs);
 error_t arch_vm_unmap(struct arch_vm *vm, vaddr_t vaddr);
+error_t arch_vm_map_range(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
+                          size_t size, unsigned attrs);
+error_t arch_vm_map_pages(struct arch_vm *vm, vaddr_t vaddr,
+                          const paddr_t *paddrs, size_t num_pages,
+                          unsigned attrs);
+error_t arch_vm_unmap_range(struct arch_vm *vm, vaddr_t vaddr, size_t size);
+error_t arch_vm_protect_range(struct arch_vm *vm, vaddr_t vaddr, size_t size,
+                              unsigned attrs);
+paddr_t arch_vm_paddr(struct arch_vm *vm, vaddr_t vaddr, bool *large);
 vaddr_t arch_paddr_to_vaddr(paddr_t paddr);
 bool arch_is_mappable_uaddr(uaddr_t uaddr);
 error_t arch_task_init(struct task *task, uaddr_t ip, vaddr_t kernel_entry,
@@ -58,8 +74,13 @@ void arch_task_destroy(struct task *task);
 void arch_task_switch(struct task *prev, struct task *next);
 void arch_init(void);
 void arch_init_percpu(void);
-void arch_idle(void);
+void arch_idle(unsigned ticks);
+void arch_unlock_kernel(void);
+void arch_lock_kernel(void);
+bool arch_is_kernel_locked(void);
 void arch_send_ipi(unsigned ipi);
+void arch_kick_cpu(int cpu);
+struct cpuvar *arch_cpuvar_of(int cpu);
 void arch_memcpy_from_user(void *dst, __user const void *src, size_t len);
 void arch_memcpy_to_user(__user void *dst, const void *src, size_t len);
 error_t arch_irq_enable(unsigned irq);
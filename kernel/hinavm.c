@@ -11,6 +11,7 @@
 // バイトコードインタプリタ「HinaVM」の実装。HinaVMタスクが作成されると、ユーザーモードに
 // 入る代わりにこの関数が呼ばれる。
 __noreturn void hinavm_run(struct hinavm *hinavm) {
+    task_switch_finish();  // 切り替え元のタスクの後始末
     struct task *current = CURRENT_TASK;
 
     // メッセージバッファのアドレスを取得する
@@ -213,8 +214,9 @@ __noreturn void hinavm_run(struct hinavm *hinavm) {
                     task_exit(EXP_ILLEGAL_EXCEPTION);
                 }
 
-                error_t err = ipc(dst, 0, (__user struct message *) &current->m,
-                                  IPC_SEND | IPC_KERNEL);
+                error_t err =
+                    ipc(dst_tid, 0, (__user struct message *) &current->m,
+                        IPC_SEND | IPC_KERNEL);
                 regs[inst.ipc.a] = err;
                 break;
             }
@@ -227,8 +229,9 @@ __noreturn void hinavm_run(struct hinavm *hinavm) {
                     task_exit(EXP_ILLEGAL_EXCEPTION);
                 }
 
-                error_t err = ipc(dst, 0, (__user struct message *) &current->m,
-                                  IPC_SEND | IPC_NOBLOCK | IPC_KERNEL);
+                error_t err =
+                    ipc(dst_tid, 0, (__user struct message *) &current->m,
+                        IPC_SEND | IPC_NOBLOCK | IPC_KERNEL);
                 regs[inst.ipc.a] = err;
                 break;
             }
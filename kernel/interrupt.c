@@ -8,6 +8,13 @@
 static struct task *irq_listeners[IRQ_MAX];
 // 起動してからの経過時間。単位はタイマー割り込みの周期 (TICK_HZ) に依存する。
 unsigned uptime_ticks = 0;
+// タイマーが設定されているタスクの二分ヒープ。期限が最も近いタスクが先頭に来る。
+static struct task *timers[NUM_TASKS_MAX];
+// タイマーが設定されているタスクの数。
+static int num_timers = 0;
+// uptime_ticks (の更新), timers, num_timers, 各タスクのtimeoutとtimer_index のロック。
+// タイマーの処理はカーネルロックを取らずに各CPUのタイマー割り込みから行われる。
+static spinlock_t timers_lock;
 
 // 割り込み通知を受け付けるようにする。
 error_t irq_listen(struct task *task, unsigned irq) {
@@ -47,6 +54,15 @@ error_t irq_unlisten(struct task *task, unsigned irq) {
     return OK;
 }
 
+// タスクが購読している割り込み通知をすべて解除する。タスクの削除時に呼ばれる。
+void irq_unlisten_all(struct task *task) {
+    for (unsigned irq = 0; irq < IRQ_MAX; irq++) {
+        if (irq_listeners[irq] == task) {
+            OOPS_OK(irq_unlisten(task, irq));
+        }
+    }
+}
+
 // ハードウェア割り込みハンドラ (タイマー割り込み以外)
 void handle_interrupt(unsigned irq) {
     if (irq >= IRQ_MAX) {
@@ -64,24 +80,148 @@ void handle_interrupt(unsigned irq) {
     notify(task, NOTIFY_IRQ);
 }
 
-// タイマー割り込みハンドラ
-void handle_timer_interrupt(unsigned ticks) {
+// 期限aが期限bより前かどうか。uptime_ticksのオーバーフローを考慮して差で比較する。
+static bool deadline_before(unsigned a, unsigned b) {
+    return (int) (a - b) < 0;
+}
+
+// ヒープのindex番目にタスクを置く。
+static void timer_place(int index, struct task *task) {
+    timers[index] = task;
+    task->timer_index = index;
+}
+
+// index番目のタスクを、親よりも期限が後になる位置まで上に移動する。
+static void timer_sift_up(int index) {
+    struct task *task = timers[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!deadline_before(task->timeout, timers[parent]->timeout)) {
+            break;
+        }
+
+        timer_place(index, timers[parent]);
+        index = parent;
+    }
+
+    timer_place(index, task);
+}
+
+// index番目のタスクを、子よりも期限が前になる位置まで下に移動する。
+static void timer_sift_down(int index) {
+    struct task *task = timers[index];
+    while (true) {
+        int child = index * 2 + 1;
+        if (child >= num_timers) {
+            break;
+        }
+
+        // 期限が近い方の子と比較する
+        if (child + 1 < num_timers
+            && deadline_before(timers[child + 1]->timeout,
+                               timers[child]->timeout)) {
+            child++;
+        }
+
+        if (!deadline_before(timers[child]->timeout, task->timeout)) {
+            break;
+        }
+
+        timer_place(index, timers[child]);
+        index = child;
+    }
+
+    timer_place(index, task);
+}
+
+// タスクをヒープから取り除く。
+static void timer_remove(struct task *task) {
+    int index = task->timer_index;
+    DEBUG_ASSERT(timers[index] == task);
+
+    task->timer_index = -1;
+    num_timers--;
+    if (index == num_timers) {
+        return;
+    }
+
+    // 末尾のタスクを空いた位置に移し、ヒープの条件を満たす位置まで移動する。
+    struct task *last = timers[num_timers];
+    timer_place(index, last);
+    timer_sift_up(index);
+    timer_sift_down(last->timer_index);
+}
+
+// タスクのタイマーを設定する。ticks後にタスクに通知が送られる。ticksがゼロの場合は
+// タイマーを解除する。
+void timer_set(struct task *task, unsigned ticks) {
+    spin_lock(&timers_lock);
+    if (task->timer_index >= 0) {
+        timer_remove(task);
+    }
+
+    if (!ticks) {
+        spin_unlock(&timers_lock);
+        return;
+    }
+
+    DEBUG_ASSERT(num_timers < NUM_TASKS_MAX);
+    task->timeout = uptime_ticks + ticks;
+    timer_place(num_timers, task);
+    num_timers++;
+    timer_sift_up(task->timer_index);
+    bool earliest = task->timer_index == 0;
+    spin_unlock(&timers_lock);
+
+    // 最も近い期限が変わった場合は、アイドル状態の0番目のCPUを起こしてタイマー割り込みの
+    // 時刻を設定し直させる。
+    struct cpuvar *cpuvar = arch_cpuvar_of(0);
+    if (earliest && cpuvar->current_task == cpuvar->idle_task) {
+        arch_kick_cpu(0);
+    }
+}
+
+// 最も近いタイマーの期限までのticks数を返す。タイマーが設定されていない場合はゼロを返す。
+unsigned timer_next(void) {
+    spin_lock(&timers_lock);
+    unsigned ticks = 0;
+    if (num_timers > 0) {
+        unsigned deadline = timers[0]->timeout;
+        if (!deadline_before(uptime_ticks, deadline)) {
+            ticks = 1;  // 既に期限を過ぎているので、次のtickで処理する
+        } else {
+            ticks = deadline - uptime_ticks;
+        }
+    }
+
+    spin_unlock(&timers_lock);
+    return ticks;
+}
+
+// 経過時間を進め、期限を迎えたタイマーのタスクに通知する。
+//
+// 通知はtimers_lockを持ったまま送る。ロックを外してから送ると、その間にtask_destroy関数が
+// タイマーを解除してタスクを解放してしまう恐れがある。
+void timer_advance(unsigned ticks) {
+    spin_lock(&timers_lock);
+
     // 起動してからの経過時間を更新
     uptime_ticks += ticks;
 
-    if (CPUVAR->id == 0) {
-        // 各タスクのタイマーを更新する
-        LIST_FOR_EACH (task, &active_tasks, struct task, next) {
-            if (task->timeout > 0) {
-                task->timeout -= MIN(task->timeout, ticks);
-                if (!task->timeout) {
-                    // タイムアウトしたのでタスクに通知する
-                    notify(task, NOTIFY_TIMER);
-                }
-            }
-        }
+    while (num_timers > 0
+           && !deadline_before(uptime_ticks, timers[0]->timeout)) {
+        struct task *task = timers[0];
+        timer_remove(task);
+
+        // タイムアウトしたのでタスクに通知する
+        notify(task, NOTIFY_TIMER);
     }
 
+    spin_unlock(&timers_lock);
+}
+
+// タイマー割り込みハンドラ
+void handle_timer_interrupt(unsigned ticks) {
     // 実行中タスクの残り実行可能時間を更新し、ゼロになったらタスク切り替えを行う
     struct task *current = CURRENT_TASK;
     DEBUG_ASSERT(current->quantum >= 0 || current == IDLE_TASK);
@@ -90,3 +230,8 @@ void handle_timer_interrupt(unsigned ticks) {
         task_switch();
     }
 }
+
+// 割り込み・タイマー管理の初期化
+void interrupt_init(void) {
+    spinlock_init(&timers_lock, "timers");
+}
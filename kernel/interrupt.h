@@ -6,5 +6,10 @@ extern unsigned uptime_ticks;
 struct task;
 error_t irq_listen(struct task *task, unsigned irq);
 error_t irq_unlisten(struct task *task, unsigned irq);
+void irq_unlisten_all(struct task *task);
 void handle_interrupt(unsigned irq);
+void timer_set(struct task *task, unsigned ticks);
+unsigned timer_next(void);
+void timer_advance(unsigned ticks);
 void handle_timer_interrupt(unsigned ticks);
+void interrupt_init(void);
@@ -1,4 +1,5 @@
 #include "ipc.h"
+#include "memory.h"
 #include "syscall.h"
 #include "task.h"
 #include <libs/common/list.h>
@@ -7,105 +8,435 @@
 #include <libs/common/string.h>
 #include <libs/common/types.h>
 
-// メッセージの送信処理
-static error_t send_message(struct task *dst, __user struct message *m,
-                            unsigned flags) {
+// senderがtaskへの送信待ちキューに入っているかどうかを返す。
+static bool is_blocked_sender(struct task *task, struct task *sender) {
+    bool found = false;
+    spin_lock(&task->lock);
+    LIST_FOR_EACH (t, &task->senders, struct task, waitqueue_next) {
+        if (t == sender) {
+            found = true;
+            break;
+        }
+    }
+
+    spin_unlock(&task->lock);
+    return found;
+}
+
+// 送信するメッセージをコピーする。ユーザーポインタの場合、ページフォルトが発生する可能性
+// があるので、ロックを取る前に呼ぶこと。
+static error_t copy_message_from(struct message *dst, __user struct message *m,
+                                 unsigned flags) {
+    if (flags & IPC_KERNEL) {
+        memcpy(dst, (struct message *) m, sizeof(struct message));
+        return OK;
+    }
+
+    return memcpy_from_user(dst, m, sizeof(struct message));
+}
+
+// ページテーブルの操作はまだカーネルロックで保護しているので、持っていなければ取得する。
+// IPCはシステムコールからはカーネルロックを持たずに、カーネル内部 (ページフォルト処理など)
+// からは持った状態で呼ばれる。取得した場合はtrueを返す。
+static bool lock_kernel_for_vm(void) {
+    if (arch_is_kernel_locked()) {
+        return false;
+    }
+
+    arch_lock_kernel();
+    return true;
+}
+
+// メッセージに添付されたページを送信元 (src) から宛先 (dst) へ移し、メッセージ中の
+// アドレスを宛先での仮想アドレスに書き換える。失敗した場合、ページは送信元に残る。
+//
+// ページテーブルの割り当てやTLBのフラッシュ (IPIの応答を待つ間はカーネルロックが解放
+// される) を伴うので、dstのロックは持たずに、dstをピン留めした状態で呼ぶこと。
+static error_t transfer_pages(struct task *src, struct task *dst,
+                              struct message *m) {
+    if (!msgtype_has_pages(m->type)) {
+        return OK;
+    }
+
+    struct message_pages *pages = (struct message_pages *) m->data;
+    if (pages->len == 0) {
+        pages->uaddr = 0;
+        return OK;
+    }
+
+    bool locked = lock_kernel_for_vm();
+    error_t err =
+        vm_transfer(src, pages->uaddr, pages->len, dst, &pages->uaddr);
+    if (locked) {
+        arch_unlock_kernel();
+    }
+
+    return err;
+}
+
+// transfer_pages関数で宛先 (dst) に移したページを解放する。メッセージを渡せなかった場合に
+// 呼ぶ。そのままにしておくと、宛先タスクが終了するまでページ受け取り領域に残ってしまう。
+static void discard_pages(struct task *dst, struct message *m) {
+    struct message_pages *pages = (struct message_pages *) m->data;
+    if (msgtype_has_pages(m->type) && pages->len > 0) {
+        bool locked = lock_kernel_for_vm();
+        vm_unmap_range(dst, pages->uaddr, ALIGN_UP(pages->len, PAGE_SIZE));
+        if (locked) {
+            arch_unlock_kernel();
+        }
+    }
+}
+
+// taskがsrcからのメッセージを受信待ちしているかどうかを返す。taskのロックを持った状態で
+// 呼ぶこと。
+static bool is_waiting_for(struct task *task, task_t src) {
+    return task->state == TASK_BLOCKED
+           && (task->wait_for == IPC_ANY || task->wait_for == src);
+}
+
+// メッセージの送信処理。flagsにIPC_RECVが含まれている場合は、直後の受信処理で宛先タスクへ
+// 直接切り替えるため、宛先タスクをブロック状態のままにする (ダイレクトハンドオフ)。そうした
+// 場合は*handoffに、ピン留めしたままの宛先タスクを設定する。
+//
+// 宛先タスクはメッセージをコピーした後にピン留めする。コピー中のページフォルトでブロック
+// している間に、宛先タスクが削除される可能性があるため。
+static error_t send_message(task_t dst_tid, __user struct message *m,
+                            unsigned flags, struct task **handoff) {
     // 自分自身にはメッセージを送信できない
     struct task *current = CURRENT_TASK;
-    if (dst == current) {
+    if (dst_tid == current->tid) {
         WARN("%s: tried to send a message to itself", current->name);
         return ERR_INVALID_ARG;
     }
 
-    // 送信するメッセージをコピーする。ユーザーポインタの場合、ページフォルトが発生する可能性
-    // があるので注意
     struct message copied_m;
-    if (flags & IPC_KERNEL) {
-        memcpy(&copied_m, (struct message *) m, sizeof(struct message));
-    } else {
-        error_t err = memcpy_from_user(&copied_m, m, sizeof(struct message));
-        if (err != OK) {
-            return err;
-        }
+    error_t err = copy_message_from(&copied_m, m, flags);
+    if (err != OK) {
+        return err;
+    }
+
+    struct task *dst = task_pin(dst_tid);
+    if (!dst) {
+        return ERR_INVALID_TASK;
+    }
+
+    // 互いにメッセージを送り合おうとしている場合はデッドロックになるので、エラーを返す。
+    // 宛先のロックを取る前に調べることで、2つのタスクのロックを同時に保持しないようにする。
+    bool noblock = (flags & (IPC_NOBLOCK | IPC_REPLY)) != 0;
+    if (!noblock && is_blocked_sender(current, dst)) {
+        WARN("dead lock detected: %s (#%d) and %s (#%d) are trying to"
+             " send messages to each other"
+             " (hint: consider using ipc_send_async())",
+             current->name, current->tid, dst->name, dst->tid);
+        task_unpin(dst);
+        return ERR_DEAD_LOCK;
     }
 
+    copied_m.src = (flags & IPC_KERNEL) ? FROM_KERNEL : current->tid;
+
     // 送信先がメッセージを待っているか確認
-    bool ready = dst->state == TASK_BLOCKED
-                 && (dst->wait_for == IPC_ANY || dst->wait_for == current->tid);
-    if (!ready) {
-        if (flags & IPC_NOBLOCK) {
-            return ERR_WOULD_BLOCK;
+    spin_lock(&dst->lock);
+    bool ready = is_waiting_for(dst, current->tid);
+    if (!ready && noblock) {
+        spin_unlock(&dst->lock);
+        task_unpin(dst);
+        return ERR_WOULD_BLOCK;
+    }
+
+    if (msgtype_has_pages(copied_m.type)) {
+        // 添付されたページはこの時点で宛先タスクに移す。宛先タスクが受信する前に終了した
+        // 場合は、宛先タスクと共に解放される。
+        spin_unlock(&dst->lock);
+        err = transfer_pages(current, dst, &copied_m);
+        if (err != OK) {
+            task_unpin(dst);
+            return err;
         }
 
-        // 互いにメッセージを送り合おうとしている場合はデッドロックになるので、エラーを返す。
-        LIST_FOR_EACH (task, &current->senders, struct task, waitqueue_next) {
-            if (task->tid == dst->tid) {
-                WARN(
-                    "dead lock detected: %s (#%d) and %s (#%d) are trying to"
-                    " send messages to each other"
-                    " (hint: consider using ipc_send_async())",
-                    current->name, current->tid, dst->name, dst->tid);
-                return ERR_DEAD_LOCK;
-            }
+        // ロックを解放している間に、宛先タスクが他のメッセージを受け取っているかもしれない
+        // ので確認し直す。
+        spin_lock(&dst->lock);
+        ready = is_waiting_for(dst, current->tid);
+        if (!ready && noblock) {
+            spin_unlock(&dst->lock);
+            discard_pages(dst, &copied_m);
+            task_unpin(dst);
+            return ERR_WOULD_BLOCK;
         }
+    }
 
-        // 宛先の送信待ちキューに実行中タスクを追加し、ブロック状態にする
+    if (!ready) {
+        // 宛先の送信待ちキューに実行中タスクを追加し、ブロック状態にする。メッセージは
+        // このタスクのメッセージ一時保存領域に置いておき、宛先タスクが受信処理で直接
+        // 取り出す。送信中のタスクは受信状態にならないので、他に上書きされることはない。
+        memcpy(&current->m, &copied_m, sizeof(struct message));
         list_push_back(&dst->senders, &current->waitqueue_next);
+        current->blocked_on = dst->tid;
         task_block(current);
+        spin_unlock(&dst->lock);
 
-        // CPUを他のタスクに譲る。宛先タスクが受信状態になると、このタスクが再開される
+        // 送信待ちキューに入ったので、宛先タスクが削除されるときはtask_destroy関数が
+        // このタスクを再開させる。ブロックする前にピン留めを外す。
+        task_unpin(dst);
+
+        // CPUを他のタスクに譲る。宛先タスクがメッセージを取り出すと、このタスクが再開される
         task_switch();
 
         // 宛先タスクが終了した場合は送信処理を中断する
-        if (current->notifications & NOTIFY_ABORTED) {
-            current->notifications &= ~NOTIFY_ABORTED;
-            return ERR_ABORTED;
-        }
+        spin_lock(&current->lock);
+        bool aborted = (current->notifications & NOTIFY_ABORTED) != 0;
+        current->notifications &= ~NOTIFY_ABORTED;
+        spin_unlock(&current->lock);
+        return aborted ? ERR_ABORTED : OK;
     }
 
     // メッセージを送信して、宛先タスクを再開する
     memcpy(&dst->m, &copied_m, sizeof(struct message));
-    dst->m.src = (flags & IPC_KERNEL) ? FROM_KERNEL : current->tid;
-    task_resume(dst);
+    if (flags & IPC_RECV) {
+        // 受信処理でこのタスクへ切り替えるまでの間に、他のメッセージや通知でdst->mが
+        // 上書きされないよう受信不可にしておく。
+        dst->wait_for = IPC_DENY;
+        *handoff = dst;
+        spin_unlock(&dst->lock);
+    } else {
+        task_resume(dst);
+        spin_unlock(&dst->lock);
+        task_unpin(dst);
+    }
+
+    return OK;
+}
+
+// 非同期メッセージ (m) を宛先タスクに渡すか、宛先タスクの非同期メッセージキューに入れる。
+// dstはピン留めした状態で呼ぶこと。
+static error_t enqueue_async_message(struct task *current, struct task *dst,
+                                     struct message *m) {
+    // キューを使うのは非同期メッセージを受け取るタスクだけなので、必要になった時点で割り当てる。
+    // headとnum_messagesが0の空のキューにするため、ゼロクリアされたページを使う。
+    // 割り当ててからロックを取るので、他の送信元が先に割り当てていた場合はそちらを使う。
+    if (!dst->asyncq) {
+        size_t size = ALIGN_UP(sizeof(struct async_queue), PAGE_SIZE);
+        paddr_t paddr = pm_alloc(size, NULL, PM_ALLOC_ZEROED);
+        if (!paddr) {
+            return ERR_NO_MEMORY;
+        }
+
+        spin_lock(&dst->lock);
+        bool lost = dst->asyncq != NULL;
+        if (!lost) {
+            dst->asyncq = (struct async_queue *) arch_paddr_to_vaddr(paddr);
+            dst->asyncq->paddr = paddr;
+        }
+        spin_unlock(&dst->lock);
+
+        if (lost) {
+            pm_free(paddr, size);
+        }
+    }
+
+    spin_lock(&dst->lock);
+    struct async_queue *q = dst->asyncq;
+    bool ready = is_waiting_for(dst, IPC_ANY);
+    if (!ready && q->num_messages >= ASYNC_QUEUE_LEN) {
+        spin_unlock(&dst->lock);
+        return ERR_WOULD_BLOCK;
+    }
+
+    if (msgtype_has_pages(m->type)) {
+        // 添付されたページはキューに入れる時点で宛先タスクに移す。
+        spin_unlock(&dst->lock);
+        error_t err = transfer_pages(current, dst, m);
+        if (err != OK) {
+            return err;
+        }
+
+        // ロックを解放している間に状態が変わっているかもしれないので確認し直す。
+        spin_lock(&dst->lock);
+        ready = is_waiting_for(dst, IPC_ANY);
+        if (!ready && q->num_messages >= ASYNC_QUEUE_LEN) {
+            spin_unlock(&dst->lock);
+            discard_pages(dst, m);
+            return ERR_WOULD_BLOCK;
+        }
+    }
+
+    if (ready) {
+        // 宛先タスクがオープン受信で待っている。キューは空のはずなので、直接渡す。
+        DEBUG_ASSERT(q->num_messages == 0);
+        memcpy(&dst->m, m, sizeof(struct message));
+        task_resume(dst);
+    } else {
+        unsigned tail = (q->head + q->num_messages) % ASYNC_QUEUE_LEN;
+        memcpy(&q->messages[tail], m, sizeof(struct message));
+        q->num_messages++;
+    }
+
+    spin_unlock(&dst->lock);
     return OK;
 }
 
-// メッセージの受信処理
+// 非同期メッセージを送信する。宛先タスクがオープン受信で待っていれば即座に渡し、そうでなければ
+// 宛先タスクの非同期メッセージキューに入れる。ブロックすることはなく、キューが一杯の場合は
+// ERR_WOULD_BLOCKを返す。
+static error_t send_async_message(task_t dst_tid, __user struct message *m,
+                                  unsigned flags) {
+    struct task *current = CURRENT_TASK;
+    if (dst_tid == current->tid) {
+        WARN("%s: tried to send a message to itself", current->name);
+        return ERR_INVALID_ARG;
+    }
+
+    struct message copied_m;
+    error_t err = copy_message_from(&copied_m, m, flags);
+    if (err != OK) {
+        return err;
+    }
+
+    copied_m.src = (flags & IPC_KERNEL) ? FROM_KERNEL : current->tid;
+
+    // 宛先タスクはメッセージをコピーした後にピン留めする (send_message関数と同じ)。
+    struct task *dst = task_pin(dst_tid);
+    if (!dst) {
+        return ERR_INVALID_TASK;
+    }
+
+    err = enqueue_async_message(current, dst, &copied_m);
+    task_unpin(dst);
+    return err;
+}
+
+// 非同期メッセージの送信元をひとつ取り出す。前回取り出した位置の続きから探すことで、特定の
+// 送信元ばかりが選ばれないようにする。taskのロックを持った状態で呼ぶこと。
+static task_t async_sender_pop(struct task *task) {
+    DEBUG_ASSERT(task->num_async_senders > 0);
+
+    int num_words = NUM_TASKS_MAX / 32;
+    for (int i = 0; i <= num_words; i++) {
+        int word = (task->async_cursor / 32 + i) % num_words;
+        uint32_t bits = task->async_senders[word];
+        if (i == 0) {
+            // 開始位置より前のビットは一周した後 (i == num_words) に調べる
+            bits &= ~0u << (task->async_cursor % 32);
+        }
+
+        if (bits) {
+            int index = word * 32 + __builtin_ctz(bits);
+            task->async_senders[word] &= ~(1u << (index % 32));
+            task->num_async_senders--;
+            task->async_cursor = (index + 1) % NUM_TASKS_MAX;
+            return index + 1;
+        }
+    }
+
+    UNREACHABLE();
+}
+
+// 保留中の通知を取り出してNOTIFY_MSGメッセージを作る。taskのロックを持った状態で呼ぶこと。
+static void pop_notifications(struct task *task, struct message *m) {
+    m->type = NOTIFY_MSG;
+    m->src = FROM_KERNEL;
+    m->notify.notifications = task->notifications;
+    m->notify.async_src = 0;
+    task->notifications = 0;
+
+    if (m->notify.notifications & NOTIFY_ASYNC) {
+        // 非同期メッセージの送信元は一度にひとつずつ渡す。まだ残っていれば通知を保留し
+        // 続ける。
+        m->notify.async_src = async_sender_pop(task);
+        if (task->num_async_senders > 0) {
+            task->notifications |= NOTIFY_ASYNC;
+        }
+    }
+}
+
+// 送信待ちキューから、srcに合致する (IPC_ANYなら先頭の) タスクを探す。taskのロックを
+// 持った状態で呼ぶこと。
+static struct task *find_sender(struct task *task, task_t src) {
+    LIST_FOR_EACH (sender, &task->senders, struct task, waitqueue_next) {
+        if (src == IPC_ANY || src == sender->tid) {
+            DEBUG_ASSERT(sender->state == TASK_BLOCKED);
+            DEBUG_ASSERT(sender->wait_for == IPC_DENY);
+            return sender;
+        }
+    }
+
+    return NULL;
+}
+
+// メッセージの受信処理。handoffは送信処理でメッセージを受け取ったタスクで、ブロックする際に
+// ランキューを経由せずに直接切り替える。ブロックしない場合は通常通り実行可能状態にする。
+// いずれの場合もhandoffのピン留めを外す。
 static error_t recv_message(task_t src, __user struct message *m,
-                            unsigned flags) {
+                            unsigned flags, struct task *handoff) {
     struct task *current = CURRENT_TASK;
+    struct task *sender;
     struct message copied_m;
-    if (src == IPC_ANY && current->notifications) {
+    spin_lock(&current->lock);
+    struct async_queue *q = current->asyncq;
+    if (src == IPC_ANY && q && q->num_messages > 0) {
+        // 非同期メッセージがある場合は、それを受信する。通知よりも先に受信することで、
+        // 同じ送信元からの非同期メッセージの順序を保つ (libs/userのipc_send_async関数)。
+        memcpy(&copied_m, &q->messages[q->head], sizeof(struct message));
+        q->head = (q->head + 1) % ASYNC_QUEUE_LEN;
+        q->num_messages--;
+        spin_unlock(&current->lock);
+
+        if (handoff) {
+            task_resume(handoff);
+            task_unpin(handoff);
+        }
+    } else if (src == IPC_ANY && current->notifications) {
         // 通知がある場合は、それをメッセージとして受信する
-        copied_m.type = NOTIFY_MSG;
-        copied_m.src = FROM_KERNEL;
-        copied_m.notify.notifications = current->notifications;
-        current->notifications = 0;
-    } else {
-        if (flags & IPC_NOBLOCK) {
-            return ERR_WOULD_BLOCK;
+        pop_notifications(current, &copied_m);
+        spin_unlock(&current->lock);
+
+        if (handoff) {
+            task_resume(handoff);
+            task_unpin(handoff);
         }
+    } else if ((sender = find_sender(current, src)) != NULL) {
+        // 送信待ちキューに `src` に合致するタスクがあれば、そのメッセージを取り出して
+        // 送信元タスクを再開する。
+        list_remove(&sender->waitqueue_next);
+        memcpy(&copied_m, &sender->m, sizeof(struct message));
+        task_resume(sender);
+
+        // 送信待ちでなくなったことは再開させた後に記録する。task_destroy関数は、これを
+        // 見て送信元がもう実行可能状態になっていることを知る。
+        sender->blocked_on = 0;
+        spin_unlock(&current->lock);
 
-        // 送信待ちキューに `src` に合致するタスクがあれば、それを再開する
-        LIST_FOR_EACH (sender, &current->senders, struct task, waitqueue_next) {
-            if (src == IPC_ANY || src == sender->tid) {
-                DEBUG_ASSERT(sender->state == TASK_BLOCKED);
-                DEBUG_ASSERT(sender->wait_for == IPC_DENY);
-                list_remove(&sender->waitqueue_next);
-                task_resume(sender);
-                src = sender->tid;
-                break;
+        if (handoff) {
+            task_resume(handoff);
+            task_unpin(handoff);
+        }
+    } else {
+        if (flags & IPC_NOBLOCK) {
+            spin_unlock(&current->lock);
+            if (handoff) {
+                task_resume(handoff);
+                task_unpin(handoff);
             }
+            return ERR_WOULD_BLOCK;
         }
 
         // メッセージを受信するまで待つ
         current->wait_for = src;
         task_block(current);
-        task_switch();
+        spin_unlock(&current->lock);
+
+        if (handoff) {
+            // メッセージを送った相手に直接切り替え、残りのCPU時間を譲る。
+            task_switch_to(handoff);
+        } else {
+            task_switch();
+        }
 
         // メッセージを受け取った
+        spin_lock(&current->lock);
         current->wait_for = IPC_DENY;
         memcpy(&copied_m, &current->m, sizeof(struct message));
+        spin_unlock(&current->lock);
     }
 
     // 受信したメッセージをコピーする。ユーザーポインタの場合、ページフォルトが発生する可能性
@@ -122,12 +453,18 @@ static error_t recv_message(task_t src, __user struct message *m,
     return OK;
 }
 
-// メッセージを送受信する。
-error_t ipc(struct task *dst, task_t src, __user struct message *m,
+// メッセージを送受信する。dstは送信先のタスクID。
+error_t ipc(task_t dst, task_t src, __user struct message *m,
             unsigned flags) {
+    // 非同期送信操作
+    if (flags & IPC_ASYNC) {
+        return send_async_message(dst, m, flags);
+    }
+
     // 送信操作
+    struct task *handoff = NULL;
     if (flags & IPC_SEND) {
-        error_t err = send_message(dst, m, flags);
+        error_t err = send_message(dst, m, flags, &handoff);
         if (err != OK) {
             return err;
         }
@@ -135,7 +472,7 @@ error_t ipc(struct task *dst, task_t src, __user struct message *m,
 
     // 受信操作
     if (flags & IPC_RECV) {
-        error_t err = recv_message(src, m, flags);
+        error_t err = recv_message(src, m, flags, handoff);
         if (err != OK) {
             return err;
         }
@@ -144,18 +481,58 @@ error_t ipc(struct task *dst, task_t src, __user struct message *m,
     return OK;
 }
 
-// 通知を送信する。
-void notify(struct task *dst, notifications_t notifications) {
+// 通知を送信する。dstのロックを持った状態で呼ぶこと。
+static void notify_locked(struct task *dst, notifications_t notifications) {
+    dst->notifications |= notifications;
     if (dst->state == TASK_BLOCKED && dst->wait_for == IPC_ANY) {
         // 宛先タスクがオープン受信状態で待っている。NOTIFY_MSGメッセージを送った体で
         // 通知を即座に配送する。
-        dst->m.type = NOTIFY_MSG;
-        dst->m.src = FROM_KERNEL;
-        dst->m.notify.notifications = dst->notifications | notifications;
-        dst->notifications = 0;
+        pop_notifications(dst, &dst->m);
         task_resume(dst);
-    } else {
-        // 宛先タスクがオープン受信をするまで通知を保留する。
-        dst->notifications |= notifications;
+    }
+
+    // そうでなければ、宛先タスクがオープン受信をするまで通知を保留する。
+}
+
+// 通知を送信する。
+void notify(struct task *dst, notifications_t notifications) {
+    spin_lock(&dst->lock);
+    notify_locked(dst, notifications);
+    spin_unlock(&dst->lock);
+}
+
+// 非同期メッセージがあることを通知する。送信元 (src) はタスクごとの集合に記録され、
+// 宛先タスクは通知と共に送信元をひとつずつ受け取る。同じ送信元から何度通知しても、
+// 受け取るまではひとつにまとめられる。
+void notify_async(struct task *dst, struct task *src) {
+    int index = src->tid - 1;
+    uint32_t bit = 1u << (index % 32);
+
+    spin_lock(&dst->lock);
+    if (!(dst->async_senders[index / 32] & bit)) {
+        dst->async_senders[index / 32] |= bit;
+        dst->num_async_senders++;
+    }
+
+    notify_locked(dst, NOTIFY_ASYNC);
+    spin_unlock(&dst->lock);
+}
+
+// 削除されるタスクを、全タスクの非同期メッセージの送信元の集合から取り除く。
+void async_sender_forget(struct task *src) {
+    int index = src->tid - 1;
+    uint32_t bit = 1u << (index % 32);
+
+    LIST_FOR_EACH (task, &active_tasks, struct task, next) {
+        spin_lock(&task->lock);
+        if (task->async_senders[index / 32] & bit) {
+            task->async_senders[index / 32] &= ~bit;
+            task->num_async_senders--;
+            if (!task->num_async_senders) {
+                task->notifications &= ~NOTIFY_ASYNC;
+            }
+        }
+
+        spin_unlock(&task->lock);
     }
 }
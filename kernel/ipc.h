@@ -3,6 +3,7 @@
 
 struct task;
 struct message;
-error_t ipc(struct task *dst, task_t src, __user struct message *m,
-            unsigned flags);
+error_t ipc(task_t dst, task_t src, __user struct message *m, unsigned flags);
 void notify(struct task *dst, notifications_t notifications);
+void notify_async(struct task *dst, struct task *src);
+void async_sender_forget(struct task *src);
@@ -1,5 +1,6 @@
 #include "main.h"
 #include "arch.h"
+#include "interrupt.h"
 #include "memory.h"
 #include "printk.h"
 #include "task.h"
@@ -67,10 +68,20 @@ static void create_first_task(struct bootinfo *bootinfo) {
 }
 
 // アイドルタスク: 他のタスクが実行可能な状態になるまで割り込み可能状態でCPUをスリープさせる。
+//
+// タイマーの期限の管理は0番目のCPUが担当し、次の期限までスリープする。その他のCPUは
+// タイマー割り込みを必要としないので、割り込みが来るまでスリープし続ける。
+//
+// スリープする前に、ページフォルト処理などで使うゼロクリア済みのページを用意しておく。
+// 少しずつ処理して、その度に実行可能なタスクがないかを確認する。
 __noreturn static void idle_task(void) {
     for (;;) {
         task_switch();
-        arch_idle();
+        if (pm_prezero_pages()) {
+            continue;
+        }
+
+        arch_idle(CPUVAR->id == 0 ? timer_next() : 0);
     }
 }
 
@@ -80,6 +91,8 @@ void kernel_main(struct bootinfo *bootinfo) {
     printf("Booting HinaOS...\n");
     memory_init(bootinfo);
     arch_init();
+    interrupt_init();
+    task_init();
     task_init_percpu();
     create_first_task(bootinfo);
     arch_init_percpu();
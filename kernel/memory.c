@@ -2,30 +2,160 @@
 #include "arch.h"
 #include "ipc.h"
 #include "printk.h"
+#include "spinlock.h"
 #include "task.h"
+#include <libs/common/message.h>
 #include <libs/common/string.h>
 
 // 物理メモリの各連続領域 (ゾーン) のリスト。
 static list_t zones = LIST_INIT(zones);
+// ゾーンと物理ページ管理構造体 (参照カウントや所有者) のロック。
+static spinlock_t zones_lock;
+// CPUごとの物理ページのキャッシュ。各キャッシュは自身のロック (cache->lock) で保護する。
+// zones_lockと両方取る場合は、zones_lock → cache->lockの順で取ること。
+static struct page_cache page_caches[NUM_CPUS_MAX];
 
-// 物理アドレスに対応するゾーンを探す。
+// 物理ページ番号から物理ページ管理構造体を引くための2段の索引。1段目は物理ページ番号の
+// 上位ビットで引き、2段目 (1ページ分のポインタ配列) は下位PAGE_INDEX_BITSビットで引く。
+// 2段目はゾーンが存在する範囲にだけ割り当てる。
+#define PAGE_INDEX_BITS   10
+#define PAGE_INDEX_LEN    (1 << PAGE_INDEX_BITS)
+#define PAGE_INDEX_L1_LEN (1 << (32 - PFN_OFFSET - PAGE_INDEX_BITS))
+static struct page **page_index[PAGE_INDEX_L1_LEN];
+
+// 物理アドレスに対応する物理ページ管理構造体を返す。索引を引くだけなので定数時間で終わる。
 static struct page *find_page_by_paddr(paddr_t paddr,
                                        enum memory_zone_type *zone_type) {
     DEBUG_ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
 
-    LIST_FOR_EACH (zone, &zones, struct memory_zone, next) {
-        if (zone->base <= paddr
-            && paddr < zone->base + zone->num_pages * PAGE_SIZE) {
-            size_t start = (paddr - zone->base) / PAGE_SIZE;
+    size_t pfn = PADDR2PFN(paddr);
+    if (pfn >> PAGE_INDEX_BITS >= PAGE_INDEX_L1_LEN) {
+        return NULL;
+    }
 
-            if (zone_type) {
-                *zone_type = zone->type;
-            }
-            return &zone->pages[start];
+    struct page **table = page_index[pfn >> PAGE_INDEX_BITS];
+    if (!table) {
+        return NULL;
+    }
+
+    struct page *page = table[pfn & (PAGE_INDEX_LEN - 1)];
+    if (page && zone_type) {
+        *zone_type = page->zone->type;
+    }
+
+    return page;
+}
+
+// ゾーンの各物理ページを索引に登録する。
+static void index_zone(struct memory_zone *zone) {
+    size_t base_pfn = PADDR2PFN(zone->base);
+    for (size_t i = 0; i < zone->num_pages; i++) {
+        size_t pfn = base_pfn + i;
+        ASSERT(pfn >> PAGE_INDEX_BITS < PAGE_INDEX_L1_LEN);
+
+        struct page ***table = &page_index[pfn >> PAGE_INDEX_BITS];
+        if (!*table) {
+            paddr_t paddr = pm_alloc(PAGE_SIZE, NULL, PM_ALLOC_ZEROED);
+            ASSERT(paddr != 0);
+            *table = (struct page **) arch_paddr_to_vaddr(paddr);
         }
+
+        (*table)[pfn & (PAGE_INDEX_LEN - 1)] = &zone->pages[i];
     }
+}
 
-    return NULL;
+// ゾーン内のindex番目のページを先頭とする、2^order個のページからなる空きブロックを空き
+// リストに追加する。
+static void push_free_block(struct memory_zone *zone, size_t index, int order) {
+    struct page *page = &zone->pages[index];
+    page->order = order;
+    list_push_back(&zone->free_lists[order], &page->next);
+    zone->num_free_blocks[order]++;
+    zone->num_free_pages += 1 << order;
+}
+
+// 空きブロックを空きリストから取り除く。
+static void remove_free_block(struct memory_zone *zone, struct page *page) {
+    DEBUG_ASSERT(page->order >= 0);
+
+    list_remove(&page->next);
+    zone->num_free_blocks[page->order]--;
+    zone->num_free_pages -= 1 << page->order;
+    page->order = -1;
+}
+
+// ゾーン内のindex番目のページを先頭とする、2^order個のページからなるブロックを解放する。
+// 隣り合うブロック (バディ) も空いていれば、できる限り大きなブロックに結合する。
+//
+// ブロックは物理ページ番号が2^orderの倍数になる位置に置かれるので、バディの物理ページ番号は
+// order番目のビットを反転するだけで求まる。
+static void free_block(struct memory_zone *zone, size_t index, int order) {
+    size_t base_pfn = PADDR2PFN(zone->base);
+    size_t pfn = base_pfn + index;
+    while (order < PM_ORDER_MAX) {
+        size_t buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn < base_pfn
+            || buddy_pfn + (1 << order) > base_pfn + zone->num_pages) {
+            // バディがゾーンの範囲外
+            break;
+        }
+
+        struct page *buddy = &zone->pages[buddy_pfn - base_pfn];
+        if (buddy->ref_count != 0 || buddy->order != order) {
+            // バディが使用中、または分割されている
+            break;
+        }
+
+        remove_free_block(zone, buddy);
+        pfn &= ~(1 << order);
+        order++;
+    }
+
+    push_free_block(zone, pfn - base_pfn, order);
+}
+
+// 2^order個のページからなるブロックを割り当て、先頭のページのインデックスをindexに返す。
+// 必要な大きさの空きブロックがなければ、より大きな空きブロックを分割して使う。
+static bool alloc_block(struct memory_zone *zone, int order, size_t *index) {
+    for (int i = order; i <= PM_ORDER_MAX; i++) {
+        if (list_is_empty(&zone->free_lists[i])) {
+            continue;
+        }
+
+        struct page *page =
+            LIST_CONTAINER(zone->free_lists[i].next, struct page, next);
+        remove_free_block(zone, page);
+        size_t start = page - zone->pages;
+
+        // 大きすぎるブロックは半分に分割し、後ろ半分を空きリストに戻していく。
+        while (i > order) {
+            i--;
+            push_free_block(zone, start + (1 << i), i);
+        }
+
+        *index = start;
+        return true;
+    }
+
+    return false;
+}
+
+// ゾーン内のindex番目から始まるnum_pages個の連続した空きページを、物理ページ番号が
+// アラインされたできる限り大きなブロックに分けて空きリストに戻す。
+static void free_range(struct memory_zone *zone, size_t index,
+                       size_t num_pages) {
+    size_t end = index + num_pages;
+    while (index < end) {
+        size_t pfn = PADDR2PFN(zone->base) + index;
+        int order = pfn ? __builtin_ctz(pfn) : PM_ORDER_MAX;
+        order = MIN(order, PM_ORDER_MAX);
+        while (index + (1 << order) > end) {
+            order--;
+        }
+
+        free_block(zone, index, order);
+        index += 1 << order;
+    }
 }
 
 // ゾーンを追加する。
@@ -34,87 +164,343 @@ static void add_zone(struct memory_zone *zone, enum memory_zone_type type,
     zone->type = type;
     zone->base = paddr;
     zone->num_pages = num_pages;
+    zone->num_free_pages = 0;
+    for (int order = 0; order <= PM_ORDER_MAX; order++) {
+        list_init(&zone->free_lists[order]);
+        zone->num_free_blocks[order] = 0;
+    }
+
     for (size_t i = 0; i < num_pages; i++) {
+        zone->pages[i].zone = zone;
         zone->pages[i].ref_count = 0;
+        zone->pages[i].disowned = false;
+        zone->pages[i].order = -1;
+        list_elem_init(&zone->pages[i].next);
+    }
+
+    if (type == MEMORY_ZONE_FREE) {
+        free_range(zone, 0, num_pages);
     }
 
     list_elem_init(&zone->next);
     list_push_back(&zones, &zone->next);
+
+    // 索引の2段目はpm_alloc関数で割り当てるので、ゾーンをリストに追加してから登録する。
+    index_zone(zone);
+}
+
+// 物理ページ管理構造体に対応する物理アドレスを返す。
+static paddr_t page_paddr(struct page *page) {
+    return page->zone->base + (page - page->zone->pages) * PAGE_SIZE;
+}
+
+// 物理ページをゼロクリアする。ページ単位なので、ワード単位で書き込む。
+static void zero_pages(paddr_t paddr, size_t num_pages) {
+    uint32_t *p = (uint32_t *) arch_paddr_to_vaddr(paddr);
+    size_t num_words = num_pages * PAGE_SIZE / sizeof(uint32_t);
+    for (size_t i = 0; i < num_words; i++) {
+        p[i] = 0;
+    }
+}
+
+// ページを所有者タスクのページリストに追加する。ページリストはタスクごとのロックで
+// 保護されているので、zones_lockを取らずに呼べる。
+static void link_owned_page(struct task *owner, struct page *page) {
+    spin_lock(&owner->pages_lock);
+    list_push_back(&owner->pages, &page->next);
+    spin_unlock(&owner->pages_lock);
 }
 
-// start番目からnum_pages個の物理ページが空いているかどうかを返す。
-static bool is_contiguously_free(struct memory_zone *zone, size_t start,
-                                 size_t num_pages) {
+// ページを所有者タスクのページリストから外す。所有者がいなければ何もしない。
+static void unlink_owned_page(struct page *page) {
+    struct task *owner = page->owner;
+    if (owner) {
+        spin_lock(&owner->pages_lock);
+        list_remove(&page->next);
+        spin_unlock(&owner->pages_lock);
+    }
+}
+
+// 連続したnum_pages個の空きページを割り当て済みにする。どこからも参照されていない
+// ページなので、ページ管理構造体の更新にzones_lockは不要。
+static void assign_pages(struct page *pages, size_t num_pages,
+                         struct task *owner) {
     for (size_t i = 0; i < num_pages; i++) {
-        if (zone->pages[start + i].ref_count != 0) {
+        struct page *page = &pages[i];
+        DEBUG_ASSERT(page->ref_count == 0);
+        page->ref_count = 1;
+        page->owner = owner;
+        page->disowned = false;
+        list_elem_init(&page->next);
+
+        if (owner) {
+            link_owned_page(owner, page);
+        }
+    }
+}
+
+// いずれかのRAM領域のゾーンから2^order個のページからなるブロックを割り当て、先頭の
+// ページを返す。空きがなければNULLを返す。
+static struct page *alloc_from_zones(int order) {
+    LIST_FOR_EACH (zone, &zones, struct memory_zone, next) {
+        if (zone->type != MEMORY_ZONE_FREE) {
+            // MMIO領域は使えない
+            continue;
+        }
+
+        size_t start;
+        if (alloc_block(zone, order, &start)) {
+            return &zone->pages[start];
+        }
+    }
+
+    return NULL;
+}
+
+// CPUごとのキャッシュに、バディアロケータから2^PM_CACHE_REFILL_ORDER個のページをまとめて
+// 補充する。十分な大きさの空きブロックがなければ1ページだけ補充する。
+//
+// zones_lockを取るので、キャッシュのロックを解放した状態で呼ぶこと。
+static bool refill_cache(struct page_cache *cache) {
+    spin_lock(&zones_lock);
+    int order = PM_CACHE_REFILL_ORDER;
+    struct page *pages = alloc_from_zones(order);
+    if (!pages) {
+        order = 0;
+        pages = alloc_from_zones(order);
+        if (!pages) {
+            spin_unlock(&zones_lock);
             return false;
         }
     }
+    spin_unlock(&zones_lock);
+
+    // キャッシュにページを追加するのはそのCPU自身だけなので、空だったキャッシュに
+    // 補充したページが収まらないことはない。
+    spin_lock(&cache->lock);
+    for (int i = 0; i < (1 << order); i++) {
+        DEBUG_ASSERT(cache->num_dirty < PM_CACHE_MAX);
+        cache->dirty[cache->num_dirty++] = &pages[i];
+    }
+    spin_unlock(&cache->lock);
+
     return true;
 }
 
+// CPUごとのキャッシュから1ページを取り出す。ゼロクリア済みのページを取り出した場合は
+// zeroedにtrueを返す。キャッシュが空ならバディアロケータから補充し、それもできなければ
+// NULLを返す。
+//
+// キャッシュはこのCPUのロックだけで保護されているので、キャッシュにページが残っている
+// 限りzones_lockは取らない。
+static struct page *alloc_cached_page(unsigned flags, bool *zeroed) {
+    struct page_cache *cache = &page_caches[CPUVAR->id];
+    spin_lock(&cache->lock);
+    if (cache->num_dirty == 0 && cache->num_zeroed == 0) {
+        cache->misses++;
+        spin_unlock(&cache->lock);
+        if (!refill_cache(cache)) {
+            return NULL;
+        }
+
+        // 補充してからロックを取り直すまでの間に、他のCPUがdrain_page_caches関数で
+        // バディアロケータに戻している可能性がある。
+        spin_lock(&cache->lock);
+        if (cache->num_dirty == 0 && cache->num_zeroed == 0) {
+            spin_unlock(&cache->lock);
+            return NULL;
+        }
+    } else {
+        cache->hits++;
+    }
+
+    // ゼロクリアが必要ならゼロクリア済みのページを、そうでなければ中身が不定のページを
+    // 優先して使う。
+    bool use_zeroed = (flags & PM_ALLOC_ZEROED) ? cache->num_zeroed > 0
+                                                : cache->num_dirty == 0;
+    if (flags & PM_ALLOC_ZEROED) {
+        if (use_zeroed) {
+            cache->zeroed_hits++;
+        } else {
+            cache->zeroed_misses++;
+        }
+    }
+
+    *zeroed = use_zeroed;
+    struct page *page = use_zeroed ? cache->zeroed[--cache->num_zeroed]
+                                   : cache->dirty[--cache->num_dirty];
+    spin_unlock(&cache->lock);
+    return page;
+}
+
+// 全てのCPUのキャッシュにあるページをバディアロケータに戻す。大きな領域の割り当てに
+// 失敗したときに、断片化したページを結合するために使う。zones_lockを保持した状態で呼ぶこと。
+static void drain_page_caches(void) {
+    DEBUG_ASSERT(spin_is_locked(&zones_lock));
+    for (int cpu = 0; cpu < NUM_CPUS_MAX; cpu++) {
+        struct page_cache *cache = &page_caches[cpu];
+        spin_lock(&cache->lock);
+        while (cache->num_dirty > 0) {
+            struct page *page = cache->dirty[--cache->num_dirty];
+            free_block(page->zone, page - page->zone->pages, 0);
+        }
+
+        while (cache->num_zeroed > 0) {
+            struct page *page = cache->zeroed[--cache->num_zeroed];
+            free_block(page->zone, page - page->zone->pages, 0);
+        }
+        spin_unlock(&cache->lock);
+    }
+}
+
 // sizeバイトの連続した物理メモリ領域を物理ページ単位で割り当てる。ownerはその領域の
 // 所有者となるタスク。NULLを指定するとカーネルが所有者となる。
 //
+// 物理メモリはバディアロケータで管理されていて、割り当てはO(log n)で終わる。1ページだけの
+// 割り当てはCPUごとのキャッシュから行うので、多くの場合はバディアロケータにも
+// zones_lockにも触らずに済む。
+//
 // flagsには次のフラグを指定できる。
 //
 // - PM_ALLOC_ZEROED: 物理ページをゼロクリアする
-// - PM_ALLOC_ALIGNED: sizeでアラインされた物理メモリアドレスを返す
+// - PM_ALLOC_ALIGNED: sizeでアラインされた物理メモリアドレスを返す (sizeは2のべき乗)。
+//                     バディアロケータのブロックは常にその大きさでアラインされているので、
+//                     特別な処理は不要。
 paddr_t pm_alloc(size_t size, struct task *owner, unsigned flags) {
     size_t aligned_size = ALIGN_UP(size, PAGE_SIZE);  // 実際に割り当てるサイズ
     size_t num_pages = aligned_size / PAGE_SIZE;      // 割り当てる物理ページ数
-    LIST_FOR_EACH (zone, &zones, struct memory_zone, next) {
-        if (zone->type != MEMORY_ZONE_FREE) {
-            // MMIO領域は使えない
-            continue;
-        }
 
-        // 各start番目からnum_pages個の物理ページが空いているかどうかを調べる。
-        for (size_t start = 0; start < zone->num_pages; start++) {
-            paddr_t paddr = zone->base + start * PAGE_SIZE;
-            if ((flags & PM_ALLOC_ALIGNED) != 0
-                && !IS_ALIGNED(paddr, aligned_size)) {
-                // アラインメントが合わないのでスキップ
-                continue;
-            }
+    // num_pages以上の最小の2のべき乗個のページからなるブロックを割り当てる。
+    int order = 0;
+    while ((1u << order) < num_pages) {
+        order++;
+    }
 
-            if (is_contiguously_free(zone, start, num_pages)) {
-                // 空いているので各物理ページを割り当てる
-                for (size_t i = 0; i < num_pages; i++) {
-                    struct page *page = &zone->pages[start + i];
-                    page->ref_count = 1;
-                    page->owner = owner;
-                    list_elem_init(&page->next);
-
-                    if (owner) {
-                        list_push_back(&owner->pages, &page->next);
-                    }
-                }
+    if (order > PM_ORDER_MAX) {
+        WARN("pm: too large allocation (%d KiB)", aligned_size / 1024);
+        return 0;
+    }
 
-                // 必要があればゼロクリアする
-                if (flags & PM_ALLOC_ZEROED) {
-                    memset((void *) arch_paddr_to_vaddr(paddr), 0,
-                           PAGE_SIZE * num_pages);
-                }
+    // 1ページだけであれば、CPUごとのキャッシュから割り当てる。
+    if (num_pages == 1) {
+        bool zeroed;
+        struct page *page = alloc_cached_page(flags, &zeroed);
+        if (page) {
+            assign_pages(page, 1, owner);
 
-                return paddr;
+            paddr_t paddr = page_paddr(page);
+            if ((flags & PM_ALLOC_ZEROED) && !zeroed) {
+                zero_pages(paddr, 1);
             }
+
+            return paddr;
         }
     }
 
-    WARN("pm: run out of memory");
-    return 0;
+    spin_lock(&zones_lock);
+    struct page *pages = alloc_from_zones(order);
+    if (!pages) {
+        // キャッシュに持っているページを戻して、もう一度試す。
+        drain_page_caches();
+        pages = alloc_from_zones(order);
+        if (!pages) {
+            spin_unlock(&zones_lock);
+            WARN("pm: run out of memory");
+            return 0;
+        }
+    }
+
+    // 各物理ページを割り当てる
+    assign_pages(pages, num_pages, owner);
+
+    // ブロックの余った後ろ部分を空きリストに戻す。
+    struct memory_zone *zone = pages->zone;
+    size_t start = pages - zone->pages;
+    free_range(zone, start + num_pages, (1 << order) - num_pages);
+    spin_unlock(&zones_lock);
+
+    // 必要があればゼロクリアする。割り当て済みのページなので、ロックを解放してから
+    // 行う。
+    paddr_t paddr = page_paddr(pages);
+    if (flags & PM_ALLOC_ZEROED) {
+        zero_pages(paddr, num_pages);
+    }
+
+    return paddr;
+}
+
+// 参照カウントが0になった連続したページを、RAM領域のページであれば空き領域に戻す。1ページ
+// だけであれば、すぐに再利用できるようCPUごとのキャッシュに入れる。
+static void release_pages(struct memory_zone *zone, size_t index,
+                          size_t num_pages) {
+    if (num_pages == 0 || zone->type != MEMORY_ZONE_FREE) {
+        return;
+    }
+
+    if (num_pages == 1) {
+        struct page_cache *cache = &page_caches[CPUVAR->id];
+        spin_lock(&cache->lock);
+        bool cached = cache->num_dirty < PM_CACHE_MAX;
+        if (cached) {
+            cache->dirty[cache->num_dirty++] = &zone->pages[index];
+        }
+        spin_unlock(&cache->lock);
+
+        if (cached) {
+            return;
+        }
+    }
+
+    free_range(zone, index, num_pages);
+}
+
+// ゾーン内のindex番目から始まるnum_pages個の物理ページを解放する。参照カウントが0になった
+// ページが連続していれば、まとめて空きリストに戻す。
+static void free_pages(struct memory_zone *zone, size_t index,
+                       size_t num_pages) {
+    size_t run_start = index;  // 参照カウントが0になった連続したページの先頭
+    size_t run_len = 0;        // 参照カウントが0になった連続したページの数
+    for (size_t i = index; i < index + num_pages; i++) {
+        struct page *page = &zone->pages[i];
+        DEBUG_ASSERT(page->ref_count > 0);
+
+        // 参照カウントを減らす。0になるまでは余所で参照されているので注意。
+        page->ref_count--;
+        if (page->ref_count > 0) {
+            release_pages(zone, run_start, run_len);
+            run_len = 0;
+            continue;
+        }
+
+        unlink_owned_page(page);
+        if (run_len == 0) {
+            run_start = i;
+        }
+        run_len++;
+    }
+
+    release_pages(zone, run_start, run_len);
 }
 
 // 物理ページを1つ解放する。
 static void free_page(struct page *page) {
-    DEBUG_ASSERT(page->ref_count > 0);
+    free_pages(page->zone, page - page->zone->pages, 1);
+}
 
-    // 参照カウントを減らす。0になるまでは余所で参照されているので注意。
-    page->ref_count--;
+// 連続した物理メモリ領域を解放する。ゾーンごとにまとめてfree_pages関数に渡す。
+static void free_paddr_range(paddr_t paddr, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        // 物理アドレスからページ管理構造体を取得する
+        struct page *page = find_page_by_paddr(paddr + offset, NULL);
+        ASSERT(page != NULL);
 
-    if (page->ref_count == 0) {
-        list_remove(&page->next);
+        struct memory_zone *zone = page->zone;
+        size_t index = page - zone->pages;
+        size_t num_pages = MIN(ALIGN_UP(size - offset, PAGE_SIZE) / PAGE_SIZE,
+                               zone->num_pages - index);
+        free_pages(zone, index, num_pages);
+        offset += num_pages * PAGE_SIZE;
     }
 }
 
@@ -122,6 +508,7 @@ static void free_page(struct page *page) {
 // が減算されるようになる。タスクに対して物理ページを割り当てたいが、まだそのタスクの初期化が
 // 終わっていない場合に使う。
 void pm_own_page(paddr_t paddr, struct task *owner) {
+    spin_lock(&zones_lock);
     struct page *page = find_page_by_paddr(paddr, NULL);
 
     ASSERT(page != NULL);
@@ -130,33 +517,152 @@ void pm_own_page(paddr_t paddr, struct task *owner) {
     ASSERT(!list_is_linked(&page->next));
 
     page->owner = owner;
-    list_push_back(&owner->pages, &page->next);
+    link_owned_page(owner, page);
+    spin_unlock(&zones_lock);
 }
 
 // pm_alloc関数で割り当てた、連続した物理メモリ領域を解放する。
 void pm_free(paddr_t paddr, size_t size) {
     DEBUG_ASSERT(IS_ALIGNED(size, PAGE_SIZE));
 
-    // 各ページを解放する
-    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        // 物理アドレスからページ管理構造体を取得する
-        struct page *page = find_page_by_paddr(paddr + offset, NULL);
-        ASSERT(page != NULL);
-        free_page(page);
+    spin_lock(&zones_lock);
+    free_paddr_range(paddr, size);
+    spin_unlock(&zones_lock);
+}
+
+// 他のタスクにマップされているページの所有者をなくす。所有者としての参照は呼び出し元で
+// 減らすこと。最後にアンマップされたときに解放される。
+static void disown_page(struct page *page) {
+    if (page->ref_count > 1) {
+        unlink_owned_page(page);
+        page->owner = NULL;
+        page->disowned = true;
     }
 }
 
-// pm_free関数の引数にリストを指定するバージョン。
+// pm_free関数の引数にリストを指定するバージョン。タスクの終了時に、そのタスクが所有する
+// ページを手放すのに使う。
 void pm_free_by_list(list_t *pages) {
+    spin_lock(&zones_lock);
     LIST_FOR_EACH (page, pages, struct page, next) {
+        disown_page(page);
         free_page(page);
     }
+    spin_unlock(&zones_lock);
 }
 
-// ページを指定した物理アドレスにマップ (ページテーブルへの追加) する。
-error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr,
-               unsigned attrs) {
-    // 物理アドレスからページ管理構造体を取得する。
+// ownerが所有している物理メモリ領域を手放す。ユーザータスクがpm_allocシステムコールで
+// 割り当てた領域を返すときに使う。どこにもマップされていないページはすぐに解放され、
+// 他のタスクにまだマップされているページは、最後にアンマップされたときに解放される。
+error_t pm_free_owned(struct task *owner, paddr_t paddr, size_t size) {
+    if (!IS_ALIGNED(paddr, PAGE_SIZE) || !IS_ALIGNED(size, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    spin_lock(&zones_lock);
+
+    // 途中で失敗して一部のページだけが解放されるのを防ぐため、先に全てのページを確認する。
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        enum memory_zone_type zone_type;
+        struct page *page = find_page_by_paddr(paddr + offset, &zone_type);
+        if (!page || zone_type != MEMORY_ZONE_FREE || page->owner != owner
+            || page->ref_count == 0) {
+            spin_unlock(&zones_lock);
+            return ERR_INVALID_PADDR;
+        }
+    }
+
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        disown_page(find_page_by_paddr(paddr + offset, NULL));
+    }
+
+    free_paddr_range(paddr, size);
+    spin_unlock(&zones_lock);
+    return OK;
+}
+
+// アイドルタスクから呼ばれ、このCPUのゼロクリア済みページのキャッシュを補充する。一度に
+// PM_PREZERO_BATCHページまでゼロクリアし、1ページでもゼロクリアしたらtrueを返す。
+//
+// ゼロクリアしている間はカーネルロックを解放し、他のCPUのカーネル処理を止めないようにする。
+// このCPUのキャッシュはキャッシュ自身のロックで保護されているので、カーネルロックは不要。
+bool pm_prezero_pages(void) {
+    struct page_cache *cache = &page_caches[CPUVAR->id];
+    int num_zeroed = 0;
+    while (num_zeroed < PM_PREZERO_BATCH) {
+        spin_lock(&cache->lock);
+        if (cache->num_zeroed >= PM_CACHE_MAX) {
+            spin_unlock(&cache->lock);
+            break;
+        }
+
+        if (cache->num_dirty == 0) {
+            spin_unlock(&cache->lock);
+            if (!refill_cache(cache)) {
+                break;
+            }
+
+            spin_lock(&cache->lock);
+            if (cache->num_dirty == 0) {
+                // 他のCPUがdrain_page_caches関数で戻した
+                spin_unlock(&cache->lock);
+                break;
+            }
+        }
+
+        struct page *page = cache->dirty[--cache->num_dirty];
+        spin_unlock(&cache->lock);
+
+        // どのキャッシュにも入っていないページなので、ロックを解放してからゼロクリアする。
+        arch_unlock_kernel();
+        zero_pages(page_paddr(page), 1);
+        arch_lock_kernel();
+
+        spin_lock(&cache->lock);
+        cache->zeroed[cache->num_zeroed++] = page;
+        spin_unlock(&cache->lock);
+        num_zeroed++;
+    }
+
+    return num_zeroed > 0;
+}
+
+// 物理メモリの空き状況を出力する。デバッグ用なのでロックは取らない。
+void pm_dump(void) {
+    WARN("physical memory zones:");
+    LIST_FOR_EACH (zone, &zones, struct memory_zone, next) {
+        if (zone->type != MEMORY_ZONE_FREE) {
+            continue;
+        }
+
+        WARN("  %p - %p: %d/%d pages free", zone->base,
+             zone->base + zone->num_pages * PAGE_SIZE, zone->num_free_pages,
+             zone->num_pages);
+        for (int order = 0; order <= PM_ORDER_MAX; order++) {
+            if (zone->num_free_blocks[order] > 0) {
+                WARN("    order %d (%d KiB): %d blocks", order,
+                     (PAGE_SIZE << order) / 1024,
+                     zone->num_free_blocks[order]);
+            }
+        }
+    }
+
+    for (int cpu = 0; cpu < NUM_CPUS_MAX; cpu++) {
+        struct page_cache *cache = &page_caches[cpu];
+        if (cache->hits + cache->misses == 0 && cache->num_zeroed == 0) {
+            continue;
+        }
+
+        WARN("  CPU #%d cache: %d dirty, %d zeroed, hits=%u, misses=%u, "
+             "zeroed hits=%u, zeroed misses=%u",
+             cpu, cache->num_dirty, cache->num_zeroed, cache->hits,
+             cache->misses, cache->zeroed_hits, cache->zeroed_misses);
+    }
+}
+
+// 物理ページをtaskにマップしてよいか、言い換えるとその物理ページへのアクセスを許可して
+// よいかを判断する。
+static error_t check_mappable(struct task *task, paddr_t paddr) {
     enum memory_zone_type zone_type;
     struct page *page = find_page_by_paddr(paddr, &zone_type);
     if (!page) {
@@ -164,7 +670,6 @@ error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr,
         return ERR_INVALID_PADDR;
     }
 
-    // ページをマップしてよいか、言い換えるとその物理ページへのアクセスを許可してよいかを判断する
     switch (zone_type) {
         // RAM領域
         case MEMORY_ZONE_FREE:
@@ -174,11 +679,38 @@ error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr,
                 return ERR_INVALID_PADDR;
             }
 
+            // 所有者が手放したページは、taskのページャタスクか、ページャを持たないタスク
+            // (VMサーバ) 自身だけがマップできる。コピーオンライトで共有していたページを
+            // 複製するときなどに使う。
+            if (page->disowned) {
+                if (task->pager != CURRENT_TASK
+                    && (task != CURRENT_TASK || task->pager)) {
+                    WARN("%s: vm_map: paddr %p is not owned", task->name,
+                         paddr);
+                    return ERR_INVALID_PADDR;
+                }
+                break;
+            }
+
+            // カーネルの内部データ構造はマップさせない
+            if (!page->owner) {
+                WARN("%s: vm_map: paddr %p is used by the kernel", task->name,
+                     paddr);
+                return ERR_INVALID_PADDR;
+            }
+
             // 次のいずれかの条件を満たすときにページをマップできる:
             //
             // 1) taskがそのページを所有しているタスク
             // 2) taskがそのページを所有しているタスクのページャタスク
-            if (page->owner != task && page->owner->pager != task) {
+            // 3) 現在のタスクが、所有者タスクとtaskの両方のページャタスク (共有メモリ)
+            // 4) 現在のタスクが、ページを所有しているtaskのページャタスク (ページャが
+            //    自身のページを共有する。BootFS上のファイルのページなど)
+            if (page->owner != task && page->owner->pager != task
+                && (page->owner->pager != CURRENT_TASK
+                    || task->pager != CURRENT_TASK)
+                && (page->owner != CURRENT_TASK
+                    || task->pager != CURRENT_TASK)) {
                 WARN("%s: vm_map: paddr %p is not owned", task->name, paddr);
                 return ERR_INVALID_PADDR;
             }
@@ -195,31 +727,310 @@ error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr,
             break;
     }
 
-    error_t err = arch_vm_map(&task->vm, uaddr, paddr, attrs);
+    return OK;
+}
+
+// uaddrからsizeバイトの範囲を、paddrから始まる連続した物理メモリ領域にマップ (ページ
+// テーブルへの追加) する。attrsにPAGE_LARGEを指定すると、LARGE_PAGE_SIZEバイトずつの
+// メガページでマップする。
+error_t vm_map_range(struct task *task, uaddr_t uaddr, paddr_t paddr,
+                     size_t size, unsigned attrs) {
+    // 途中で失敗して一部のページだけが参照されるのを防ぐため、先に全てのページを確認する。
+    spin_lock(&zones_lock);
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        error_t err = check_mappable(task, paddr + offset);
+        if (err != OK) {
+            spin_unlock(&zones_lock);
+            return err;
+        }
+    }
+
+    // ページテーブルの割り当てでpm_alloc関数が呼ばれるので、ロックを解放してからマップする。
+    // 先に参照カウントを増やしておき、他のCPUから同じページが空き扱いされないようにする。
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        enum memory_zone_type zone_type;
+        struct page *page = find_page_by_paddr(paddr + offset, &zone_type);
+
+        // MMIO領域の場合はタスクを所有者として登録する。RAM領域の場合はpm_alloc関数で登録
+        // 済み。
+        if (zone_type == MEMORY_ZONE_MMIO && task) {
+            list_push_back(&task->pages, &page->next);
+        }
+
+        page->ref_count++;
+    }
+    spin_unlock(&zones_lock);
+
+    error_t err = arch_vm_map_range(&task->vm, uaddr, paddr, size, attrs);
+    if (err != OK) {
+        spin_lock(&zones_lock);
+        free_paddr_range(paddr, size);
+        spin_unlock(&zones_lock);
+        return err;
+    }
+
+    return OK;
+}
+
+// ページを指定した物理アドレスにマップ (ページテーブルへの追加) する。attrsにPAGE_LARGEを
+// 指定すると、LARGE_PAGE_SIZEバイトの領域を1つのページとしてマップする。
+error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr,
+               unsigned attrs) {
+    size_t size = (attrs & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    return vm_map_range(task, uaddr, paddr, size, attrs);
+}
+
+// ページ受け取り領域内のuaddrからnum_pages個 (MESSAGE_PAGES_MAX以下) のページを
+// アンマップする。
+//
+// メッセージで受け取ったページは、アンマップした時点で解放する。そうしないと、タスクが
+// 終了するまで所有者としての参照が残り続けてしまう。
+static error_t unmap_message_pages(struct task *task, uaddr_t uaddr,
+                                   size_t num_pages) {
+    DEBUG_ASSERT(num_pages <= MESSAGE_PAGES_MAX);
+
+    // アンマップすると物理アドレスが分からなくなるので、先に記録しておく
+    paddr_t paddrs[MESSAGE_PAGES_MAX];
+    for (size_t i = 0; i < num_pages; i++) {
+        paddrs[i] = arch_vm_paddr(&task->vm, uaddr + i * PAGE_SIZE, NULL);
+    }
+
+    error_t err = arch_vm_unmap_range(&task->vm, uaddr, num_pages * PAGE_SIZE);
     if (err != OK) {
         return err;
     }
 
-    // MMIO領域の場合はタスクを所有者として登録する。RAM領域の場合はpm_alloc関数で登録済み。
-    if (zone_type == MEMORY_ZONE_MMIO && task) {
-        list_push_back(&task->pages, &page->next);
+    spin_lock(&zones_lock);
+    for (size_t i = 0; i < num_pages; i++) {
+        struct page *page = find_page_by_paddr(paddrs[i], NULL);
+        if (page && page->owner == task && page->ref_count == 1) {
+            free_page(page);
+        }
     }
+    spin_unlock(&zones_lock);
 
-    page->ref_count++;
+    // 空いた仮想アドレスから次の空きを探せるようにする
+    task->message_pages_hint = MIN(task->message_pages_hint, uaddr);
     return OK;
 }
 
-// ページをアンマップ (ページテーブルからの削除) する。
+// uaddrからsizeバイトの範囲にマップされているページをアンマップ (ページテーブルからの削除)
+// する。範囲内に1つもページがマップされていなければERR_NOT_FOUNDを返す。
+error_t vm_unmap_range(struct task *task, uaddr_t uaddr, size_t size) {
+    DEBUG_ASSERT(IS_ALIGNED(uaddr, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE));
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + size - 1)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ページ受け取り領域と重なる部分は、解放するページを確認しながら少しずつアンマップし、
+    // それ以外の部分はまとめてアンマップする。
+    uaddr_t end = uaddr + size;
+    uaddr_t window_start = MAX(uaddr, MESSAGE_PAGES_BASE);
+    uaddr_t window_end = MIN(end, MESSAGE_PAGES_END);
+    bool found = false;
+    while (uaddr < end) {
+        error_t err;
+        uaddr_t next;
+        if (window_start <= uaddr && uaddr < window_end) {
+            next = MIN(window_end, uaddr + MESSAGE_PAGES_MAX * PAGE_SIZE);
+            err = unmap_message_pages(task, uaddr, (next - uaddr) / PAGE_SIZE);
+        } else {
+            next = (uaddr < window_start) ? MIN(window_start, end) : end;
+            err = arch_vm_unmap_range(&task->vm, uaddr, next - uaddr);
+        }
+
+        if (err != OK && err != ERR_NOT_FOUND) {
+            return err;
+        }
+
+        found |= err == OK;
+        uaddr = next;
+    }
+
+    return found ? OK : ERR_NOT_FOUND;
+}
+
+// ページをアンマップ (ページテーブルからの削除) する。メガページは先頭の仮想アドレスを
+// 指定したときに丸ごとアンマップする。
 error_t vm_unmap(struct task *task, uaddr_t uaddr) {
     if (!arch_is_mappable_uaddr(uaddr)) {
         return ERR_INVALID_ARG;
     }
 
-    error_t err = arch_vm_unmap(&task->vm, uaddr);
+    bool large = false;
+    arch_vm_paddr(&task->vm, uaddr, &large);
+    return vm_unmap_range(task, uaddr, large ? LARGE_PAGE_SIZE : PAGE_SIZE);
+}
+
+// srcのuaddrからsizeバイトの範囲にマップされているページを、dstの同じ仮想アドレスに
+// attrsでマップする。マップされていないページは無視し、仮想アドレスと物理アドレスの両方が
+// 連続しているページはまとめてマップする。タスクの複製 (fork) に使う。
+//
+// 途中で失敗した場合、それまでにマップしたページはdstにマップされたまま残る。
+error_t vm_share_range(struct task *src, struct task *dst, uaddr_t uaddr,
+                       size_t size, unsigned attrs) {
+    uaddr_t run_uaddr = 0;  // まとめてマップするページの先頭の仮想アドレス
+    paddr_t run_paddr = 0;  // まとめてマップするページの先頭の物理アドレス
+    size_t run_size = 0;    // まとめてマップするページの大きさ
+    for (offset_t offset = 0; offset <= size; offset += PAGE_SIZE) {
+        // 範囲の終わりに達したら、残りのページをマップする
+        paddr_t paddr = 0;
+        if (offset < size) {
+            paddr = arch_vm_paddr(&src->vm, uaddr + offset, NULL);
+            if (paddr && run_size > 0 && paddr == run_paddr + run_size) {
+                run_size += PAGE_SIZE;
+                continue;
+            }
+        }
+
+        if (run_size > 0) {
+            error_t err = vm_map_range(dst, run_uaddr, run_paddr, run_size,
+                                       attrs & ~PAGE_LARGE);
+            if (err != OK) {
+                return err;
+            }
+        }
+
+        run_uaddr = uaddr + offset;
+        run_paddr = paddr;
+        run_size = paddr ? PAGE_SIZE : 0;
+    }
+
+    return OK;
+}
+
+// taskのページ受け取り領域から、num_pages個の連続した空き仮想アドレスを探す。見つから
+// なければ0を返す。
+//
+// message_pages_hintより前は全て使用中なので、そこから探し始める。受け取ったページは
+// 大抵すぐにアンマップされるので、ほとんどの場合はヒントの位置がそのまま空いている。
+static uaddr_t find_free_pages_window(struct task *task, size_t num_pages) {
+    size_t num_free = 0;
+    for (uaddr_t uaddr = task->message_pages_hint; uaddr < MESSAGE_PAGES_END;
+         uaddr += PAGE_SIZE) {
+        if (arch_vm_paddr(&task->vm, uaddr, NULL)) {
+            num_free = 0;
+            continue;
+        }
+
+        num_free++;
+        if (num_free == num_pages) {
+            uaddr_t base = uaddr - (num_pages - 1) * PAGE_SIZE;
+            if (base == task->message_pages_hint) {
+                task->message_pages_hint = uaddr + PAGE_SIZE;
+            }
+
+            return base;
+        }
+    }
+
+    return 0;
+}
+
+// srcの仮想アドレスuaddrからlenバイト (ページ単位に切り上げる) のページを、コピーせずに
+// dstへ移す。各ページはsrcからアンマップされて所有者がdstに変わり、dstのページ受け取り
+// 領域にマップされる。dst_uaddrにはdstでの仮想アドレスが返る。
+//
+// 移せるのは、srcが所有していて、かつsrcにだけマップされているページのみ。共有メモリや
+// ページャがマップしたままのページを移すと、移した後もsrcから書き換えられてしまうため。
+// 失敗した場合は、全てのページがsrcに残る。dstはピン留め (task_pin関数) しておくこと。
+error_t vm_transfer(struct task *src, uaddr_t uaddr, size_t len,
+                    struct task *dst, uaddr_t *dst_uaddr) {
+    size_t num_pages = ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE;
+    if (!IS_ALIGNED(uaddr, PAGE_SIZE) || num_pages == 0
+        || num_pages > MESSAGE_PAGES_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 全てのページが移せるかを先に確認する。途中で失敗して一部のページだけが移るのを防ぐ。
+    paddr_t paddrs[MESSAGE_PAGES_MAX];
+    for (size_t i = 0; i < num_pages; i++) {
+        uaddr_t page_uaddr = uaddr + i * PAGE_SIZE;
+        if (!arch_is_mappable_uaddr(page_uaddr)) {
+            return ERR_INVALID_UADDR;
+        }
+
+        bool large;
+        paddr_t paddr = arch_vm_paddr(&src->vm, page_uaddr, &large);
+        if (!paddr) {
+            WARN("%s: vm_transfer: %p is not mapped", src->name, page_uaddr);
+            return ERR_INVALID_UADDR;
+        }
+
+        // 大きなページの一部だけをアンマップすることはできない。
+        if (large) {
+            WARN("%s: vm_transfer: %p is in a large page", src->name,
+                 page_uaddr);
+            return ERR_INVALID_UADDR;
+        }
+
+        spin_lock(&zones_lock);
+        enum memory_zone_type zone_type;
+        struct page *page = find_page_by_paddr(paddr, &zone_type);
+        bool movable = page && zone_type == MEMORY_ZONE_FREE
+                       && page->owner == src && page->ref_count == 2;
+        spin_unlock(&zones_lock);
+
+        if (!movable) {
+            WARN("%s: vm_transfer: %p is not exclusively owned", src->name,
+                 page_uaddr);
+            return ERR_INVALID_UADDR;
+        }
+
+        paddrs[i] = paddr;
+    }
+
+    uaddr_t base = find_free_pages_window(dst, num_pages);
+    if (!base) {
+        WARN("%s: vm_transfer: no free virtual address space", dst->name);
+        return ERR_NO_RESOURCES;
+    }
+
+    // 先にdstへマップする。ページテーブルの割り当てに失敗した場合は、dstにマップした
+    // ページをアンマップするだけで元に戻せる (srcは何も変わっていない)。参照カウントは
+    // マップする前に増やしておく。
+    //
+    // 全てのページテーブルエントリを書き込んでからTLBを一度だけフラッシュする。フラッシュ
+    // (IPIの応答待ち) の間はカーネルロックが解放されるが、dstは呼び出し元がピン留め
+    // (task_pin関数) しているので、その間に削除されることはない。
+    spin_lock(&zones_lock);
+    for (size_t i = 0; i < num_pages; i++) {
+        find_page_by_paddr(paddrs[i], NULL)->ref_count++;
+    }
+    spin_unlock(&zones_lock);
+
+    error_t err =
+        arch_vm_map_pages(&dst->vm, base, paddrs, num_pages,
+                          PAGE_USER | PAGE_READABLE | PAGE_WRITABLE);
     if (err != OK) {
+        spin_lock(&zones_lock);
+        for (size_t i = 0; i < num_pages; i++) {
+            free_paddr_range(paddrs[i], PAGE_SIZE);
+        }
+        spin_unlock(&zones_lock);
+
+        dst->message_pages_hint = MIN(dst->message_pages_hint, base);
         return err;
     }
 
+    // srcからまとめてアンマップする。参照カウントは所有者とdstでのマップの2つになる。
+    ASSERT_OK(arch_vm_unmap_range(&src->vm, uaddr, num_pages * PAGE_SIZE));
+    if (MESSAGE_PAGES_BASE <= uaddr && uaddr < MESSAGE_PAGES_END) {
+        src->message_pages_hint = MIN(src->message_pages_hint, uaddr);
+    }
+
+    // 所有者をdstに変更する。
+    spin_lock(&zones_lock);
+    for (size_t i = 0; i < num_pages; i++) {
+        struct page *page = find_page_by_paddr(paddrs[i], NULL);
+        unlink_owned_page(page);
+        page->owner = dst;
+        link_owned_page(dst, page);
+    }
+    spin_unlock(&zones_lock);
+
+    *dst_uaddr = base;
     return OK;
 }
 
@@ -254,7 +1065,7 @@ void handle_page_fault(vaddr_t vaddr, vaddr_t ip, unsigned fault) {
     m.page_fault.uaddr = vaddr;
     m.page_fault.ip = ip;
     m.page_fault.fault = fault;
-    error_t err = ipc(pager, pager->tid, (__user struct message *) &m,
+    error_t err = ipc(pager->tid, pager->tid, (__user struct message *) &m,
                       IPC_CALL | IPC_KERNEL);
 
     // ページャタスクからの応答メッセージが正しいかどうかチェックする
@@ -265,6 +1076,11 @@ void handle_page_fault(vaddr_t vaddr, vaddr_t ip, unsigned fault) {
 
 // メモリ管理システムの初期化
 void memory_init(struct bootinfo *bootinfo) {
+    spinlock_init(&zones_lock, "zones");
+    for (int cpu = 0; cpu < NUM_CPUS_MAX; cpu++) {
+        spinlock_init(&page_caches[cpu].lock, "page cache");
+    }
+
     struct memory_map *memory_map = &bootinfo->memory_map;
     for (int i = 0; i < memory_map->num_frees; i++) {
         struct memory_map_entry *e = &memory_map->frees[i];
@@ -274,8 +1090,11 @@ void memory_init(struct bootinfo *bootinfo) {
 
         struct memory_zone *zone =
             (struct memory_zone *) arch_paddr_to_vaddr(e->paddr);
-        size_t num_pages =
-            ALIGN_DOWN(e->size, PAGE_SIZE) / (PAGE_SIZE + sizeof(struct page));
+        // 先頭にゾーン管理構造体を置くので、その分 (ページ境界への切り上げを含む) を除いた
+        // 残りを物理ページとして使う。
+        size_t header_max = PAGE_SIZE + sizeof(struct memory_zone);
+        size_t num_pages = (ALIGN_DOWN(e->size, PAGE_SIZE) - header_max)
+                           / (PAGE_SIZE + sizeof(struct page));
 
         void *end_of_header = &zone->pages[num_pages + 1];
         size_t header_size = ((vaddr_t) end_of_header) - ((vaddr_t) zone);
@@ -292,8 +1111,9 @@ void memory_init(struct bootinfo *bootinfo) {
               e->size / 1024);
 
         size_t num_pages = e->size / PAGE_SIZE;
-        paddr_t zone_paddr = pm_alloc(sizeof(struct page) * num_pages, NULL,
-                                      PM_ALLOC_UNINITIALIZED);
+        size_t zone_size =
+            sizeof(struct memory_zone) + sizeof(struct page) * num_pages;
+        paddr_t zone_paddr = pm_alloc(zone_size, NULL, PM_ALLOC_UNINITIALIZED);
         ASSERT(zone_paddr != 0);
         struct memory_zone *zone =
             (struct memory_zone *) arch_paddr_to_vaddr(zone_paddr);
@@ -1,16 +1,31 @@
 #pragma once
+#include "spinlock.h"
 #include <libs/common/list.h>
 #include <libs/common/types.h>
 
+// バディアロケータで扱う空きブロックの最大次数。2^PM_ORDER_MAXページ (128MiB) まで。
+#define PM_ORDER_MAX 15
+// CPUごとのキャッシュに置く物理ページの最大数 (ゼロクリア済み・未クリアのそれぞれ)。
+#define PM_CACHE_MAX 32
+// CPUごとのキャッシュが空のときに、バディアロケータからまとめて補充するブロックの次数。
+#define PM_CACHE_REFILL_ORDER 3
+// アイドルタスクが一度にゼロクリアするページの最大数。
+#define PM_PREZERO_BATCH 4
+
 // 物理ページ管理構造体
+struct memory_zone;
 struct page {
-    struct task *owner;  // 所有者 (NULLならカーネルの内部データ構造)
-    unsigned ref_count;  // 参照カウンタ:
-                         // - 0: 空き
-                         // - 1: 割り当て済み (まだマップされていない)
-                         // - 2: マップ済み (1つのタスクでのみ使用中)
-                         // - 3以上: マップ済み (複数のタスクで使用中。つまり共有メモリ)
-    list_elem_t next;    // 所有者タスクのtask->pagesのリスト要素
+    struct memory_zone *zone;  // このページが属するゾーン
+    struct task *owner;        // 所有者 (NULLならカーネルの内部データ構造)
+    unsigned ref_count;        // 参照カウンタ:
+                               // - 0: 空き
+                               // - 1: 割り当て済み (まだマップされていない)
+                               // - 2: マップ済み (1つのタスクでのみ使用中)
+                               // - 3以上: マップ済み (複数のタスクで使用中。つまり共有メモリ)
+                               // disownedの場合は、マップしているタスクの数
+    bool disowned;             // 所有者が手放した (マップされている間だけ残っている) か
+    int order;                 // 空きブロックの先頭ページならその次数、それ以外は-1
+    list_elem_t next;          // 所有者タスクのtask->pages、または空きリストのリスト要素
 };
 
 // メモリゾーンの種類
@@ -21,11 +36,29 @@ enum memory_zone_type {
 
 // メモリゾーン管理構造体
 struct memory_zone {
-    enum memory_zone_type type;  // 種類
-    list_elem_t next;            // 各メモリゾーンを繋げたリストの要素
-    paddr_t base;                // 先頭物理アドレス
-    size_t num_pages;            // 物理ページ数
-    struct page pages[];         // 物理ページ管理構造体の配列
+    enum memory_zone_type type;                // 種類
+    list_elem_t next;                          // 各メモリゾーンを繋げたリストの要素
+    paddr_t base;                              // 先頭物理アドレス
+    size_t num_pages;                          // 物理ページ数
+    size_t num_free_pages;                     // 空きページ数
+    list_t free_lists[PM_ORDER_MAX + 1];       // 次数ごとの空きブロックのリスト
+    size_t num_free_blocks[PM_ORDER_MAX + 1];  // 次数ごとの空きブロックの数
+    struct page pages[];                       // 物理ページ管理構造体の配列
+};
+
+// CPUごとの物理ページのキャッシュ (マガジン)。1ページの割り当て・解放をバディアロケータを
+// 介さずに済ませる。キャッシュ中のページは参照カウントが0でorderが-1なので、バディアロケータ
+// からは割り当て済みに見える。
+struct page_cache {
+    spinlock_t lock;                    // このキャッシュのロック
+    struct page *dirty[PM_CACHE_MAX];   // 中身が不定のページ
+    struct page *zeroed[PM_CACHE_MAX];  // アイドル時にゼロクリアしたページ
+    int num_dirty;                      // dirtyのページ数
+    int num_zeroed;                     // zeroedのページ数
+    unsigned hits;                      // キャッシュから割り当てた回数
+    unsigned misses;                    // キャッシュが空だった回数
+    unsigned zeroed_hits;               // ゼロクリア済みのページを使えた回数
+    unsigned zeroed_misses;             // 割り当て時にゼロクリアした回数
 };
 
 struct task;
@@ -33,8 +66,18 @@ paddr_t pm_alloc(size_t size, struct task *owner, unsigned flags);
 void pm_own_page(paddr_t paddr, struct task *owner);
 void pm_free(paddr_t paddr, size_t size);
 void pm_free_by_list(list_t *pages);
+error_t pm_free_owned(struct task *owner, paddr_t paddr, size_t size);
+bool pm_prezero_pages(void);
+void pm_dump(void);
+error_t vm_map_range(struct task *task, uaddr_t uaddr, paddr_t paddr,
+                     size_t size, unsigned attrs);
 error_t vm_map(struct task *task, uaddr_t uaddr, paddr_t paddr, unsigned attrs);
+error_t vm_unmap_range(struct task *task, uaddr_t uaddr, size_t size);
 error_t vm_unmap(struct task *task, uaddr_t uaddr);
+error_t vm_share_range(struct task *src, struct task *dst, uaddr_t uaddr,
+                       size_t size, unsigned attrs);
+error_t vm_transfer(struct task *src, uaddr_t uaddr, size_t len,
+                    struct task *dst, uaddr_t *dst_uaddr);
 void handle_page_fault(uaddr_t uaddr, vaddr_t ip, unsigned fault);
 
 struct bootinfo;
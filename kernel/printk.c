@@ -1,5 +1,7 @@
 #include "printk.h"
 #include "arch.h"
+#include "memory.h"
+#include "spinlock.h"
 #include "task.h"
 #include <libs/common/list.h>
 #include <libs/common/string.h>
@@ -26,6 +28,8 @@ void handle_serial_interrupt(void) {
         // https://en.wikipedia.org/wiki/Control_character
         if (ch == 'P' - '@' /* 0x10 */) {
             task_dump();
+            pm_dump();
+            spinlock_dump();
             continue;
         }
 
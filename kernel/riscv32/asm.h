@@ -39,9 +39,11 @@
 #define SCAUSE_STORE_PAGE_FAULT   15
 
 // satpレジスタのフィールド
-#define SATP_MODE_SV32 (1u << 31)  // Sv32モード
-#define SATP_PPN_MASK  0x3fffffff
-#define SATP_PPN_SHIFT 12
+#define SATP_MODE_SV32  (1u << 31)  // Sv32モード
+#define SATP_ASID_MASK  0x1ff
+#define SATP_ASID_SHIFT 22
+#define SATP_PPN_MASK   0x3fffff
+#define SATP_PPN_SHIFT  12
 
 // Core Local Interrupt (CLINT) のメモリマップトレジスタ
 #define CLINT_PADDR 0x2000000
@@ -58,9 +60,11 @@
 // 1ミリ秒ごとにmtimeレジスタの値がどれだけ進むか。QEMUのタイマーからとった値。
 #define MTIME_PER_1MS 10000
 
+// 1ticksごとにmtimeレジスタの値がどれだけ進むか。
+#define MTIME_PER_TICK (MTIME_PER_1MS / (TICK_HZ / 1000))
+
 // mtimeレジスタの値の差からticksに変換するマクロ。
-#define MTIME_TO_TICKS(mtime_diff)                                             \
-    (((unsigned) (mtime_diff)) / (MTIME_PER_1MS / (TICK_HZ / 1000)))
+#define MTIME_TO_TICKS(mtime_diff) (((unsigned) (mtime_diff)) / MTIME_PER_TICK)
 
 // Advanced Core Local Interruptor (ACLINT) のメモリマップトレジスタ
 #define ACLINT_SSWI_PADDR 0x2f00000
@@ -241,6 +245,17 @@ static inline void asm_sfence_vma(void) {
     __asm__ __volatile__("sfence.vma zero, zero" ::: "memory");
 }
 
+// 指定したASIDの、指定した仮想アドレスのTLBエントリだけを無効化するsfence.vma命令
+static inline void asm_sfence_vma_page(vaddr_t vaddr, unsigned asid) {
+    __asm__ __volatile__("sfence.vma %0, %1" ::"r"(vaddr), "r"(asid)
+                         : "memory");
+}
+
+// 指定したASIDのTLBエントリだけを無効化するsfence.vma命令
+static inline void asm_sfence_vma_asid(unsigned asid) {
+    __asm__ __volatile__("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+
 // mret命令
 static inline void asm_mret(void) {
     __asm__ __volatile__("mret");
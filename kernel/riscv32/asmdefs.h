@@ -10,5 +10,3 @@
 #define CPUVAR_MSCRATCH0 8
 #define CPUVAR_MSCRATCH1 12
 #define CPUVAR_MTIMECMP  16
-#define CPUVAR_MTIME     20
-#define CPUVAR_INTERVAL  24
@@ -1 +1,2 @@
-objs-y += boot.o setup.o task.o vm.o mp.o switch.o handler.o trap.o usercopy.o debug.o uart.o plic.o
+objs-y += boot.o setup.o task.o vm.o mp.o switch.o handler.o trap.o usercopy.o \
+          debug.o uart.o plic.o timer.o
@@ -16,7 +16,11 @@ struct arch_task {
 
 // RISC-V特有のページテーブル管理構造体。
 struct arch_vm {
-    paddr_t table;  // ページテーブルの物理アドレス (Sv32)
+    paddr_t table;         // ページテーブルの物理アドレス (Sv32)
+    unsigned asid;         // ASID (0ならASIDを割り当てられていない)
+    uint32_t loaded_cpus;  // このページテーブルを読み込んでいるCPUのビットマップ
+    uint32_t used_cpus;    // このページテーブルを使ったことがあるCPUのビットマップ
+    uint32_t stale_cpus;   // 次に切り替えたときにTLBを無効化すべきCPUのビットマップ
 };
 
 // RISC-V特有のCPUローカル変数。順番を変える時はasmdefs.hで定義しているマクロも更新する。
@@ -25,11 +29,13 @@ struct arch_cpuvar {
     uint32_t sp_top;    // 実行中タスクのカーネルスタックの上端
 
     // タイマー割り込みハンドラ (M-mode) で使用。
-    uint32_t mscratch0;   // 変数の一時保管場所
-    uint32_t mscratch1;   // 変数の一時保管場所その2
-    paddr_t mtimecmp;     // MTIMECMPのアドレス
+    uint32_t mscratch0;  // 変数の一時保管場所
+    uint32_t mscratch1;  // 変数の一時保管場所その2
+    paddr_t mtimecmp;    // MTIMECMPのアドレス
+
+    // タイマーの管理 (timer.c) で使用。
     paddr_t mtime;        // MTIMEのアドレス
-    uint32_t interval;    // MTIMECMPに加算していく値
+    uint32_t interval;    // タイマー割り込みの間隔
     uint64_t last_mtime;  // 直前のmtimeの値
 };
 
@@ -44,11 +50,7 @@ struct arch_cpuvar {
     STATIC_ASSERT(offsetof(struct cpuvar, arch.mscratch1) == CPUVAR_MSCRATCH1, \
                   "CPUVAR_MSCRATCH1 is incorrect");                            \
     STATIC_ASSERT(offsetof(struct cpuvar, arch.mtimecmp) == CPUVAR_MTIMECMP,   \
-                  "CPUVAR_MTIMECMP is incorrect");                             \
-    STATIC_ASSERT(offsetof(struct cpuvar, arch.mtime) == CPUVAR_MTIME,         \
-                  "CPUVAR_MTIME is incorrect");                                \
-    STATIC_ASSERT(offsetof(struct cpuvar, arch.interval) == CPUVAR_INTERVAL,   \
-                  "CPUVAR_INTERVAL is incorrect");
+                  "CPUVAR_MTIMECMP is incorrect");
 
 // CPUVARマクロの中身。現在のCPUローカル変数のアドレスを返す。
 static inline struct cpuvar *arch_cpuvar_get(void) {
@@ -53,10 +53,30 @@ void mp_unlock(void) {
     // これがないとCPUやコンパイラが並び替えてしまう恐れがある。
     full_memory_barrier();
 
-    // ロックを解放
+    // ロックを解放。解放後に他のCPUが取得するまでの間、このCPUが持っていると誤認されない
+    // よう先に記録を消しておく (arch_is_kernel_locked関数)。
+    locked_cpu = -1;
     compare_and_swap(&big_lock, BKL_LOCKED, BKL_UNLOCKED);
 }
 
+// 実行中のCPUがカーネルロックを持っているかどうかを返す。システムコールの一部やIPCは
+// カーネルロックを取らずに処理するので、カーネルロックを持った状態とそうでない状態の
+// どちらからも呼ばれる関数が、必要に応じてロックを取得・解放するために使う。
+bool arch_is_kernel_locked(void) {
+    return big_lock == BKL_LOCKED && locked_cpu == CPUVAR->id;
+}
+
+// 実行中のCPUが持っているカーネルロックを一時的に解放する。アイドルタスクが時間のかかる
+// 処理を、他のCPUのカーネル処理と並行して行うときに使う。
+void arch_unlock_kernel(void) {
+    mp_unlock();
+}
+
+// arch_unlock_kernel関数で解放したカーネルロックを取り直す。
+void arch_lock_kernel(void) {
+    mp_lock();
+}
+
 // カーネルロックを強制的に取得する。カーネルパニックなど致命的なエラーが発生したときに
 // 他のCPUからロックを奪い取ってカーネルを停止するために使う。
 void mp_force_lock(void) {
@@ -66,19 +86,20 @@ void mp_force_lock(void) {
 }
 
 // 指定したCPUのCPUローカル変数を取得する
-struct cpuvar *riscv32_cpuvar_of(int hartid) {
+struct cpuvar *arch_cpuvar_of(int hartid) {
     ASSERT(hartid < NUM_CPUS_MAX);
     return &cpuvars[hartid];
 }
 
-// 他のCPUにプロセッサ間割り込み (IPI) を送信する
-void arch_send_ipi(unsigned ipi) {
-    // 自身を除いた全CPUにIPIを送信する
+// cpusのビットが立っているCPUにプロセッサ間割り込み (IPI) を送信し、処理されるまで待つ。
+void riscv32_send_ipi(uint32_t cpus, unsigned ipi) {
+    // 自身を除いた指定のCPUにIPIを送信する
+    cpus &= ~(1u << CPUVAR->id);
     for (int hartid = 0; hartid < NUM_CPUS_MAX; hartid++) {
-        struct cpuvar *cpuvar = riscv32_cpuvar_of(hartid);
+        struct cpuvar *cpuvar = arch_cpuvar_of(hartid);
 
-        // 起動が完了しているCPUかつ自身以外かチェック
-        if (cpuvar->online && hartid != CPUVAR->id) {
+        // 起動が完了しているCPUかつ宛先に含まれているかチェック
+        if (cpuvar->online && (cpus & (1u << hartid))) {
             // IPIの送信理由を宛先CPUのローカル変数に記録する (アトミックな |= 演算)
             atomic_fetch_and_or(&cpuvar->ipi_pending, ipi);
 
@@ -87,12 +108,16 @@ void arch_send_ipi(unsigned ipi) {
         }
     }
 
-    // 各CPUがIPIを処理するまで待つ
+    // 各CPUがIPIを処理するまで待つ。カーネルロックを持たずに呼ばれることもある
+    // (IPCでのページの受け渡しなど)。
+    bool locked = arch_is_kernel_locked();
     for (int hartid = 0; hartid < NUM_CPUS_MAX; hartid++) {
-        struct cpuvar *cpuvar = riscv32_cpuvar_of(hartid);
-        if (cpuvar->online && hartid != CPUVAR->id) {
+        struct cpuvar *cpuvar = arch_cpuvar_of(hartid);
+        if (cpuvar->online && (cpus & (1u << hartid))) {
             // 一旦カーネルロックを解放して他のCPUがカーネルに入れるようにする
-            mp_unlock();
+            if (locked) {
+                mp_unlock();
+            }
 
             // CPUがIPIを処理するまで待つ
             unsigned pending;
@@ -101,11 +126,31 @@ void arch_send_ipi(unsigned ipi) {
             } while (pending != 0);
 
             // カーネルロックを再取得
-            mp_lock();
+            if (locked) {
+                mp_lock();
+            }
         }
     }
 }
 
+// 自身を除いた全てのCPUにプロセッサ間割り込み (IPI) を送信する
+void arch_send_ipi(unsigned ipi) {
+    riscv32_send_ipi(0xffffffff, ipi);
+}
+
+// 指定したCPUにタスク切り替えを促すIPIを送信する。arch_send_ipi関数とは異なり、宛先の
+// CPUがIPIを処理するのを待たない。ランキューに新しくタスクを追加したときに、アイドル状態の
+// CPUを起こすために使う。
+void arch_kick_cpu(int cpu) {
+    struct cpuvar *cpuvar = arch_cpuvar_of(cpu);
+    if (!cpuvar->online || cpu == CPUVAR->id) {
+        return;
+    }
+
+    atomic_fetch_and_or(&cpuvar->ipi_pending, IPI_RESCHEDULE);
+    write_setssip(cpu);
+}
+
 // 各CPUの初期化処理
 void riscv32_mp_init_percpu(void) {
     CPUVAR->online = true;
@@ -9,7 +9,7 @@ int mp_self(void);
 void mp_lock(void);
 void mp_force_lock(void);
 void mp_unlock(void);
-struct cpuvar *riscv32_cpuvar_of(int hartid);
 void mp_send_ipi(void);
+void riscv32_send_ipi(uint32_t cpus, unsigned ipi);
 __noreturn void halt(void);
 void riscv32_mp_init_percpu(void);
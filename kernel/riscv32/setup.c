@@ -3,6 +3,7 @@
 #include "handler.h"
 #include "mp.h"
 #include "plic.h"
+#include "timer.h"
 #include "trap.h"
 #include "uart.h"
 #include "vm.h"
@@ -103,13 +104,12 @@ __noreturn void riscv32_boot(void) {
     write_pmpcfg0(0xf);
 
     // CPUローカル変数を初期化する。
-    struct cpuvar *cpuvar = riscv32_cpuvar_of(hartid);
+    struct cpuvar *cpuvar = arch_cpuvar_of(hartid);
     memset(cpuvar, 0, sizeof(struct cpuvar));
     cpuvar->magic = CPUVAR_MAGIC;
     cpuvar->online = false;  // まだブート中
     cpuvar->id = hartid;
     cpuvar->ipi_pending = 0;
-    cpuvar->arch.interval = MTIME_PER_1MS;
     cpuvar->arch.mtimecmp = CLINT_MTIMECMP(hartid);
     cpuvar->arch.mtime = CLINT_MTIME;
 
@@ -120,7 +120,7 @@ __noreturn void riscv32_boot(void) {
     write_tp((uint32_t) cpuvar);
 
     // タイマーを設定するが、まだ割り込みが来て欲しくないので十分長い時間を設定する。
-    *MTIMECMP = 0xffffffff;
+    *MTIMECMP = 0xffffffffffffffffULL;
 
     // S-modeの割り込みハンドラと、例外ハンドラで使われるカーネルスタックを設定する。
     //
@@ -179,9 +179,7 @@ void arch_init_percpu(void) {
     riscv32_mp_init_percpu();
 
     // タイマー割り込みを設定する。
-    uint32_t last_mtime = *MTIME;
-    *MTIMECMP = last_mtime + CPUVAR->arch.interval;
-    CPUVAR->arch.last_mtime = last_mtime;
+    riscv32_timer_init_percpu();
 
     if (CPUVAR->id == 0) {
         hart0_ready = true;
@@ -189,8 +187,13 @@ void arch_init_percpu(void) {
     }
 }
 
-// アイドルタスクのメイン処理。割り込みが来るまでCPUを休ませる。
-void arch_idle(void) {
+// アイドルタスクのメイン処理。割り込みが来るまでCPUを休ませる。ticksが0でなければ、
+// 遅くともticks後にはタイマー割り込みで起床する。
+void arch_idle(unsigned ticks) {
+    // 周期的なタイマー割り込みを止めて、必要な時刻にだけ割り込みが来るようにする。
+    // タスクの実行を再開するときにarch_task_switch関数で元に戻す。
+    riscv32_timer_idle(ticks);
+
     // 割り込みハンドラが自身でカーネルロックをとっているので、ここではロックを解除する
     mp_unlock();
 
@@ -2,6 +2,8 @@
 #include "debug.h"
 #include "mp.h"
 #include "switch.h"
+#include "timer.h"
+#include "vm.h"
 #include <kernel/arch.h>
 #include <kernel/hinavm.h>
 #include <kernel/memory.h>
@@ -10,8 +12,8 @@
 
 // ユーザータスクへの最初のコンテキストスイッチ時に呼び出される関数
 __noreturn void riscv32_user_entry(uint32_t ip) {
-    mp_unlock();     // ユーザーモードへ入るのでカーネルロックを解放する
-    write_sepc(ip);  // ユーザータスクの実行開始アドレスを設定
+    task_switch_finish();  // 切り替え元のタスクの後始末
+    write_sepc(ip);        // ユーザータスクの実行開始アドレスを設定
 
     // sret命令が復元すべき状態を設定する
     uint32_t sstatus = read_sstatus();
@@ -65,13 +67,11 @@ void arch_task_switch(struct task *prev, struct task *next) {
     // カーネルスタックが必要。
     CPUVAR->arch.sp_top = next->arch.sp_top;
 
-    // ページテーブルを切り替えてTLBをフラッシュする。satpレジスタに書き込む前に一度
-    // sfence.vma命令を実行しているのは、ここ以前に行ったページテーブルへの変更が
-    // 完了するのを保証するため。
-    // (The RISC-V Instruction Set Manual Volume II, Version 1.10, p. 58)
-    asm_sfence_vma();
-    write_satp(SATP_MODE_SV32 | next->vm.table >> SATP_PPN_SHIFT);
-    asm_sfence_vma();
+    // アイドル状態の間止めていた周期的なタイマー割り込みを再開する。
+    riscv32_timer_resume();
+
+    // ページテーブルを切り替える。
+    riscv32_vm_switch(&prev->vm, &next->vm);
 
     // レジスタを切り替えて次のタスク (next) に実行を移す。このタスク (prev) は
     // 実行コンテキストが保存され、再度続行されるときはこの関数から帰ってきたように
@@ -0,0 +1,114 @@
+// タイマー (CLINTのmtime/mtimecmpレジスタ) の管理
+//
+// M-modeのタイマー割り込みハンドラ (riscv32_timer_handler) はmtimecmpを無効な値にして
+// S-modeにソフトウェア割り込みを送るだけで、次の割り込み時刻はS-modeのこのファイルで設定
+// する。タスクを実行している間は1ticksごとに割り込みを発生させ、アイドル状態の間は次の
+// タイマーの期限まで割り込みを止める (tickless idle)。
+#include "timer.h"
+#include "asm.h"
+#include <kernel/arch.h>
+#include <kernel/interrupt.h>
+
+// riscv32_timer_handlerがタイマー割り込みを止めたときのmtimecmpの値。
+#define MTIMECMP_DISARMED 0xffffffffffffffffULL
+
+// アイドル状態で眠る最大時間 (60秒)。経過時間をticksに変換する際に32ビットの範囲に
+// 収まるようにするための上限。
+#define IDLE_MTIME_MAX (MTIME_PER_TICK * TICK_HZ * 60)
+
+// uptime_ticksに反映済みの時刻 (mtimeの値)。全CPUで共有する。
+static uint64_t uptime_mtime = 0;
+// uptime_mtimeのロック。各CPUのタイマー割り込みがカーネルロックを取らずに更新する。
+static spinlock_t uptime_lock;
+
+// mtimeレジスタの値を読み込む。32ビットCPUでは上位・下位32ビットを別々に読むので、
+// 読み込み途中で上位32ビットが繰り上がっていないかを確認する。
+uint64_t riscv32_timer_read(void) {
+    volatile uint32_t *mtime = (volatile uint32_t *) MTIME;
+    uint32_t hi, lo;
+    do {
+        hi = mtime[1];
+        lo = mtime[0];
+    } while (hi != mtime[1]);
+
+    return ((uint64_t) hi << 32) | lo;
+}
+
+// 指定した時刻 (mtimeの値) にタイマー割り込みが発生するように設定する。
+static void timer_arm_at(uint64_t deadline) {
+    // 書き換え途中の値で割り込みが発生しないように、まず上位32ビットを最大値にしておく。
+    // (The RISC-V Instruction Set Manual Volume II, Machine Timer Registers)
+    volatile uint32_t *mtimecmp = (volatile uint32_t *) MTIMECMP;
+    mtimecmp[1] = 0xffffffff;
+    mtimecmp[0] = deadline & 0xffffffff;
+    mtimecmp[1] = deadline >> 32;
+}
+
+// タイマー割り込みが発生していたら、次のタイマー割り込みを設定する。ソフトウェア割り込み
+// ハンドラの最初に呼ぶこと。タスク切り替えが先に起きると、割り込みが止まったままになる。
+void riscv32_timer_rearm(void) {
+    if (*MTIMECMP == MTIMECMP_DISARMED) {
+        timer_arm_at(riscv32_timer_read() + CPUVAR->arch.interval);
+    }
+}
+
+// 経過時間を反映する。
+void riscv32_timer_update(void) {
+    uint64_t now = riscv32_timer_read();
+
+    // 全CPU共通の経過時間を更新する。1ticks未満の端数は次回に持ち越す。
+    spin_lock(&uptime_lock);
+    unsigned elapsed = MTIME_TO_TICKS(now - uptime_mtime);
+    if (elapsed > 0) {
+        uptime_mtime += (uint64_t) elapsed * MTIME_PER_TICK;
+        timer_advance(elapsed);
+    }
+
+    spin_unlock(&uptime_lock);
+
+    // このCPUで実行中のタスクの残り実行可能時間を更新する。
+    unsigned ticks = MTIME_TO_TICKS(now - CPUVAR->arch.last_mtime);
+    CPUVAR->arch.last_mtime = now;
+    if (ticks > 0) {
+        handle_timer_interrupt(ticks);
+    }
+}
+
+// アイドル状態に入る前に、周期的なタイマー割り込みを止めてticks後に一度だけ割り込みが
+// 発生するようにする。ticksが0の場合はタイマー割り込みを必要としない。
+void riscv32_timer_idle(unsigned ticks) {
+    CPUVAR->arch.interval = IDLE_MTIME_MAX;
+
+    uint64_t deadline = riscv32_timer_read() + IDLE_MTIME_MAX;
+    if (ticks > 0) {
+        // uptime_mtimeはuptime_ticksと対応しているので、経過時間の反映が遅れていても
+        // 期限の時刻を正しく計算できる。
+        spin_lock(&uptime_lock);
+        deadline =
+            MIN(deadline, uptime_mtime + (uint64_t) ticks * MTIME_PER_TICK);
+        spin_unlock(&uptime_lock);
+    }
+
+    timer_arm_at(deadline);
+}
+
+// アイドル状態から抜けてタスクを実行する前に、周期的なタイマー割り込みを再開する。
+void riscv32_timer_resume(void) {
+    if (CPUVAR->arch.interval != MTIME_PER_TICK) {
+        CPUVAR->arch.interval = MTIME_PER_TICK;
+        timer_arm_at(riscv32_timer_read() + MTIME_PER_TICK);
+    }
+}
+
+// 各CPUのタイマーの初期化処理。
+void riscv32_timer_init_percpu(void) {
+    uint64_t now = riscv32_timer_read();
+    if (CPUVAR->id == 0) {
+        spinlock_init(&uptime_lock, "uptime");
+        uptime_mtime = now;
+    }
+
+    CPUVAR->arch.interval = MTIME_PER_TICK;
+    CPUVAR->arch.last_mtime = now;
+    timer_arm_at(now + MTIME_PER_TICK);
+}
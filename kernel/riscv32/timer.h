@@ -0,0 +1,9 @@
+#pragma once
+#include <libs/common/types.h>
+
+uint64_t riscv32_timer_read(void);
+void riscv32_timer_rearm(void);
+void riscv32_timer_update(void);
+void riscv32_timer_idle(unsigned ticks);
+void riscv32_timer_resume(void);
+void riscv32_timer_init_percpu(void);
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "mp.h"
 #include "plic.h"
+#include "timer.h"
 #include "uart.h"
 #include "usercopy.h"
 #include "vm.h"
@@ -27,6 +28,10 @@ static void handle_syscall_trap(struct riscv32_trap_frame *frame) {
 static void handle_soft_interrupt_trap(void) {
     write_sip(read_sip() & ~SIP_SSIP);  // SSIPビットをクリア
 
+    // タイマー割り込みであれば次のタイマー割り込みを設定する。IPIの処理でタスクを切り替える
+    // 前に設定しておく必要がある。
+    riscv32_timer_rearm();
+
     // 処理すべきIPIがなくなるまで処理
     while (true) {
         // 処理すべきIPIを取得する。ipi_pending = ipi_pending & 0 と同じ。
@@ -47,12 +52,7 @@ static void handle_soft_interrupt_trap(void) {
     }
 
     // タイマーが進んでいたら、タイマー割り込みハンドラを呼び出す
-    unsigned now = *MTIME;
-    unsigned ticks = MTIME_TO_TICKS(now - CPUVAR->arch.last_mtime);
-    CPUVAR->arch.last_mtime = now;
-    if (ticks > 0) {
-        handle_timer_interrupt(ticks);
-    }
+    riscv32_timer_update();
 }
 
 // ハードウェア割り込み
@@ -109,8 +109,8 @@ static void handle_page_fault_trap(struct riscv32_trap_frame *frame) {
         // ユーザーポインタ上でのコピー中にページフォルトが発生した場合は、
         // ユーザーモードで発生したもの (PAGE_FAULT_USER) として処理する。
         //
-        // このケースではカーネルロックを既に持っているため、ロックをここで取得する
-        // (mp_lock関数を呼び出す) 必要はない。
+        // 元のシステムコールがカーネルロックを持っているかどうかに関わらず、そのまま
+        // 処理できる (ページャタスクとのIPCはカーネルロックを必要としない)。
         reason |= PAGE_FAULT_USER;
         handle_page_fault(vaddr, sepc, reason);
     } else {
@@ -121,10 +121,8 @@ static void handle_page_fault_trap(struct riscv32_trap_frame *frame) {
         }
 
         // ユーザーモードでのページフォルトはページャタスクを呼び出す。ページャタスクがマップ
-        // するまでブロックするので注意。
-        mp_lock();
+        // するまでブロックするので注意。IPCだけなのでカーネルロックは取らない。
         handle_page_fault(vaddr, sepc, reason);
-        mp_unlock();
     }
 }
 
@@ -135,20 +133,20 @@ void riscv32_handle_trap(struct riscv32_trap_frame *frame) {
     //
     //  注意: カーネルロックの取得・解放 (mp_lock/mp_unlock 関数) を忘れないこと
     //
+    //  システムコールはhandle_syscall関数が必要な場合にだけカーネルロックを取る。IPCと
+    //  タスク切り替え (ソフトウェア割り込み) はタスクごとのロックとランキューのロックで
+    //  保護されているので、カーネルロックを取らずに処理する。
+    //
 
     uint32_t scause = read_scause();  // 割り込みの原因を取得
     switch (scause) {
         // システムコール
         case SCAUSE_ENV_CALL:
-            mp_lock();
             handle_syscall_trap(frame);
-            mp_unlock();
             break;
         // ソフトウェア割り込み
         case SCAUSE_S_SOFT_INTR:
-            mp_lock();
             handle_soft_interrupt_trap();
-            mp_unlock();
             break;
         // 外部割り込み
         case SCAUSE_S_EXT_INTR:
@@ -172,7 +170,6 @@ void riscv32_handle_trap(struct riscv32_trap_frame *frame) {
         case SCAUSE_STORE_ACCESS_FAULT:
             WARN("%s: invalid exception: scause=%d, stval=%p",
                  CURRENT_TASK->name, read_scause(), read_stval());
-            mp_lock();
             task_exit(EXP_ILLEGAL_EXCEPTION);
         default:
             PANIC("unknown trap: scause=%p, stval=%p", read_scause(),
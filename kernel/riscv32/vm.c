@@ -6,11 +6,73 @@
 #include <kernel/arch.h>
 #include <kernel/memory.h>
 #include <kernel/printk.h>
+#include <kernel/spinlock.h>
 #include <libs/common/string.h>
 
+// arch_vm_unmap_range関数で、TLBをフラッシュするまで解放を遅らせる領域の最大数。
+#define UNMAP_RUNS_MAX 16
+// 変更した範囲のページごとにTLBを無効化するページ数の上限。これより大きな範囲の場合は、
+// ASID全体を無効化する。
+#define TLB_FLUSH_PAGES_MAX 16
+
 // カーネルメモリ領域がマップされたページテーブル。起動時に生成され、各タスクの作成時にこの
-// ページテーブルの内容がコピーされる。
+// ページテーブルの1段目のエントリがコピーされる。
+//
+// カーネルが使う仮想アドレス範囲の2段目のテーブルは起動時に全て用意しておき、全てのページ
+// テーブルで共有する。そのため1段目のエントリは起動後に変わらず、2段目のテーブルへの変更は
+// 全てのタスクに反映される。
 static struct arch_vm kernel_vm;
+// kernel_vmの1段目のテーブルのうち、設定されているエントリのインデックスの一覧。
+static uint16_t kernel_l1_indices[1024];
+static int num_kernel_l1_indices;
+
+// ASID (アドレス空間ID) の割り当て状況。ASIDを付けてsatpレジスタに書き込むと、TLBのエントリ
+// がASIDで区別されるので、ページテーブルを切り替えるたびにTLBをフラッシュせずに済む。
+//
+// 0番はASIDを割り当てられなかったページテーブルが共有して使い、切り替えのたびにTLBを
+// フラッシュする。
+static bool asid_used[SATP_ASID_MASK + 1];
+static unsigned asid_max;   // 使えるASIDの最大値 (0ならASIDに非対応)
+static unsigned asid_next;  // 次に割り当てを試みるASID
+static spinlock_t asid_lock;
+
+// ASIDを割り当てる。空きがなければ0を返す。
+static unsigned alloc_asid(void) {
+    spin_lock(&asid_lock);
+    for (unsigned i = 0; i < asid_max; i++) {
+        unsigned asid = 1 + (asid_next + i) % asid_max;
+        if (!asid_used[asid]) {
+            asid_used[asid] = true;
+            asid_next = asid;
+            spin_unlock(&asid_lock);
+            return asid;
+        }
+    }
+
+    spin_unlock(&asid_lock);
+    return 0;
+}
+
+// ASIDを解放する。再利用されたときに古いTLBのエントリが使われないよう、全てのCPUで
+// フラッシュしておく。
+static void free_asid(unsigned asid) {
+    if (!asid) {
+        return;
+    }
+
+    asm_sfence_vma_asid(asid);
+    arch_send_ipi(IPI_TLB_FLUSH);
+
+    spin_lock(&asid_lock);
+    asid_used[asid] = false;
+    spin_unlock(&asid_lock);
+}
+
+// 仮想アドレスがカーネルと共有している2段目のテーブルの範囲にあるかを返す。
+static bool is_kernel_shared(struct arch_vm *vm, vaddr_t vaddr) {
+    pte_t *kernel_l1table = (pte_t *) arch_paddr_to_vaddr(kernel_vm.table);
+    return vm != &kernel_vm && kernel_l1table[PTE_INDEX(1, vaddr)] != 0;
+}
 
 // PAGE_* マクロで指定したページ属性をSv32のそれに変換する。
 static pte_t page_attrs_to_pte_flags(unsigned attrs) {
@@ -30,12 +92,23 @@ static pte_t construct_pte(paddr_t paddr, pte_t flags) {
 // vaddrは探索対象の仮想アドレス、allocがtrueの場合はページテーブルが設定されていない場合に
 // 新たに割り当てる。
 //
-// 成功時に引数pteにページテーブルエントリのアドレスを返す。
-static error_t walk(paddr_t base, vaddr_t vaddr, bool alloc, pte_t **pte) {
+// 成功時に引数pteにページテーブルエントリのアドレスを返す。1段目のエントリがメガページを
+// 指している場合は1段目のエントリを返し、largeにtrueを設定する (largeはNULLでもよい)。
+static error_t walk(paddr_t base, vaddr_t vaddr, bool alloc, pte_t **pte,
+                    bool *large) {
     ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
 
     pte_t *l1table = (pte_t *) arch_paddr_to_vaddr(base);  // 1段目のテーブル
     int index = PTE_INDEX(1, vaddr);                       // 1段目のインデックス
+    if (PTE_IS_LEAF(l1table[index])) {
+        // メガページ
+        *pte = &l1table[index];
+        if (large) {
+            *large = true;
+        }
+        return OK;
+    }
+
     if (l1table[index] == 0) {
         // 2段目のテーブルが設定されていなかった
         if (!alloc) {
@@ -55,71 +128,443 @@ static error_t walk(paddr_t base, vaddr_t vaddr, bool alloc, pte_t **pte) {
     pte_t *l2table = (pte_t *) arch_paddr_to_vaddr(PTE_PADDR(l1table[index]));
     // vaddrのページテーブルエントリへのポインタ
     *pte = &l2table[PTE_INDEX(0, vaddr)];
+    if (large) {
+        *large = false;
+    }
+    return OK;
+}
+
+// まだ解放していない、物理アドレスが連続した領域。
+struct free_run {
+    paddr_t start;
+    size_t size;
+};
+
+// 解放する領域を追加する。直前の領域と物理アドレスが連続していなければ、それまでの領域を
+// 解放する。
+static void free_run_add(struct free_run *run, paddr_t paddr, size_t size) {
+    if (run->size > 0 && paddr != run->start + run->size) {
+        pm_free(run->start, run->size);
+        run->size = 0;
+    }
+
+    if (run->size == 0) {
+        run->start = paddr;
+    }
+    run->size += size;
+}
+
+// ページテーブルの変更をTLBに反映する (TLB shootdown)。vaddrからsizeバイトの範囲を変更した
+// ときに呼ぶ。
+//
+// このCPUでは、ASIDがあればそのASIDの変更した範囲だけを無効化する。他のCPUについては、この
+// ページテーブルを読み込んでいるCPUにだけIPIを送る。以前にこのページテーブルを使ったことが
+// あるCPUには、次に切り替えたときにそのASIDのエントリを無効化させる。
+static void flush_tlb(struct arch_vm *vm, vaddr_t vaddr, size_t size) {
+    if (vm == &kernel_vm) {
+        // カーネルのページはグローバルなので、全てのCPUでフラッシュする
+        asm_sfence_vma();
+        arch_send_ipi(IPI_TLB_FLUSH);
+        return;
+    }
+
+    if (!vm->asid) {
+        asm_sfence_vma();
+    } else if (size <= TLB_FLUSH_PAGES_MAX * PAGE_SIZE) {
+        for (offset_t offset = 0; offset < size; offset += PAGE_SIZE) {
+            asm_sfence_vma_page(vaddr + offset, vm->asid);
+        }
+    } else {
+        asm_sfence_vma_asid(vm->asid);
+    }
+
+    uint32_t self = 1u << CPUVAR->id;
+    uint32_t loaded = atomic_load(&vm->loaded_cpus) & ~self;
+    if (vm->asid) {
+        uint32_t used = atomic_load(&vm->used_cpus) & ~loaded & ~self;
+        atomic_fetch_and_or(&vm->stale_cpus, used);
+    }
+
+    if (loaded) {
+        riscv32_send_ipi(loaded, IPI_TLB_FLUSH);
+    }
+}
+
+// vaddrから始まり、1段目のエントリ1つが指す範囲 (LARGE_PAGE_SIZE) の終わりまでのバイト数を
+// 返す。sizeより大きい場合はsizeを返す。
+static size_t table_remaining(vaddr_t vaddr, size_t size) {
+    vaddr_t end = ALIGN_DOWN(vaddr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+    return MIN(size, end - vaddr);
+}
+
+// vaddrからsizeバイトの範囲のうち、同じ2段目のテーブルに収まる先頭部分 (PAGE_LARGEの場合は
+// メガページ1つ) をマップする。テーブルは一度だけ引く。TLBのフラッシュは呼び出し元で行う。
+//
+// マップできたバイト数をmappedに返す。失敗した場合もそれまでにマップした分を返す。
+static error_t map_in_table(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
+                            size_t size, unsigned attrs, size_t *mapped) {
+    *mapped = 0;
+
+    // カーネルと共有している2段目のテーブルは書き換えさせない
+    if (is_kernel_shared(vm, vaddr)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    // ページテーブルエントリを探す。メガページは1段目のテーブルに直接設定するので、2段目の
+    // テーブルが既にある場合もマップ済みとして扱う。
+    pte_t *pte;
+    size_t page_size;
+    size_t num_ptes;
+    if (attrs & PAGE_LARGE) {
+        DEBUG_ASSERT(IS_ALIGNED(vaddr, LARGE_PAGE_SIZE));
+        DEBUG_ASSERT(IS_ALIGNED(paddr, LARGE_PAGE_SIZE));
+
+        pte_t *l1table = (pte_t *) arch_paddr_to_vaddr(vm->table);
+        pte = &l1table[PTE_INDEX(1, vaddr)];
+        if (*pte != 0) {
+            return ERR_ALREADY_EXISTS;
+        }
+
+        page_size = LARGE_PAGE_SIZE;
+        num_ptes = 1;
+    } else {
+        bool large;
+        error_t err = walk(vm->table, vaddr, true, &pte, &large);
+        if (err != OK) {
+            return err;
+        }
+
+        if (large) {
+            return ERR_ALREADY_EXISTS;
+        }
+
+        // 2段目のテーブル内のエントリは仮想アドレス順に並んでいる
+        page_size = PAGE_SIZE;
+        num_ptes = table_remaining(vaddr, size) / PAGE_SIZE;
+    }
+
+    // ページテーブルエントリを設定する。カーネルのページは全てのASIDで共通なので、
+    // グローバルなページとしてマップする。
+    pte_t flags = page_attrs_to_pte_flags(attrs) | PTE_V;
+    if (vm == &kernel_vm) {
+        flags |= PTE_G;
+    }
+
+    for (size_t i = 0; i < num_ptes; i++) {
+        // 既にページがマップされていたら中断する
+        if (pte[i] & PTE_V) {
+            return ERR_ALREADY_EXISTS;
+        }
+
+        pte[i] = construct_pte(paddr + i * page_size, flags);
+        *mapped += page_size;
+    }
+
+    return OK;
+}
+
+// vaddrからsizeバイトの範囲のページテーブルエントリを消す。物理ページの解放とTLBの
+// フラッシュは呼び出し元で行う。
+static void clear_range(struct arch_vm *vm, vaddr_t vaddr, size_t size) {
+    offset_t offset = 0;
+    while (offset < size) {
+        size_t len = table_remaining(vaddr + offset, size - offset);
+        pte_t *pte;
+        bool large;
+        if (walk(vm->table, vaddr + offset, false, &pte, &large) == OK) {
+            size_t num_ptes = large ? 1 : len / PAGE_SIZE;
+            for (size_t i = 0; i < num_ptes; i++) {
+                pte[i] = 0;
+            }
+        }
+
+        offset += len;
+    }
+}
+
+// vaddrからsizeバイトの仮想アドレス範囲を、paddrから始まる連続した物理メモリ領域にマップ
+// する。ページテーブルは2段目のテーブルごとに一度だけ引き、TLBのフラッシュは最後に一度
+// だけ行う。attrsにPAGE_LARGEを指定した場合は、LARGE_PAGE_SIZE単位でマップする。
+//
+// 途中で失敗した場合は、それまでにマップしたページを元に戻す。
+error_t arch_vm_map_range(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
+                          size_t size, unsigned attrs) {
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
+    DEBUG_ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
+    DEBUG_ASSERT(IS_ALIGNED(
+        size, (attrs & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE));
+
+    offset_t offset = 0;
+    while (offset < size) {
+        size_t mapped;
+        error_t err = map_in_table(vm, vaddr + offset, paddr + offset,
+                                   size - offset, attrs, &mapped);
+        offset += mapped;
+        if (err != OK) {
+            // マップしたページを元に戻す。物理ページの参照カウントは呼び出し元で戻す。
+            clear_range(vm, vaddr, offset);
+            flush_tlb(vm, vaddr, offset);
+            return err;
+        }
+    }
+
+    flush_tlb(vm, vaddr, size);
+    return OK;
+}
+
+// vaddrから始まるnum_pages個の連続した仮想ページに、paddrsの各物理ページをマップする。
+// arch_vm_map_range関数と異なり、物理ページは連続していなくてよい。全てのページテーブル
+// エントリを書き込んでから、TLBのフラッシュを最後に一度だけ行う。
+//
+// 途中で失敗した場合は、それまでにマップしたページを元に戻す。
+error_t arch_vm_map_pages(struct arch_vm *vm, vaddr_t vaddr,
+                          const paddr_t *paddrs, size_t num_pages,
+                          unsigned attrs) {
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
+    DEBUG_ASSERT((attrs & PAGE_LARGE) == 0);
+
+    for (size_t i = 0; i < num_pages; i++) {
+        DEBUG_ASSERT(IS_ALIGNED(paddrs[i], PAGE_SIZE));
+
+        size_t mapped;
+        error_t err = map_in_table(vm, vaddr + i * PAGE_SIZE, paddrs[i],
+                                   PAGE_SIZE, attrs, &mapped);
+        if (err != OK) {
+            // マップしたページを元に戻す。物理ページの参照カウントは呼び出し元で戻す。
+            size_t size = i * PAGE_SIZE + mapped;
+            clear_range(vm, vaddr, size);
+            flush_tlb(vm, vaddr, size);
+            return err;
+        }
+    }
+
+    flush_tlb(vm, vaddr, num_pages * PAGE_SIZE);
     return OK;
 }
 
 // ページをマップする。
 error_t arch_vm_map(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
                     unsigned attrs) {
+    size_t size = (attrs & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    return arch_vm_map_range(vm, vaddr, paddr, size, attrs);
+}
+
+// vaddrからsizeバイトの範囲のページテーブルエントリを書き換えてよいかを確認する。範囲内に
+// 1つもページがマップされていなければERR_NOT_FOUNDを返す。メガページは丸ごと範囲内に
+// 含まれている必要があり、そうでなければERR_INVALID_ARGを返す。
+static error_t check_range(struct arch_vm *vm, vaddr_t vaddr, size_t size) {
+    bool found = false;
+    offset_t offset = 0;
+    while (offset < size) {
+        // カーネルと共有している2段目のテーブルは書き換えさせない
+        if (is_kernel_shared(vm, vaddr + offset)) {
+            return ERR_INVALID_UADDR;
+        }
+
+        size_t len = table_remaining(vaddr + offset, size - offset);
+        pte_t *pte;
+        bool large;
+        if (walk(vm->table, vaddr + offset, false, &pte, &large) != OK) {
+            // 2段目のテーブルがない: 次の1段目のエントリへ
+            offset += len;
+            continue;
+        }
+
+        if (large && len != LARGE_PAGE_SIZE) {
+            // メガページの一部だけを書き換えようとしている
+            return ERR_INVALID_ARG;
+        }
+
+        size_t num_ptes = large ? 1 : len / PAGE_SIZE;
+        for (size_t i = 0; i < num_ptes; i++) {
+            found |= (pte[i] & PTE_V) != 0;
+        }
+
+        offset += len;
+    }
+
+    return found ? OK : ERR_NOT_FOUND;
+}
+
+// vaddrからsizeバイトの仮想アドレス範囲にマップされているページを全てアンマップして解放
+// する。ページテーブルは2段目のテーブルごとに引き、TLBのフラッシュは最後に一度だけ行い、
+// フラッシュしてから物理ページを解放する。
+//
+// 範囲内に1つもページがマップされていなければERR_NOT_FOUNDを返す。メガページは丸ごと
+// 範囲内に含まれている必要があり、そうでなければ何もせずにERR_INVALID_ARGを返す。
+error_t arch_vm_unmap_range(struct arch_vm *vm, vaddr_t vaddr, size_t size) {
     DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
-    DEBUG_ASSERT(IS_ALIGNED(paddr, PAGE_SIZE));
+    DEBUG_ASSERT(IS_ALIGNED(size, PAGE_SIZE));
 
-    // ページテーブルエントリを探す
-    pte_t *pte;
-    error_t err = walk(vm->table, vaddr, true, &pte);
+    // 途中で失敗して一部のページだけがアンマップされるのを防ぐため、先に確認する。
+    error_t err = check_range(vm, vaddr, size);
     if (err != OK) {
         return err;
     }
 
-    // 既にページがマップされていたら中断する
-    DEBUG_ASSERT(pte != NULL);
-    if (*pte & PTE_V) {
-        return ERR_ALREADY_EXISTS;
-    }
+    // ページテーブルエントリを消して、解放する物理ページを記録する
+    struct free_run runs[UNMAP_RUNS_MAX];
+    int num_runs = 0;
+    offset_t offset = 0;
+    while (offset < size) {
+        size_t len = table_remaining(vaddr + offset, size - offset);
+        pte_t *pte;
+        bool large;
+        if (walk(vm->table, vaddr + offset, false, &pte, &large) != OK) {
+            offset += len;
+            continue;
+        }
 
-    // ページテーブルエントリを設定する
-    *pte = construct_pte(paddr, page_attrs_to_pte_flags(attrs) | PTE_V);
+        size_t page_size = large ? LARGE_PAGE_SIZE : PAGE_SIZE;
+        size_t num_ptes = len / page_size;
+        for (size_t i = 0; i < num_ptes; i++) {
+            if ((pte[i] & PTE_V) == 0) {
+                continue;
+            }
 
-    // TLBをクリアする
-    asm_sfence_vma();
+            paddr_t paddr = PTE_PADDR(pte[i]);
+            pte[i] = 0;
+
+            // 物理アドレスが連続していなければ新しい領域として記録する。記録しきれなく
+            // なったら、一旦フラッシュしてから解放する。
+            struct free_run *last = num_runs > 0 ? &runs[num_runs - 1] : NULL;
+            if (last && paddr == last->start + last->size) {
+                last->size += page_size;
+            } else {
+                if (num_runs == UNMAP_RUNS_MAX) {
+                    flush_tlb(vm, vaddr, offset + i * page_size);
+                    for (int j = 0; j < num_runs; j++) {
+                        pm_free(runs[j].start, runs[j].size);
+                    }
+                    num_runs = 0;
+                }
+
+                runs[num_runs].start = paddr;
+                runs[num_runs].size = page_size;
+                num_runs++;
+            }
+        }
+
+        offset += len;
+    }
+
+    flush_tlb(vm, vaddr, size);
+    for (int i = 0; i < num_runs; i++) {
+        pm_free(runs[i].start, runs[i].size);
+    }
 
-    // 他のCPUにTLBをクリアするよう通知する (TLB shootdown)
-    arch_send_ipi(IPI_TLB_FLUSH);
     return OK;
 }
 
 // ページをアンマップする。
 error_t arch_vm_unmap(struct arch_vm *vm, vaddr_t vaddr) {
-    // ページテーブルエントリを探す
     pte_t *pte;
-    error_t err = walk(vm->table, vaddr, false, &pte);
+    bool large;
+    error_t err = walk(vm->table, vaddr, false, &pte, &large);
     if (err != OK) {
         return err;
     }
 
-    // ページがマップされていなかったら中断する
-    if (!pte || (*pte & PTE_V) == 0) {
-        return ERR_NOT_FOUND;
+    // メガページは先頭の仮想アドレスを指定したときに丸ごとアンマップする
+    return arch_vm_unmap_range(vm, vaddr, large ? LARGE_PAGE_SIZE : PAGE_SIZE);
+}
+
+// vaddrからsizeバイトの範囲にマップされているページの属性をattrsに変更する。マップされて
+// いないページは無視する。TLBのフラッシュは最後に一度だけ行う。
+//
+// 範囲内に1つもページがマップされていなければERR_NOT_FOUNDを返す。メガページは丸ごと
+// 範囲内に含まれている必要があり、そうでなければ何もせずにERR_INVALID_ARGを返す。
+error_t arch_vm_protect_range(struct arch_vm *vm, vaddr_t vaddr, size_t size,
+                              unsigned attrs) {
+    DEBUG_ASSERT(IS_ALIGNED(vaddr, PAGE_SIZE));
+    DEBUG_ASSERT(IS_ALIGNED(size, PAGE_SIZE));
+
+    error_t err = check_range(vm, vaddr, size);
+    if (err != OK) {
+        return err;
     }
 
-    // ページを解放する
-    paddr_t paddr = PTE_PADDR(*pte);
-    *pte = 0;
-    pm_free(paddr, PAGE_SIZE);
+    pte_t flags = page_attrs_to_pte_flags(attrs);
+    pte_t mask = PTE_R | PTE_W | PTE_X | PTE_U;
+    offset_t offset = 0;
+    while (offset < size) {
+        size_t len = table_remaining(vaddr + offset, size - offset);
+        pte_t *pte;
+        bool large;
+        if (walk(vm->table, vaddr + offset, false, &pte, &large) == OK) {
+            size_t num_ptes = large ? 1 : len / PAGE_SIZE;
+            for (size_t i = 0; i < num_ptes; i++) {
+                if (pte[i] & PTE_V) {
+                    pte[i] = (pte[i] & ~mask) | flags;
+                }
+            }
+        }
 
-    // TLBをクリアする
-    asm_sfence_vma();
+        offset += len;
+    }
 
-    // 他のCPUにTLBをクリアするよう通知する (TLB shootdown)
-    arch_send_ipi(IPI_TLB_FLUSH);
+    flush_tlb(vm, vaddr, size);
     return OK;
 }
 
+// 仮想アドレスにマップされている物理アドレスを返す。マップされていなければ0を返す。
+// largeがNULLでなければ、メガページでマップされているかどうかを返す。
+paddr_t arch_vm_paddr(struct arch_vm *vm, vaddr_t vaddr, bool *large) {
+    pte_t *pte;
+    bool is_large;
+    error_t err = walk(vm->table, vaddr, false, &pte, &is_large);
+    if (err != OK || (*pte & PTE_V) == 0) {
+        return 0;
+    }
+
+    if (large) {
+        *large = is_large;
+    }
+
+    paddr_t paddr = PTE_PADDR(*pte);
+    return is_large ? paddr + (vaddr & (LARGE_PAGE_SIZE - 1)) : paddr;
+}
+
+// ページテーブルをprevからnextに切り替える。
+void riscv32_vm_switch(struct arch_vm *prev, struct arch_vm *next) {
+    uint32_t self = 1u << CPUVAR->id;
+    atomic_fetch_and_and(&prev->loaded_cpus, ~self);
+    atomic_fetch_and_or(&next->loaded_cpus, self);
+    atomic_fetch_and_or(&next->used_cpus, self);
+    bool stale = (atomic_fetch_and_and(&next->stale_cpus, ~self) & self) != 0;
+
+    uint32_t satp = SATP_MODE_SV32 | (next->asid << SATP_ASID_SHIFT)
+                    | (next->table >> SATP_PPN_SHIFT);
+
+    // ASIDが割り当てられていれば、TLBのエントリはASIDで区別されるのでフラッシュは不要。
+    // ページテーブルを読み込んでいるCPUには変更時にIPIが届き、そうでないCPUには
+    // stale_cpusで通知される。ただし、まだ処理していないIPIがあればここで処理する。
+    unsigned pending =
+        atomic_fetch_and_and(&CPUVAR->ipi_pending, ~IPI_TLB_FLUSH);
+    if (next->asid && !(pending & IPI_TLB_FLUSH)) {
+        if (stale) {
+            // このCPUで前回使ってから変更されているので、このASIDのエントリを無効化する
+            asm_sfence_vma_asid(next->asid);
+        }
+
+        write_satp(satp);
+        return;
+    }
+
+    // ページテーブルを切り替えてTLBをフラッシュする。satpレジスタに書き込む前に一度
+    // sfence.vma命令を実行しているのは、ここ以前に行ったページテーブルへの変更が
+    // 完了するのを保証するため。
+    // (The RISC-V Instruction Set Manual Volume II, Version 1.10, p. 58)
+    asm_sfence_vma();
+    write_satp(satp);
+    asm_sfence_vma();
+}
+
 // 仮想アドレスがページテーブルにマップされているかどうかを返す。
 bool riscv32_is_mapped(uint32_t satp, vaddr_t vaddr) {
     satp = (satp & SATP_PPN_MASK) << SATP_PPN_SHIFT;
     uint32_t *pte;
-    error_t err = walk(satp, ALIGN_DOWN(vaddr, PAGE_SIZE), false, &pte);
+    error_t err = walk(satp, ALIGN_DOWN(vaddr, PAGE_SIZE), false, &pte, NULL);
     return err == OK && pte != NULL && (*pte & PTE_V);
 }
 
@@ -131,16 +576,31 @@ error_t arch_vm_init(struct arch_vm *vm) {
         return ERR_NO_MEMORY;
     }
 
-    // カーネル空間のマッピングをコピーする
-    memcpy((void *) arch_paddr_to_vaddr(vm->table),
-           (void *) arch_paddr_to_vaddr(kernel_vm.table), PAGE_SIZE);
+    // カーネル空間のマッピングを設定する。2段目のテーブルは共有しているので、1段目の
+    // 設定されているエントリだけをコピーすればよい。
+    pte_t *l1table = (pte_t *) arch_paddr_to_vaddr(vm->table);
+    pte_t *kernel_l1table = (pte_t *) arch_paddr_to_vaddr(kernel_vm.table);
+    for (int i = 0; i < num_kernel_l1_indices; i++) {
+        int index = kernel_l1_indices[i];
+        l1table[index] = kernel_l1table[index];
+    }
+
+    vm->asid = alloc_asid();
+    vm->loaded_cpus = 0;
+    vm->used_cpus = 0;
+    vm->stale_cpus = 0;
     return OK;
 }
 
 // ページテーブルを破棄する。
 void arch_vm_destroy(struct arch_vm *vm) {
+    // 物理アドレスが連続しているページはまとめてpm_free関数に渡す。
+    struct free_run run = {.start = 0, .size = 0};
+
     // 仮想アドレスを走査して、ユーザ空間のページを解放する
     uint32_t *l1table = (uint32_t *) arch_paddr_to_vaddr(vm->table);
+    uint32_t *kernel_l1table =
+        (uint32_t *) arch_paddr_to_vaddr(kernel_vm.table);
     for (int i = 0; i < 512; i++) {
         uint32_t pte1 = l1table[i];
         // エントリが設定されていなければスキップ
@@ -148,9 +608,17 @@ void arch_vm_destroy(struct arch_vm *vm) {
             continue;
         }
 
+        // ユーザ空間のメガページ
+        if (PTE_IS_LEAF(pte1)) {
+            if (pte1 & PTE_U) {
+                free_run_add(&run, PTE_PADDR(pte1), LARGE_PAGE_SIZE);
+            }
+            continue;
+        }
+
         // 2段目のテーブル
         uint32_t *l2table = (uint32_t *) arch_paddr_to_vaddr(PTE_PADDR(pte1));
-        for (int j = 0; j < 512; j++) {
+        for (int j = 0; j < 1024; j++) {
             uint32_t pte2 = l2table[j];
 
             // ユーザ空間のページでなければスキップ
@@ -158,25 +626,47 @@ void arch_vm_destroy(struct arch_vm *vm) {
                 continue;
             }
 
-            // ページを解放する
-            paddr_t paddr = PTE_PADDR(pte2);
-            pm_free(paddr, PAGE_SIZE);
+            free_run_add(&run, PTE_PADDR(pte2), PAGE_SIZE);
+        }
+
+        // カーネル空間のマッピングからコピーしたものでなければ、2段目のページテーブルを
+        // 格納している物理ページも解放する
+        if (pte1 != kernel_l1table[i]) {
+            pm_free(PTE_PADDR(pte1), PAGE_SIZE);
         }
     }
 
+    if (run.size > 0) {
+        pm_free(run.start, run.size);
+    }
+
     // 1段目のページテーブルを格納している物理ページを解放する
     pm_free(vm->table, PAGE_SIZE);
+    free_asid(vm->asid);
 }
 
-// 連続領域をマップする。
+// 連続領域をマップする。仮想アドレスと物理アドレスの両方がLARGE_PAGE_SIZEでアラインされて
+// いる部分はメガページでマップし、ページテーブルとTLBの消費を抑える。
 static error_t map_pages(struct arch_vm *vm, vaddr_t vaddr, paddr_t paddr,
                          size_t size, unsigned attrs) {
-    // 各ページをひとつずつマップする
-    for (offset_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        error_t err = arch_vm_map(vm, vaddr + offset, paddr + offset, attrs);
+    offset_t offset = 0;
+    while (offset < size) {
+        size_t page_size = PAGE_SIZE;
+        unsigned page_attrs = attrs;
+        if (IS_ALIGNED(vaddr + offset, LARGE_PAGE_SIZE)
+            && IS_ALIGNED(paddr + offset, LARGE_PAGE_SIZE)
+            && size - offset >= LARGE_PAGE_SIZE) {
+            page_size = LARGE_PAGE_SIZE;
+            page_attrs |= PAGE_LARGE;
+        }
+
+        error_t err =
+            arch_vm_map(vm, vaddr + offset, paddr + offset, page_attrs);
         if (err != OK) {
             return err;
         }
+
+        offset += page_size;
     }
 
     return OK;
@@ -226,4 +716,31 @@ void riscv32_vm_init(void) {
     // ACLINT
     ASSERT_OK(map_pages(&kernel_vm, ACLINT_SSWI_PADDR, ACLINT_SSWI_PADDR,
                         PAGE_SIZE, PAGE_READABLE | PAGE_WRITABLE));
+
+    // カーネルが使う仮想アドレス範囲 (物理メモリ領域全体) で、まだ2段目のテーブルがない
+    // ところにも空のテーブルを用意しておく。後からカーネルのマッピングを変更しても、1段目の
+    // エントリを書き換えずに済むようにするため。
+    pte_t *l1table = (pte_t *) arch_paddr_to_vaddr(kernel_vm.table);
+    for (vaddr_t vaddr = ram_start; vaddr - ram_start < RAM_SIZE;
+         vaddr += LARGE_PAGE_SIZE) {
+        pte_t *pte;
+        ASSERT_OK(walk(kernel_vm.table, vaddr, true, &pte, NULL));
+    }
+
+    // 各タスクにコピーする1段目のエントリを記録しておく。
+    for (int i = 0; i < 1024; i++) {
+        if (l1table[i] != 0) {
+            kernel_l1_indices[num_kernel_l1_indices++] = i;
+        }
+    }
+
+    // ASIDに対応しているかを確認する。satpレジスタのASIDフィールドに全て1を書き込み、
+    // 読み戻した値から実装されているビットを調べる。
+    spinlock_init(&asid_lock, "asid");
+    write_satp(SATP_MODE_SV32 | (SATP_ASID_MASK << SATP_ASID_SHIFT)
+               | (kernel_vm.table >> SATP_PPN_SHIFT));
+    asid_max = (read_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    write_satp(0);
+    asm_sfence_vma();
+    TRACE("ASIDs: %d", asid_max);
 }
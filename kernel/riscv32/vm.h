@@ -10,6 +10,10 @@
 #define PTE_W (1 << 2)
 #define PTE_X (1 << 3)
 #define PTE_U (1 << 4)
+#define PTE_G (1 << 5)
+
+// R/W/Xのいずれかが設定されていれば、次の段のテーブルではなくページを指すエントリ
+#define PTE_IS_LEAF(pte) (((pte) & (PTE_R | PTE_W | PTE_X)) != 0)
 
 typedef uint32_t pte_t;
 
@@ -23,5 +27,7 @@ extern char __ram_start[];
 extern char __free_ram_start[];
 extern char __boot_elf[];
 
+struct arch_vm;
+void riscv32_vm_switch(struct arch_vm *prev, struct arch_vm *next);
 bool riscv32_is_mapped(uint32_t satp, vaddr_t vaddr);
 void riscv32_vm_init(void);
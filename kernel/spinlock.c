@@ -0,0 +1,74 @@
+#include "spinlock.h"
+#include "arch.h"
+#include "printk.h"
+
+// 初期化済みの全スピンロックのリスト。統計情報の表示に使う。
+static list_t spinlocks = LIST_INIT(spinlocks);
+
+// スピンロックを初期化する。nameは統計情報の表示に使う名前。
+void spinlock_init(spinlock_t *lock, const char *name) {
+    lock->name = name;
+    lock->locked = 0;
+    lock->owner = -1;
+    lock->num_acquired = 0;
+    lock->num_contended = 0;
+    lock->num_spins = 0;
+    list_elem_init(&lock->next);
+    list_push_back(&spinlocks, &lock->next);
+}
+
+// スピンロックを統計情報の表示対象から外す。ロックを含む構造体を解放する前に呼ぶこと。
+void spinlock_destroy(spinlock_t *lock) {
+    DEBUG_ASSERT(!lock->locked);
+    list_remove(&lock->next);
+}
+
+// スピンロックを取得する。割り込みが無効化された状態で呼び出すこと。
+void spin_lock(spinlock_t *lock) {
+    DEBUG_ASSERT(lock->owner != CPUVAR->id);  // 再帰的なロック取得はできない
+
+    unsigned spins = 0;
+    while (!compare_and_swap(&lock->locked, 0, 1)) {
+        spins++;
+    }
+
+    // ここ以降のメモリ読み書きが上のロック取得前に行われないようにする。
+    full_memory_barrier();
+
+    // 統計情報はロックを取得した状態で更新するので、アトミック操作は不要。
+    lock->owner = CPUVAR->id;
+    lock->num_acquired++;
+    if (spins > 0) {
+        lock->num_contended++;
+        lock->num_spins += spins;
+    }
+}
+
+// スピンロックを解放する。
+void spin_unlock(spinlock_t *lock) {
+    DEBUG_ASSERT(lock->owner == CPUVAR->id);
+
+    lock->owner = -1;
+
+    // ここ以前のメモリ読み書きが下のロック解放前に行われるようにする。
+    full_memory_barrier();
+    compare_and_swap(&lock->locked, 1, 0);
+}
+
+// 実行中のCPUがスピンロックを保持しているかどうかを返す。
+bool spin_is_locked(spinlock_t *lock) {
+    return lock->locked && lock->owner == CPUVAR->id;
+}
+
+// 各スピンロックの統計情報を表示する。競合が多いロックを見つけるのに便利。
+void spinlock_dump(void) {
+    WARN("spinlocks:");
+    LIST_FOR_EACH (lock, &spinlocks, struct spinlock, next) {
+        if (!lock->num_acquired) {
+            continue;
+        }
+
+        WARN("  %s: acquired=%u, contended=%u, spins=%u", lock->name,
+             lock->num_acquired, lock->num_contended, lock->num_spins);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <libs/common/list.h>
+#include <libs/common/types.h>
+
+// スピンロック。カーネルロック (mp_lock関数) よりも細かい単位でデータ構造を保護する。
+//
+// IPC、通知、タスク切り替え、タイマーの処理はカーネルロックを取らずに実行され、スピンロック
+// だけで保護されている。タスクの作成・削除やメモリ管理などはまだカーネルロックを取って実行
+// される。IPIの応答待ちの間はスピンロックを保持しないこと (応答するCPUがそのロックを
+// 待っているとデッドロックする)。スピンロックを保持したままカーネルロックを取らないこと
+// (カーネルロックを持つCPUがそのスピンロックを待っているとデッドロックする)。
+struct spinlock {
+    const char *name;        // ロック名 (統計情報の表示用)
+    uint32_t locked;         // ロックが取得されていれば非ゼロ
+    int owner;               // ロックを保持しているCPUのID (-1なら誰も保持していない)
+    unsigned num_acquired;   // ロックを取得した回数
+    unsigned num_contended;  // 取得時に他のCPUがロックを保持していた回数
+    unsigned num_spins;      // ロックの解放を待ってスピンした総回数
+    list_elem_t next;        // 全スピンロックのリストの要素
+};
+
+typedef struct spinlock spinlock_t;
+
+void spinlock_init(spinlock_t *lock, const char *name);
+void spinlock_destroy(spinlock_t *lock);
+void spin_lock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+bool spin_is_locked(spinlock_t *lock);
+void spinlock_dump(void);
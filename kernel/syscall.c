@@ -126,6 +126,32 @@ static task_t sys_task_self(void) {
     return CURRENT_TASK->tid;
 }
 
+// タスクの優先度を変更する。値が小さいほど優先度が高い。
+static error_t sys_task_set_priority(task_t tid, int priority) {
+    if (priority < TASK_PRIORITY_HIGHEST || priority > TASK_PRIORITY_LOWEST) {
+        return ERR_INVALID_ARG;
+    }
+
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    // 優先度を変更できるのは、タスク自身かそのページャータスクのみ。
+    if (task != CURRENT_TASK && task->pager != CURRENT_TASK) {
+        return ERR_NOT_ALLOWED;
+    }
+
+    // タスク自身は優先度を下げることしかできない。ただしページャータスクを持たない最初の
+    // ユーザータスク (VMサーバ) は例外。
+    if (task == CURRENT_TASK && task->pager && priority < task->priority) {
+        return ERR_NOT_ALLOWED;
+    }
+
+    task_set_priority(task, priority);
+    return OK;
+}
+
 // 物理ページを割り当てる。
 //
 // flagsにPM_ALLOC_ALIGNが指定されている場合は、sizeバイトにアラインされたアドレスを
@@ -155,6 +181,22 @@ static pfn_t sys_pm_alloc(task_t tid, size_t size, unsigned flags) {
     return PADDR2PFN(paddr);
 }
 
+// pm_allocシステムコールで割り当てた物理ページを手放す。他のタスクにまだマップされている
+// ページは、最後にアンマップされたときに解放される。
+static error_t sys_pm_free(task_t tid, paddr_t paddr, size_t size) {
+    // 所有者タスクを取得
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    if (task != CURRENT_TASK && task->pager != CURRENT_TASK) {
+        return ERR_INVALID_TASK;
+    }
+
+    return pm_free_owned(task, paddr, size);
+}
+
 // ページを仮想アドレス空間にマップする。
 static paddr_t sys_vm_map(task_t tid, uaddr_t uaddr, paddr_t paddr,
                           unsigned attrs) {
@@ -165,17 +207,21 @@ static paddr_t sys_vm_map(task_t tid, uaddr_t uaddr, paddr_t paddr,
     }
 
     // 未知・許可されていないフラグが指定されていないかチェック
-    if ((attrs & ~(PAGE_WRITABLE | PAGE_READABLE | PAGE_EXECUTABLE)) != 0) {
+    if ((attrs
+         & ~(PAGE_WRITABLE | PAGE_READABLE | PAGE_EXECUTABLE | PAGE_LARGE))
+        != 0) {
         return ERR_INVALID_ARG;
     }
 
     // ページ境界にアラインされているかチェック
-    if (!IS_ALIGNED(uaddr, PAGE_SIZE) || !IS_ALIGNED(paddr, PAGE_SIZE)) {
+    size_t page_size = (attrs & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (!IS_ALIGNED(uaddr, page_size) || !IS_ALIGNED(paddr, page_size)) {
         return ERR_INVALID_ARG;
     }
 
     // 仮想アドレスがマップ可能かチェック
-    if (!arch_is_mappable_uaddr(uaddr)) {
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + page_size - 1)) {
         return ERR_INVALID_UADDR;
     }
 
@@ -204,11 +250,198 @@ static paddr_t sys_vm_unmap(task_t tid, uaddr_t uaddr) {
     return vm_unmap(task, uaddr);
 }
 
+// uaddrからnum_pages個のページを、paddrから始まる連続した物理メモリ領域にまとめてマップ
+// する。attrsにPAGE_LARGEを指定した場合は、範囲をLARGE_PAGE_SIZE単位でアラインすること。
+static error_t sys_vm_map_range(task_t tid, uaddr_t uaddr, paddr_t paddr,
+                                size_t num_pages, unsigned attrs) {
+    // 操作対象のタスクを取得
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    // 未知・許可されていないフラグが指定されていないかチェック
+    if ((attrs
+         & ~(PAGE_WRITABLE | PAGE_READABLE | PAGE_EXECUTABLE | PAGE_LARGE))
+        != 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ユーザー空間に収まらないページ数はオーバーフローする前に弾く
+    if (num_pages == 0 || num_pages > KERNEL_BASE / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ページ境界にアラインされているかチェック
+    size_t size = num_pages * PAGE_SIZE;
+    size_t page_size = (attrs & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (!IS_ALIGNED(uaddr, page_size) || !IS_ALIGNED(paddr, page_size)
+        || !IS_ALIGNED(size, page_size)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 仮想アドレスがマップ可能かチェック
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + size - 1)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    attrs |= PAGE_USER;  // 常にユーザーページとしてマップする
+    return vm_map_range(task, uaddr, paddr, size, attrs);
+}
+
+// uaddrからnum_pages個のページをまとめてアンマップする。マップされていないページは無視
+// するが、1つもマップされていなければERR_NOT_FOUNDを返す。
+static error_t sys_vm_unmap_range(task_t tid, uaddr_t uaddr,
+                                  size_t num_pages) {
+    // 操作対象のタスクを取得
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    // ユーザー空間に収まらないページ数はオーバーフローする前に弾く
+    if (num_pages == 0 || num_pages > KERNEL_BASE / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ページ境界にアラインされているかチェック
+    if (!IS_ALIGNED(uaddr, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 仮想アドレスがアンマップ可能かチェック
+    size_t size = num_pages * PAGE_SIZE;
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + size - 1)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    return vm_unmap_range(task, uaddr, size);
+}
+
+// uaddrからnum_pages個のページのうちマップされているものの属性を変更する。ページャ
+// タスクのみが呼び出せる。コピーオンライトのためにページを読み込み専用にするのに使う。
+static error_t sys_vm_protect(task_t tid, uaddr_t uaddr, size_t num_pages,
+                              unsigned attrs) {
+    // 操作対象のタスクを取得
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    // タスク自身が共有しているページを書き込み可能にできないよう、ページャに限る
+    if (task->pager != CURRENT_TASK) {
+        return ERR_NOT_ALLOWED;
+    }
+
+    // 未知・許可されていないフラグが指定されていないかチェック。読み込みも実行もできない
+    // ページはSv32では表現できない。
+    if ((attrs & ~(PAGE_WRITABLE | PAGE_READABLE | PAGE_EXECUTABLE)) != 0
+        || (attrs & (PAGE_READABLE | PAGE_EXECUTABLE)) == 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ユーザー空間に収まらないページ数はオーバーフローする前に弾く
+    if (num_pages == 0 || num_pages > KERNEL_BASE / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ページ境界にアラインされているかチェック
+    if (!IS_ALIGNED(uaddr, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 仮想アドレスがユーザー空間のものかチェック
+    size_t size = num_pages * PAGE_SIZE;
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + size - 1)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    attrs |= PAGE_USER;  // 常にユーザーページとしてマップする
+    return arch_vm_protect_range(&task->vm, uaddr, size, attrs);
+}
+
+// srcのuaddrからnum_pages個のページのうちマップされているものを、dstの同じ仮想アドレスに
+// マップする。タスクの複製 (fork) に使う。
+static error_t sys_vm_share(task_t src_tid, task_t dst_tid, uaddr_t uaddr,
+                            size_t num_pages, unsigned attrs) {
+    // 操作対象のタスクを取得
+    struct task *src = task_find(src_tid);
+    struct task *dst = task_find(dst_tid);
+    if (!src || !dst) {
+        return ERR_INVALID_TASK;
+    }
+
+    if ((src != CURRENT_TASK && src->pager != CURRENT_TASK)
+        || (dst != CURRENT_TASK && dst->pager != CURRENT_TASK)) {
+        return ERR_INVALID_TASK;
+    }
+
+    // 未知・許可されていないフラグが指定されていないかチェック
+    if ((attrs & ~(PAGE_WRITABLE | PAGE_READABLE | PAGE_EXECUTABLE)) != 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ユーザー空間に収まらないページ数はオーバーフローする前に弾く
+    if (num_pages == 0 || num_pages > KERNEL_BASE / PAGE_SIZE) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ページ境界にアラインされているかチェック
+    if (!IS_ALIGNED(uaddr, PAGE_SIZE)) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 仮想アドレスがマップ可能かチェック
+    size_t size = num_pages * PAGE_SIZE;
+    if (!arch_is_mappable_uaddr(uaddr)
+        || !arch_is_mappable_uaddr(uaddr + size - 1)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    attrs |= PAGE_USER;  // 常にユーザーページとしてマップする
+    return vm_share_range(src, dst, uaddr, size, attrs);
+}
+
+// タスクの仮想アドレスにマップされている物理ページの番号を返す。
+static pfn_t sys_vm_paddr(task_t tid, uaddr_t uaddr) {
+    // 操作対象のタスクを取得
+    struct task *task = task_find(tid);
+    if (!task) {
+        return ERR_INVALID_TASK;
+    }
+
+    if (task != CURRENT_TASK && task->pager != CURRENT_TASK) {
+        return ERR_INVALID_TASK;
+    }
+
+    // 仮想アドレスがユーザー空間のものかチェック
+    if (!arch_is_mappable_uaddr(uaddr)) {
+        return ERR_INVALID_UADDR;
+    }
+
+    paddr_t paddr =
+        arch_vm_paddr(&task->vm, ALIGN_DOWN(uaddr, PAGE_SIZE), NULL);
+    if (!paddr) {
+        return ERR_NOT_FOUND;
+    }
+
+    return PADDR2PFN(paddr);
+}
+
 // メッセージを送受信する。
 static error_t sys_ipc(task_t dst, task_t src, __user struct message *m,
                        unsigned flags) {
     // 許可されていないフラグが指定されていないかチェック
-    if ((flags & ~(IPC_SEND | IPC_RECV | IPC_NOBLOCK)) != 0) {
+    if ((flags & ~(IPC_SEND | IPC_RECV | IPC_NOBLOCK | IPC_REPLY | IPC_ASYNC))
+        != 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 非同期送信は送信処理のみ
+    if ((flags & IPC_ASYNC) && (flags & (IPC_SEND | IPC_RECV)) != IPC_SEND) {
         return ERR_INVALID_ARG;
     }
 
@@ -217,26 +450,84 @@ static error_t sys_ipc(task_t dst, task_t src, __user struct message *m,
         return ERR_INVALID_ARG;
     }
 
-    // 送信処理が含まれているのであれば、送信先タスクを取得
-    struct task *dst_task = NULL;
-    if (flags & IPC_SEND) {
-        dst_task = task_find(dst);
-        if (!dst_task) {
-            return ERR_INVALID_TASK;
+    // 送信先タスクはipc関数の中で取得する (存在しなければERR_INVALID_TASKを返す)。
+    return ipc(dst, src, m, flags);
+}
+
+// 複数のメッセージをまとめて送受信する。sendsのnum_sends個のメッセージをノンブロッキングで
+// 送信 (返信) し、続けて最大max_recvs個のメッセージをrecvsにオープン受信する。受信できる
+// メッセージがなければ最初の1つが届くまでブロックし、2つ目以降は既に届いているものだけを
+// 受信する。受信したメッセージの数を返す。各メッセージの送信結果はsends[i].resultに設定する。
+static int sys_ipc_batch(__user struct ipc_batch_send *sends, int num_sends,
+                         __user struct message *recvs, int max_recvs) {
+    if (num_sends < 0 || num_sends > IPC_BATCH_MAX || max_recvs < 0
+        || max_recvs > IPC_BATCH_MAX) {
+        return ERR_INVALID_ARG;
+    }
+
+    // 送信処理: 宛先が受信待ちでなければブロックせずにERR_WOULD_BLOCKとする。
+    for (int i = 0; i < num_sends; i++) {
+        task_t dst;
+        error_t err = memcpy_from_user(&dst, &sends[i].dst, sizeof(dst));
+        if (err != OK) {
+            return err;
+        }
+
+        error_t result = ipc(dst, 0, &sends[i].m, IPC_SEND | IPC_NOBLOCK);
+
+        err = memcpy_to_user(&sends[i].result, &result, sizeof(result));
+        if (err != OK) {
+            return err;
+        }
+    }
+
+    // 受信処理
+    int num_recvs = 0;
+    while (num_recvs < max_recvs) {
+        unsigned flags = IPC_RECV | (num_recvs > 0 ? IPC_NOBLOCK : 0);
+        error_t err = ipc(0, IPC_ANY, &recvs[num_recvs], flags);
+        if (err == ERR_WOULD_BLOCK) {
+            break;
+        }
+
+        if (err != OK) {
+            // 既に受信したメッセージがあれば、それを先に返す
+            return num_recvs > 0 ? num_recvs : err;
+        }
+
+        // 通知メッセージはlibs/userでひとつずつ処理されるので、受信したらそこで打ち切る。
+        int32_t type;
+        err = memcpy_from_user(&type, &recvs[num_recvs].type, sizeof(type));
+        num_recvs++;
+        if (err != OK || type == NOTIFY_MSG) {
+            break;
         }
     }
 
-    return ipc(dst_task, src, m, flags);
+    return num_recvs;
 }
 
 // 通知を送信する。
+//
+// カーネルロックを取らずに呼ばれるので、通知している間に宛先タスクが削除されないよう
+// ピン留めする。
 static error_t sys_notify(task_t dst, notifications_t notifications) {
-    struct task *dst_task = task_find(dst);
+    struct task *dst_task = task_pin(dst);
     if (!dst_task) {
         return ERR_INVALID_TASK;
     }
 
-    notify(dst_task, notifications);
+    // 非同期メッセージの通知は、送信元を記録して宛先タスクに伝える。
+    if (notifications & NOTIFY_ASYNC) {
+        notify_async(dst_task, CURRENT_TASK);
+        notifications &= ~NOTIFY_ASYNC;
+    }
+
+    if (notifications) {
+        notify(dst_task, notifications);
+    }
+
+    task_unpin(dst_task);
     return OK;
 }
 
@@ -292,7 +583,7 @@ static error_t sys_time(int timeout) {
     }
 
     // タイムアウト時間を更新する
-    CURRENT_TASK->timeout = (timeout == 0) ? 0 : (timeout * (TICK_HZ / 1000));
+    timer_set(CURRENT_TASK, timeout * (TICK_HZ / 1000));
     return OK;
 }
 
@@ -306,8 +597,32 @@ __noreturn static int sys_shutdown(void) {
     arch_shutdown();
 }
 
+// カーネルロックを取らずに処理するシステムコールかどうかを返す。IPCと通知はタスクごとの
+// ロックとランキューのロックで、タイマーはタイマーのロックで保護されている。
+//
+// その他 (タスクの作成・削除、メモリ管理、シリアルポートや割り込みの管理) はまだ
+// カーネルロックで保護している。
+static bool is_lockless_syscall(long n) {
+    switch (n) {
+        case SYS_IPC:
+        case SYS_IPC_BATCH:
+        case SYS_NOTIFY:
+        case SYS_TASK_SELF:
+        case SYS_TIME:
+        case SYS_UPTIME:
+            return true;
+        default:
+            return false;
+    }
+}
+
 // システムコールハンドラ
 long handle_syscall(long a0, long a1, long a2, long a3, long a4, long n) {
+    bool locked = !is_lockless_syscall(n);
+    if (locked) {
+        arch_lock_kernel();
+    }
+
     long ret;
     switch (n) {
         case SYS_IPC:
@@ -316,6 +631,10 @@ long handle_syscall(long a0, long a1, long a2, long a3, long a4, long n) {
         case SYS_NOTIFY:
             ret = sys_notify(a0, a1);
             break;
+        case SYS_IPC_BATCH:
+            ret = sys_ipc_batch((__user struct ipc_batch_send *) a0, a1,
+                                (__user struct message *) a2, a3);
+            break;
         case SYS_SERIAL_WRITE:
             ret = sys_serial_write((__user const char *) a0, a1);
             break;
@@ -334,15 +653,36 @@ long handle_syscall(long a0, long a1, long a2, long a3, long a4, long n) {
         case SYS_TASK_SELF:
             ret = sys_task_self();
             break;
+        case SYS_TASK_SET_PRIORITY:
+            ret = sys_task_set_priority(a0, a1);
+            break;
         case SYS_PM_ALLOC:
             ret = sys_pm_alloc(a0, a1, a2);
             break;
+        case SYS_PM_FREE:
+            ret = sys_pm_free(a0, a1, a2);
+            break;
         case SYS_VM_MAP:
             ret = sys_vm_map(a0, a1, a2, a3);
             break;
         case SYS_VM_UNMAP:
             ret = sys_vm_unmap(a0, a1);
             break;
+        case SYS_VM_MAP_RANGE:
+            ret = sys_vm_map_range(a0, a1, a2, a3, a4);
+            break;
+        case SYS_VM_UNMAP_RANGE:
+            ret = sys_vm_unmap_range(a0, a1, a2);
+            break;
+        case SYS_VM_PADDR:
+            ret = sys_vm_paddr(a0, a1);
+            break;
+        case SYS_VM_PROTECT:
+            ret = sys_vm_protect(a0, a1, a2, a3);
+            break;
+        case SYS_VM_SHARE:
+            ret = sys_vm_share(a0, a1, a2, a3, a4);
+            break;
         case SYS_IRQ_LISTEN:
             ret = sys_irq_listen(a0);
             break;
@@ -366,5 +706,9 @@ long handle_syscall(long a0, long a1, long a2, long a3, long a4, long n) {
             ret = ERR_INVALID_ARG;
     }
 
+    if (locked) {
+        arch_unlock_kernel();
+    }
+
     return ret;
 }
@@ -1,49 +1,195 @@
 #include "task.h"
 #include "arch.h"
+#include "interrupt.h"
 #include "ipc.h"
 #include "memory.h"
 #include "printk.h"
 #include <libs/common/list.h>
 #include <libs/common/string.h>
 
-static struct task tasks[NUM_TASKS_MAX];        // 全てのタスク管理構造体 (未使用含む)
+static struct task *tasks[NUM_TASKS_MAX];       // タスクIDから管理構造体への対応表
+static spinlock_t tasks_lock;                   // tasksのロック
 static struct task idle_tasks[NUM_CPUS_MAX];    // 各CPUのアイドルタスク
-static list_t runqueue = LIST_INIT(runqueue);   // ランキュー
 list_t active_tasks = LIST_INIT(active_tasks);  // 使用中の管理構造体のリスト
 
+// 解放されたタスクIDのリスト (FIFO)。free_tids_next[tid - 1] がリスト中の次のタスクID。
+// 解放されたIDがすぐに再利用されないように、末尾に追加して先頭から取り出す。
+static task_t free_tids_next[NUM_TASKS_MAX];
+static task_t free_tids_head = 0;
+static task_t free_tids_tail = 0;
+// まだ一度も使われていないタスクIDの最小値。
+static task_t next_unused_tid = 1;
+
+// タスクを指定したCPUのランキューの末尾に追加する。
+static void runqueue_push(struct cpuvar *cpuvar, struct task *task) {
+    int priority = task->priority;
+    spin_lock(&cpuvar->runqueue_lock);
+    task->cpu = cpuvar->id;
+    list_push_back(&cpuvar->runqueues[priority], &task->waitqueue_next);
+    cpuvar->runqueue_bitmap |= 1u << priority;
+    cpuvar->num_runnable++;
+    spin_unlock(&cpuvar->runqueue_lock);
+}
+
+// 指定したCPUのランキューから、優先度がmax_priority以上 (値がmax_priority以下) のタスク
+// のうち最も優先度の高いものを取り出す。該当するタスクがない場合はNULLを返す。
+//
+// 空でないランキューをビットマップで管理しているので、最も優先度の高いランキューは最下位の
+// セットされたビットを数えるだけで見つかる (O(1))。
+static struct task *runqueue_pop(struct cpuvar *cpuvar, int max_priority) {
+    spin_lock(&cpuvar->runqueue_lock);
+    uint32_t bitmap = cpuvar->runqueue_bitmap;
+    if (!bitmap || __builtin_ctz(bitmap) > max_priority) {
+        spin_unlock(&cpuvar->runqueue_lock);
+        return NULL;
+    }
+
+    int priority = __builtin_ctz(bitmap);
+    list_t *runqueue = &cpuvar->runqueues[priority];
+    struct task *task = LIST_POP_FRONT(runqueue, struct task, waitqueue_next);
+    DEBUG_ASSERT(task != NULL);
+    DEBUG_ASSERT(cpuvar->num_runnable > 0);
+    cpuvar->num_runnable--;
+    if (list_is_empty(runqueue)) {
+        cpuvar->runqueue_bitmap &= ~(1u << priority);
+    }
+
+    spin_unlock(&cpuvar->runqueue_lock);
+    return task;
+}
+
+// タスクを (どのCPUのものであれ) ランキューから取り除く。他のCPUのスケジューラが先に
+// 取り出していた (または別のCPUのランキューに移っていた) 場合はfalseを返す。
+//
+// スケジューラはカーネルロックを取らずにランキューから取り出すので、ランキューのロックを
+// 取ってから、そのランキューに入っていることを確かめる。
+static bool runqueue_remove(struct task *task) {
+    struct cpuvar *cpuvar = arch_cpuvar_of(task->cpu);
+    int priority = task->priority;
+    list_t *runqueue = &cpuvar->runqueues[priority];
+    spin_lock(&cpuvar->runqueue_lock);
+    if (!list_contains(runqueue, &task->waitqueue_next)) {
+        spin_unlock(&cpuvar->runqueue_lock);
+        return false;
+    }
+
+    DEBUG_ASSERT(cpuvar->num_runnable > 0);
+    list_remove(&task->waitqueue_next);
+    cpuvar->num_runnable--;
+    if (list_is_empty(runqueue)) {
+        cpuvar->runqueue_bitmap &= ~(1u << priority);
+    }
+
+    spin_unlock(&cpuvar->runqueue_lock);
+    return true;
+}
+
+// 他のCPUのランキューから実行可能なタスクを奪い取る。最も多くのタスクを抱えているCPUから
+// 取り出す。奪えるタスクがない場合はNULLを返す。
+static struct task *steal_task(void) {
+    struct cpuvar *busiest = NULL;
+    for (int cpu = 0; cpu < NUM_CPUS_MAX; cpu++) {
+        struct cpuvar *cpuvar = arch_cpuvar_of(cpu);
+        if (!cpuvar->online || cpuvar == CPUVAR || !cpuvar->num_runnable) {
+            continue;
+        }
+
+        if (!busiest || cpuvar->num_runnable > busiest->num_runnable) {
+            busiest = cpuvar;
+        }
+    }
+
+    return busiest ? runqueue_pop(busiest, TASK_PRIORITY_LOWEST) : NULL;
+}
+
 // 次に実行するタスクを選択する。
 static struct task *scheduler(void) {
-    // ランキューから実行可能なタスクを取り出す。
-    struct task *next = LIST_POP_FRONT(&runqueue, struct task, waitqueue_next);
+    struct task *current = CURRENT_TASK;
+    bool current_runnable =
+        current->state == TASK_RUNNABLE && !current->destroyed;
+
+    // 自CPUのランキューから実行可能なタスクを取り出す。実行中タスクが実行可能な場合は、
+    // それと同じかより高い優先度のタスクのみを選ぶ (同じ優先度のタスク間はラウンドロビン)。
+    int max_priority =
+        current_runnable ? current->priority : TASK_PRIORITY_LOWEST;
+    struct task *next = runqueue_pop(CPUVAR, max_priority);
     if (next) {
         return next;
     }
 
-    if (CURRENT_TASK->state == TASK_RUNNABLE && !CURRENT_TASK->destroyed) {
-        // 他に実行可能なタスクがない場合は、実行中タスクを続行する。
-        return CURRENT_TASK;
+    if (current_runnable) {
+        // 他により優先度の高いタスクがない場合は、実行中タスクを続行する。
+        return current;
+    }
+
+    // 自CPUに実行するタスクがないので、他のCPUから奪ってくる (work stealing)。
+    next = steal_task();
+    if (next) {
+        return next;
     }
 
     return IDLE_TASK;  // 実行するタスクがない場合はアイドルタスクを実行する。
 }
 
+// 実行可能になったタスクを入れるランキュー (CPU) を選ぶ。
+static struct cpuvar *select_cpu(struct task *task) {
+    // 起こした側のCPU (wake-affine) のランキューが空ならそこで実行する。IPCで相手を
+    // 起こしたタスクはすぐにブロックすることが多く、メッセージの内容もキャッシュに乗っている。
+    struct cpuvar *local = CPUVAR;
+    if (!local->num_runnable) {
+        return local;
+    }
+
+    // 前回実行していたCPUがアイドル状態ならそこで実行する。
+    struct cpuvar *prev = arch_cpuvar_of(task->cpu);
+    if (prev->online && prev->current_task == prev->idle_task
+        && !prev->num_runnable) {
+        return prev;
+    }
+
+    // 最もランキューが短いCPUを選ぶ。
+    struct cpuvar *best = local;
+    for (int cpu = 0; cpu < NUM_CPUS_MAX; cpu++) {
+        struct cpuvar *cpuvar = arch_cpuvar_of(cpu);
+        if (cpuvar->online && cpuvar->num_runnable < best->num_runnable) {
+            best = cpuvar;
+        }
+    }
+
+    return best;
+}
+
 // タスク管理構造体を初期化する。
 static error_t init_task_struct(struct task *task, task_t tid, const char *name,
                                 vaddr_t ip, struct task *pager,
                                 vaddr_t kernel_entry, void *arg) {
     task->tid = tid;
     task->destroyed = false;
+    task->on_cpu = false;
     task->quantum = 0;
+    task->priority = TASK_PRIORITY_DEFAULT;
+    task->cpu = CPUVAR->id;
     task->timeout = 0;
+    task->timer_index = -1;
     task->wait_for = IPC_DENY;
+    task->blocked_on = 0;
     task->ref_count = 0;
+    task->num_pins = 0;
     task->pager = pager;
+    task->notifications = 0;
+    task->num_async_senders = 0;
+    task->async_cursor = 0;
+    memset(task->async_senders, 0, sizeof(task->async_senders));
+    task->asyncq = NULL;
+    task->message_pages_hint = MESSAGE_PAGES_BASE;
 
     strcpy_safe(task->name, sizeof(task->name), name);
+    spinlock_init(&task->lock, task->name);
     list_elem_init(&task->waitqueue_next);
     list_elem_init(&task->next);
     list_init(&task->senders);
     list_init(&task->pages);
+    spinlock_init(&task->pages_lock, task->name);
 
     error_t err = arch_vm_init(&task->vm);
     if (err != OK) {
@@ -64,6 +210,61 @@ static error_t init_task_struct(struct task *task, task_t tid, const char *name,
     return OK;
 }
 
+// taskが他のCPUで実行中であれば、切り替えて実行コンテキストの保存が済むまで待つ。
+// ブロックした直後のタスクは、他のCPUに起こされた時点ではまだ元のCPUで切り替えの途中
+// かもしれない。
+static void wait_for_switch_out(struct task *task) {
+    while (atomic_load(&task->on_cpu)) {
+        ;
+    }
+}
+
+// これから実行するタスクを、このCPUで実行中であると記録する。
+static void claim_task(struct task *task) {
+    wait_for_switch_out(task);
+    atomic_store(&task->on_cpu, true);
+}
+
+// 実行中タスク (prev) から、claim_task関数で確保したnextに切り替える。スケジューラは
+// カーネルロックを取らずに動くので、カーネルロックを持っている場合は切り替えている間は
+// 解放し、このタスクに戻ってきたときに取り直す。
+static void switch_to(struct task *prev, struct task *next) {
+    next->cpu = CPUVAR->id;
+    CURRENT_TASK = next;
+    CPUVAR->prev_task = prev;
+
+    bool locked = arch_is_kernel_locked();
+    if (locked) {
+        arch_unlock_kernel();
+    }
+
+    arch_task_switch(prev, next);
+    task_switch_finish();
+
+    if (locked) {
+        arch_lock_kernel();
+    }
+}
+
+// タスク切り替えの後始末をする。切り替え先のタスクで、切り替え直後に呼ぶ (初めて実行
+// されるタスクの場合は、最初に実行される関数から呼ぶ)。
+//
+// 切り替え元のタスクは実行コンテキストの保存が済んだので、他のCPUで実行できるようにする。
+// 実行可能な状態 (CPU時間を使い切った) ならランキューに戻す。切り替える前に戻すと、保存が
+// 済む前に他のCPUが取り出して実行してしまう。
+void task_switch_finish(void) {
+    struct task *prev = CPUVAR->prev_task;
+    bool runnable = prev->state == TASK_RUNNABLE;
+
+    // 以降はブロック中のprevを他のCPUが再開し得るので、状態を読んでから記録を消す。
+    full_memory_barrier();
+    atomic_store(&prev->on_cpu, false);
+
+    if (runnable) {
+        runqueue_push(CPUVAR, prev);
+    }
+}
+
 // 自発的なタスク切り替えを行う。もし実行可能なタスクが実行中タスク以外にない場合は、即座に
 // 戻ってくる。その他の場合は、他のタスクに実行が移され、次回タスクが再びスケジュールされたとき
 // に戻ってくる。
@@ -73,7 +274,7 @@ void task_switch(void) {
 
     // 次に実行するタスクにCPU時間を与える
     if (next != IDLE_TASK) {
-        next->quantum = TASK_QUANTUM;
+        next->quantum = TASK_QUANTUM(next->priority);
     }
 
     if (next == prev) {
@@ -81,42 +282,148 @@ void task_switch(void) {
         return;
     }
 
-    if (prev->state == TASK_RUNNABLE) {
-        // 実行中タスクが実行可能な状態ならば、実行可能なタスクのキューに戻す。
-        // 与えられたCPU時間を使い切ったときに起きる。
-        list_push_back(&runqueue, &prev->waitqueue_next);
+    // タスクを切り替える。実行中タスクが実行可能な状態ならば、切り替えた後に
+    // task_switch_finish関数がランキューに戻す。
+    claim_task(next);
+    switch_to(prev, next);
+}
+
+// 指定したタスクに直接切り替える (ダイレクトハンドオフ)。nextはブロック状態のタスクで、
+// ランキューを経由せずに実行可能状態にして実行する。実行中タスクの残りのクォンタムはnextに
+// 譲られる。IPCの送信直後に受信待ちでブロックする場合に使い、ランキューを一巡する待ち時間を
+// なくす。
+//
+// ただし、このCPUでnextより優先度の高いタスクが実行を待っている場合や、nextが削除中の場合は
+// 通常通りランキューに入れてスケジューラに任せる。
+//
+// nextはピン留め (task_pin関数) した状態で渡すこと。実行可能状態にした時点で (以降は
+// task_destroy関数が実行の中断を待つので) ピン留めを外す。
+void task_switch_to(struct task *next) {
+    struct task *prev = CURRENT_TASK;
+    DEBUG_ASSERT(next != prev);
+    DEBUG_ASSERT(next->state == TASK_BLOCKED);
+
+    uint32_t bitmap = CPUVAR->runqueue_bitmap;
+    bool preempted = bitmap && __builtin_ctz(bitmap) < next->priority;
+    if (prev->state == TASK_RUNNABLE || next->destroyed || preempted) {
+        task_resume(next);
+        task_unpin(next);
+        task_switch();
+        return;
     }
 
-    // タスクを切り替える
-    CURRENT_TASK = next;
-    arch_task_switch(prev, next);
+    // nextの切り替え元のCPUが後始末 (task_switch_finish関数) を終えてから実行可能状態に
+    // する。先に実行可能状態にすると、そのCPUがランキューに戻してしまう。
+    claim_task(next);
+    next->state = TASK_RUNNABLE;
+    next->quantum = prev->quantum;
+    task_unpin(next);
+    switch_to(prev, next);
 }
 
-// 未使用のタスクIDを探す。
+// 未使用のタスクIDを割り当てる (O(1))。空きがない場合は0を返す。
 static task_t alloc_tid(void) {
-    for (task_t i = 0; i < NUM_TASKS_MAX; i++) {
-        if (tasks[i].state == TASK_UNUSED) {
-            return i + 1;
+    // まだ一度も使われていないIDを優先して使う。
+    if (next_unused_tid <= NUM_TASKS_MAX) {
+        return next_unused_tid++;
+    }
+
+    task_t tid = free_tids_head;
+    if (tid) {
+        free_tids_head = free_tids_next[tid - 1];
+        if (!free_tids_head) {
+            free_tids_tail = 0;
         }
     }
 
-    return 0;
+    return tid;
+}
+
+// タスクIDを解放する。
+static void free_tid(task_t tid) {
+    free_tids_next[tid - 1] = 0;
+    if (free_tids_tail) {
+        free_tids_next[free_tids_tail - 1] = tid;
+    } else {
+        free_tids_head = tid;
+    }
+
+    free_tids_tail = tid;
+}
+
+// タスク管理構造体とタスクIDを割り当てる。管理構造体はゼロクリアされている。
+static error_t alloc_task(struct task **task) {
+    task_t tid = alloc_tid();
+    if (!tid) {
+        return ERR_TOO_MANY_TASKS;
+    }
+
+    size_t size = ALIGN_UP(sizeof(struct task), PAGE_SIZE);
+    paddr_t paddr = pm_alloc(size, NULL, PM_ALLOC_ZEROED);
+    if (!paddr) {
+        free_tid(tid);
+        return ERR_NO_MEMORY;
+    }
+
+    *task = (struct task *) arch_paddr_to_vaddr(paddr);
+    (*task)->tid = tid;
+    (*task)->paddr = paddr;
+    return OK;
+}
+
+// alloc_task関数で割り当てたタスク管理構造体とタスクIDを解放する。
+static void free_task(struct task *task) {
+    spinlock_destroy(&task->lock);
+    spinlock_destroy(&task->pages_lock);
+    spin_lock(&tasks_lock);
+    tasks[task->tid - 1] = NULL;
+    spin_unlock(&tasks_lock);
+    free_tid(task->tid);
+    pm_free(task->paddr, ALIGN_UP(sizeof(struct task), PAGE_SIZE));
 }
 
 // タスクIDからタスク管理構造体を取得する。存在しない場合や無効なIDの場合はNULLを返す。
 struct task *task_find(task_t tid) {
-    if (tid < 0 || tid >= NUM_TASKS_MAX) {
+    if (tid <= 0 || tid > NUM_TASKS_MAX) {
         return NULL;
     }
 
-    struct task *task = &tasks[tid - 1];
-    if (task->state == TASK_UNUSED) {
+    return tasks[tid - 1];
+}
+
+// タスクIDからタスク管理構造体を取得し、task_unpin関数を呼ぶまで削除されないようにする
+// (ピン留め)。存在しないか削除中の場合はNULLを返す。
+//
+// task_destroy関数はピン留めが外れるまで待つので、ピン留めしたままブロックしないこと。
+struct task *task_pin(task_t tid) {
+    if (tid <= 0 || tid > NUM_TASKS_MAX) {
         return NULL;
     }
 
+    spin_lock(&tasks_lock);
+    struct task *task = tasks[tid - 1];
+    if (task) {
+        spin_lock(&task->lock);
+        if (task->destroyed) {
+            spin_unlock(&task->lock);
+            task = NULL;
+        } else {
+            atomic_fetch_and_add(&task->num_pins, 1);
+            spin_unlock(&task->lock);
+        }
+    }
+
+    spin_unlock(&tasks_lock);
     return task;
 }
 
+// task_pin関数でピン留めしたタスクのピン留めを外す。ブロックした直後 (切り替える前) にも
+// 呼ばれるので、ロックは取らない (task_resume関数の待ちとデッドロックしないようにする)。
+void task_unpin(struct task *task) {
+    DEBUG_ASSERT(task->num_pins > 0);
+    atomic_fetch_and_sub(&task->num_pins, 1);
+}
+
 // タスクをブロック状態にする。実行中タスク自身をブロックする場合は、task_switch関数を
 // 呼び出して他のタスクに実行を移す必要がある。
 void task_block(struct task *task) {
@@ -127,29 +434,67 @@ void task_block(struct task *task) {
 }
 
 // タスクを実行可能状態にする。
+//
+// ブロックした直後のタスクは、切り替えが済むまで待ってから実行可能状態にする。ブロック
+// してから切り替えが済むまでの間、ブロックしたタスクはロックを取らないので、ロックを
+// 持ったまま呼んでもよい。
 void task_resume(struct task *task) {
     DEBUG_ASSERT(task->state == TASK_BLOCKED);
 
+    wait_for_switch_out(task);
     task->state = TASK_RUNNABLE;
-    list_push_back(&runqueue, &task->waitqueue_next);
+
+    struct cpuvar *cpuvar = select_cpu(task);
+    runqueue_push(cpuvar, task);
+
+    // 入れたCPUで実行中のタスクよりも優先度が高ければ、実行中タスクを横取りする (プリエンプ
+    // ション)。アイドル状態のCPUも同様に起こす。
+    struct task *running = cpuvar->current_task;
+    if (task->priority < running->priority) {
+        if (cpuvar == CPUVAR) {
+            // 処理の途中なのでここでは切り替えられない。クォンタムを使い切ったことにして、
+            // 次のタイマー割り込みでタスクを切り替えさせる。
+            running->quantum = 0;
+        } else {
+            arch_kick_cpu(cpuvar->id);
+        }
+    }
+}
+
+// タスクの優先度を変更する。
+void task_set_priority(struct task *task, int priority) {
+    DEBUG_ASSERT(TASK_PRIORITY_HIGHEST <= priority
+                 && priority <= TASK_PRIORITY_LOWEST);
+
+    struct cpuvar *cpuvar = arch_cpuvar_of(task->cpu);
+    if (task->state == TASK_RUNNABLE && runqueue_remove(task)) {
+        // ランキューに入っている場合は、新しい優先度のランキューに入れ直す。
+        task->priority = priority;
+        runqueue_push(cpuvar, task);
+    } else {
+        task->priority = priority;
+    }
 }
 
 // タスクを作成する。ipはユーザーモードで実行するアドレス (エントリーポイント)、pagerは
 // ページャータスク。
 task_t task_create(const char *name, uaddr_t ip, struct task *pager) {
-    task_t tid = alloc_tid();
-    if (!tid) {
-        return ERR_TOO_MANY_TASKS;
+    struct task *task;
+    error_t err = alloc_task(&task);
+    if (err != OK) {
+        return err;
     }
 
-    struct task *task = &tasks[tid - 1];
-    DEBUG_ASSERT(task != NULL);
-
-    error_t err = init_task_struct(task, tid, name, ip, pager, 0, NULL);
+    task_t tid = task->tid;
+    err = init_task_struct(task, tid, name, ip, pager, 0, NULL);
     if (err != OK) {
+        free_task(task);
         return err;
     }
 
+    spin_lock(&tasks_lock);
+    tasks[tid - 1] = task;
+    spin_unlock(&tasks_lock);
     list_push_back(&active_tasks, &task->next);
     task_resume(task);
     TRACE("created a task \"%s\" (tid=%d)", name, tid);
@@ -160,17 +505,17 @@ task_t task_create(const char *name, uaddr_t ip, struct task *pager) {
 // hinavm.c ではなくここで書かれているのは、init_task_struct関数などを呼び出すため。
 task_t hinavm_create(const char *name, hinavm_inst_t *insts, uint32_t num_insts,
                      struct task *pager) {
-    task_t tid = alloc_tid();
-    if (!tid) {
-        return ERR_TOO_MANY_TASKS;
+    struct task *task;
+    error_t err = alloc_task(&task);
+    if (err != OK) {
+        return err;
     }
 
-    struct task *task = &tasks[tid - 1];
-    DEBUG_ASSERT(task != NULL);
-
+    task_t tid = task->tid;
     size_t hinavm_size = ALIGN_UP(sizeof(struct hinavm), PAGE_SIZE);
     paddr_t hinavm_paddr = pm_alloc(hinavm_size, NULL, PM_ALLOC_UNINITIALIZED);
     if (!hinavm_paddr) {
+        free_task(task);
         return ERR_NO_MEMORY;
     }
 
@@ -178,20 +523,49 @@ task_t hinavm_create(const char *name, hinavm_inst_t *insts, uint32_t num_insts,
     memcpy(&hinavm->insts, insts, sizeof(hinavm_inst_t) * num_insts);
     hinavm->num_insts = num_insts;
 
-    error_t err = init_task_struct(task, tid, name, 0, pager,
-                                   (vaddr_t) hinavm_run, hinavm);
+    err = init_task_struct(task, tid, name, 0, pager, (vaddr_t) hinavm_run,
+                           hinavm);
     if (err != OK) {
         pm_free(hinavm_paddr, hinavm_size);
+        free_task(task);
         return err;
     }
 
     pm_own_page(hinavm_paddr, task);
+    spin_lock(&tasks_lock);
+    tasks[tid - 1] = task;
+    spin_unlock(&tasks_lock);
     list_push_back(&active_tasks, &task->next);
     task_resume(task);
     TRACE("created a HinaVM task \"%s\" (tid=%d)", name, tid);
     return tid;
 }
 
+// taskが他のタスクへの送信待ちでブロックしていれば、宛先タスクのロックを取ってその送信待ち
+// キューから取り除く。取り除いたか送信待ちでなかった場合はtrueを返し、宛先タスクが先に
+// 取り出していた場合はfalseを返す。
+//
+// 宛先タスクが削除される場合はカーネルロックを持った状態で送信待ちを中断させるので、
+// カーネルロックを持って呼べば宛先タスクが解放されることはない。
+static bool unlink_blocked_sender(struct task *task) {
+    task_t dst_tid = task->blocked_on;
+    if (!dst_tid) {
+        return true;
+    }
+
+    struct task *dst = task_find(dst_tid);
+    DEBUG_ASSERT(dst != NULL);
+
+    spin_lock(&dst->lock);
+    bool linked = task->blocked_on == dst_tid;
+    if (linked) {
+        list_remove(&task->waitqueue_next);
+        task->blocked_on = 0;
+    }
+    spin_unlock(&dst->lock);
+    return linked;
+}
+
 // タスクを削除する。taskは削除するタスク。taskが実行中のタスクである場合は、この関数では
 // なく、task_exit関数を呼び出す必要がある。
 error_t task_destroy(struct task *task) {
@@ -219,37 +593,85 @@ error_t task_destroy(struct task *task) {
     // 削除中であること記録しておくことで、以下のプロセッサ間割り込みを受け取った他のCPUでの
     // スケジューラが再びこのタスクを選ばないようにする。こうしておかないと、もしこのタスク以外
     // に実行可能なタスクが存在しない場合に以下のループが永久に実行される恐れがある。
+    spin_lock(&task->lock);
     task->destroyed = true;
+    spin_unlock(&task->lock);
+
+    // 他のCPUがこのタスクをピン留めしていれば、外れるまで待つ。ピン留めしたままブロック
+    // することはないので、すぐに外れる。ピン留めしているCPUがカーネルロックを必要とする
+    // (ページの受け渡しなど) 場合に備えて、待つ間はカーネルロックを解放する。
+    while (atomic_load(&task->num_pins) > 0) {
+        arch_unlock_kernel();
+        arch_lock_kernel();
+    }
 
-    // 他のCPUがこのタスクの実行を中断するまで待つ。
-    while (true) {
-        // タスクがブロックされていれば明らかに現在実行中ではない。
-        if (task->state != TASK_RUNNABLE) {
-            break;
-        }
+    // タイマーと割り込みの通知も止める。以降はこのタスクを再開させ得るのは、送信待ち
+    // キューから取り出した宛先タスクだけになる。
+    timer_set(task, 0);
+    irq_unlisten_all(task);
 
-        // タスクが実行可能状態であってもランキューに含まれていなければ現在実行中ではない。
-        if (list_contains(&runqueue, &task->waitqueue_next)) {
-            break;
+    // 他のCPUがこのタスクの実行を中断するまで待つ。スケジューラはカーネルロックを取らずに
+    // 動くので、実行中でないことを確かめた上で、ランキューや送信待ちキューから取り除く。
+    while (true) {
+        if (!atomic_load(&task->on_cpu)) {
+            if (task->state == TASK_RUNNABLE) {
+                // 他のCPUのスケジューラが取り出す前にランキューから取り除けば、以降は
+                // 実行されない。
+                if (runqueue_remove(task)) {
+                    break;
+                }
+            } else if (unlink_blocked_sender(task)) {
+                // 送信待ちを取り除く前に宛先タスクが再開させていないか確かめる。
+                full_memory_barrier();
+                if (task->state == TASK_BLOCKED) {
+                    break;
+                }
+            }
         }
 
-        // 他のCPUがこのタスクを実行中である。IPIを送信してコンテキストスイッチを促す。
+        // 他のCPUがこのタスクを実行中 (または切り替え途中) である。IPIを送信して
+        // コンテキストスイッチを促す。
         arch_send_ipi(IPI_RESCHEDULE);
     }
 
+    // シリアルポートの入力待ちであれば、その待ちリストから取り除く (カーネルロックで保護)。
+    if (task->state == TASK_BLOCKED) {
+        list_remove(&task->waitqueue_next);
+    }
+
     // もしこのタスクへメッセージを送ろうとしているタスクがいたら、それらの送信処理を中断させる。
-    LIST_FOR_EACH (sender, &task->senders, struct task, waitqueue_next) {
-        notify(sender, NOTIFY_ABORTED);
+    // 2つのタスクのロックを同時に保持しないよう (IPCの送信処理と同じ)、送信待ちキューから
+    // 取り出したらこのタスクのロックを解放してから送信元のロックを取る。
+    spin_lock(&task->lock);
+    while (!list_is_empty(&task->senders)) {
+        struct task *sender =
+            LIST_POP_FRONT(&task->senders, struct task, waitqueue_next);
+        sender->blocked_on = 0;
+        spin_unlock(&task->lock);
+
+        spin_lock(&sender->lock);
+        sender->notifications |= NOTIFY_ABORTED;
+        spin_unlock(&sender->lock);
+        task_resume(sender);
+
+        spin_lock(&task->lock);
     }
+    spin_unlock(&task->lock);
 
     // カーネルからタスクを削除する。
     list_remove(&task->next);
-    list_remove(&task->waitqueue_next);
+    async_sender_forget(task);
     arch_vm_destroy(&task->vm);
     arch_task_destroy(task);
     pm_free_by_list(&task->pages);
+    if (task->asyncq) {
+        pm_free(task->asyncq->paddr,
+                ALIGN_UP(sizeof(struct async_queue), PAGE_SIZE));
+    }
+
     task->state = TASK_UNUSED;
     task->pager->ref_count--;
+    free_task(task);
     return OK;
 }
 
@@ -267,7 +689,7 @@ __noreturn void task_exit(int exception) {
     m.type = EXCEPTION_MSG;
     m.exception.task = CURRENT_TASK->tid;
     m.exception.reason = exception;
-    error_t err = ipc(CURRENT_TASK->pager, IPC_DENY,
+    error_t err = ipc(pager->tid, IPC_DENY,
                       (__user struct message *) &m, IPC_SEND | IPC_KERNEL);
 
     if (err != OK) {
@@ -319,10 +741,25 @@ void task_dump(void) {
 }
 
 // タスク管理システムの初期化
+void task_init(void) {
+    spinlock_init(&tasks_lock, "tasks");
+}
+
+// タスク管理システムのCPUごとの初期化
 void task_init_percpu(void) {
     // CPUごとのアイドルタスクを作成し、それを実行中タスクとする。
+    for (int i = 0; i < NUM_TASK_PRIORITIES; i++) {
+        list_init(&CPUVAR->runqueues[i]);
+    }
+
+    CPUVAR->runqueue_bitmap = 0;
+    CPUVAR->num_runnable = 0;
+    spinlock_init(&CPUVAR->runqueue_lock, "runqueue");
+
     struct task *idle_task = &idle_tasks[CPUVAR->id];
     ASSERT_OK(init_task_struct(idle_task, 0, "(idle)", 0, NULL, 0, NULL));
+    idle_task->priority = IDLE_TASK_PRIORITY;
+    idle_task->on_cpu = true;
     IDLE_TASK = idle_task;
     CURRENT_TASK = IDLE_TASK;
 }
@@ -6,8 +6,13 @@
 #include <libs/common/message.h>
 #include <libs/common/types.h>
 
-// タスクの最大連続実行時間
-#define TASK_QUANTUM (20 * (TICK_HZ / 1000)) /* 20ミリ秒 */
+// タスクの最大連続実行時間。優先度が高いタスクほど短く、8段階ごとに倍になる
+// (5, 10, 20, 40ミリ秒)。優先度の高いタスクは短い処理を頻繁に行うことが多く、優先度の
+// 低いタスクはまとめて長く実行させた方がコンテキストスイッチが少なくて済む。
+#define TASK_QUANTUM(priority) ((5 << ((priority) / 8)) * (TICK_HZ / 1000))
+
+// アイドルタスクの優先度。どのタスクよりも低い。
+#define IDLE_TASK_PRIORITY NUM_TASK_PRIORITIES
 
 // 現在のCPUのアイドルタスク (struct task *)
 #define IDLE_TASK (arch_cpuvar_get()->idle_task)
@@ -19,6 +24,21 @@
 #define TASK_RUNNABLE 1
 #define TASK_BLOCKED  2
 
+// タスクIDの集合を表すビットマップ。タスクID tid は (tid - 1) 番目のビットに対応する。
+typedef uint32_t tid_bitmap_t[NUM_TASKS_MAX / 32];
+STATIC_ASSERT(NUM_TASKS_MAX % 32 == 0, "NUM_TASKS_MAX must be a multiple of 32");
+
+// 非同期メッセージのキューに入れられる最大メッセージ数
+#define ASYNC_QUEUE_LEN 8
+
+// 非同期メッセージのキュー (リングバッファ)。最初に非同期メッセージを受け取るときに割り当てる。
+struct async_queue {
+    paddr_t paddr;                             // このキュー自身の物理アドレス
+    unsigned head;                             // 次に取り出すメッセージの位置
+    unsigned num_messages;                     // キュー内のメッセージ数
+    struct message messages[ASYNC_QUEUE_LEN];  // メッセージ
+};
+
 // タスク管理構造体
 struct task {
     struct arch_task arch;          // CPU依存のタスク情報
@@ -27,23 +47,42 @@ struct task {
     char name[TASK_NAME_LEN];       // タスク名
     int state;                      // タスクの状態
     bool destroyed;                 // タスクが削除されている途中かどうか
+    bool on_cpu;                    // いずれかのCPUで実行中 (または切り替え途中) か
     struct task *pager;             // ページャータスク
-    unsigned timeout;               // タイムアウトの残り時間
+    unsigned timeout;               // タイムアウトの時刻 (uptime_ticks)
+    int timer_index;                // タイマーのヒープ内の位置 (未設定なら-1)
     int ref_count;                  // タスクが参照されている数 (ゼロでないと削除不可)
+    unsigned num_pins;              // ピン留めされている数 (ゼロになるまで削除を待つ)
+                                    // (アトミックに増減する)
     unsigned quantum;               // タスクの残りクォンタム
+    int priority;                   // 優先度 (値が小さいほど優先度が高い)
+    int cpu;                        // 最後に実行された (またはランキューに入っている) CPU
     list_elem_t waitqueue_next;     // 各種待ちリストの次の要素へのポインタ
     list_elem_t next;               // 全タスクリストの次の要素へのポインタ
+    spinlock_t lock;                // senders, wait_for, notifications, m,
+                                    // destroyed のロック
     list_t senders;                 // このタスクへの送信待ちタスクリスト
+    task_t blocked_on;              // 送信待ちキューに入っている宛先タスクのID
+                                    // (宛先タスクのロックで保護)
     task_t wait_for;                // このタスクへメッセージ送信ができるタスクID
                                     // (IPC_ANYの場合は全て)
     list_t pages;                   // 利用中メモリページのリスト
+    spinlock_t pages_lock;          // pagesのロック
+    uaddr_t message_pages_hint;     // ページ受け取り領域の空きを探し始める位置
     notifications_t notifications;  // 受信済みの通知
+    tid_bitmap_t async_senders;     // 非同期メッセージの送信元タスクの集合
+    unsigned num_async_senders;     // async_sendersで立っているビットの数
+    unsigned async_cursor;          // async_sendersを次に探し始める位置
+    struct async_queue *asyncq;     // 非同期メッセージのキュー (未割り当てならNULL)
+    paddr_t paddr;                  // このタスク管理構造体自身の物理アドレス
     struct message m;               // メッセージの一時保存領域
 };
 
 extern list_t active_tasks;
 
 struct task *task_find(task_t tid);
+struct task *task_pin(task_t tid);
+void task_unpin(struct task *task);
 task_t task_create(const char *name, uaddr_t ip, struct task *pager);
 task_t hinavm_create(const char *name, hinavm_inst_t *insts, uint32_t num_insts,
                      struct task *pager);
@@ -51,6 +90,10 @@ error_t task_destroy(struct task *task);
 __noreturn void task_exit(int exception);
 void task_resume(struct task *task);
 void task_block(struct task *task);
+void task_set_priority(struct task *task, int priority);
 void task_switch(void);
+void task_switch_to(struct task *next);
+void task_switch_finish(void);
 void task_dump(void);
+void task_init(void);
 void task_init_percpu(void);
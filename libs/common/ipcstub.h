@@ -27,6 +27,7 @@ struct page_fault_reply_fields {
 
 struct notify_fields {
     notifications_t notifications;
+    task_t async_src;
 };
 
 struct notify_irq_fields {
@@ -35,6 +36,9 @@ struct notify_irq_fields {
 struct notify_timer_fields {
 };
 
+struct notify_channel_fields {
+};
+
 struct async_recv_fields {
 };
 struct async_recv_reply_fields {
@@ -101,36 +105,62 @@ struct vm_alloc_physical_reply_fields {
     paddr_t paddr;
 };
 
+struct vm_alloc_shared_fields {
+    task_t peer;
+    size_t size;
+};
+struct vm_alloc_shared_reply_fields {
+    uaddr_t uaddr;
+    uaddr_t peer_uaddr;
+};
+
+struct fork_task_fields {
+    uaddr_t ip;
+};
+struct fork_task_reply_fields {
+    task_t task;
+};
+
 struct blk_read_fields {
+    uaddr_t buf;
+    size_t buf_len;
     unsigned sector;
-    size_t offset;
     size_t len;
 };
 struct blk_read_reply_fields {
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
 };
 
 struct blk_write_fields {
-    unsigned sector;
-    size_t offset;
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
+    unsigned sector;
 };
 struct blk_write_reply_fields {
+    uaddr_t buf;
+    size_t buf_len;
+};
+
+struct blk_open_fields {
+    uaddr_t req_channel;
+    uaddr_t resp_channel;
+};
+struct blk_open_reply_fields {
+};
+
+struct blk_process_fields {
+};
+struct blk_process_reply_fields {
 };
 
 struct net_open_fields {
+    uaddr_t rx_channel;
 };
 struct net_open_reply_fields {
     uint8_t macaddr[6];
 };
 
-struct net_recv_fields {
-    uint8_t payload[1500];
-    size_t payload_len;
-};
-
 struct net_send_fields {
     uint8_t payload[1500];
     size_t payload_len;
@@ -153,20 +183,25 @@ struct fs_close_reply_fields {
 };
 
 struct fs_read_fields {
+    uaddr_t buf;
+    size_t buf_len;
     int fd;
     size_t len;
 };
 struct fs_read_reply_fields {
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
+    size_t read_len;
 };
 
 struct fs_write_fields {
-    int fd;
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
+    int fd;
 };
 struct fs_write_reply_fields {
+    uaddr_t buf;
+    size_t buf_len;
     size_t written_len;
 };
 
@@ -198,6 +233,11 @@ struct fs_delete_fields {
 struct fs_delete_reply_fields {
 };
 
+struct fs_sync_fields {
+};
+struct fs_sync_reply_fields {
+};
+
 struct tcpip_connect_fields {
     uint32_t dst_addr;
     uint16_t dst_port;
@@ -213,19 +253,25 @@ struct tcpip_close_reply_fields {
 };
 
 struct tcpip_write_fields {
-    int sock;
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
+    int sock;
 };
 struct tcpip_write_reply_fields {
+    uaddr_t buf;
+    size_t buf_len;
 };
 
 struct tcpip_read_fields {
+    uaddr_t buf;
+    size_t buf_len;
     int sock;
+    size_t len;
 };
 struct tcpip_read_reply_fields {
-    uint8_t data[1024];
+    uaddr_t data;
     size_t data_len;
+    size_t read_len;
 };
 
 struct tcpip_dns_resolve_fields {
@@ -243,6 +289,18 @@ struct tcpip_closed_fields {
     int sock;
 };
 
+struct bench_data_fields {
+    int value;
+};
+
+struct bench_sync_fields {
+    int batch_size;
+};
+struct bench_sync_reply_fields {
+    int num_received;
+    int num_batches;
+};
+
 
 
 #define EXCEPTION_MSG 1
@@ -251,62 +309,75 @@ struct tcpip_closed_fields {
 #define NOTIFY_MSG 4
 #define NOTIFY_IRQ_MSG 5
 #define NOTIFY_TIMER_MSG 6
-#define ASYNC_RECV_MSG 7
-#define ASYNC_RECV_REPLY_MSG 8
-#define PING_MSG 9
-#define PING_REPLY_MSG 10
-#define SPAWN_TASK_MSG 11
-#define SPAWN_TASK_REPLY_MSG 12
-#define DESTROY_TASK_MSG 13
-#define DESTROY_TASK_REPLY_MSG 14
-#define SERVICE_LOOKUP_MSG 15
-#define SERVICE_LOOKUP_REPLY_MSG 16
-#define SERVICE_REGISTER_MSG 17
-#define SERVICE_REGISTER_REPLY_MSG 18
-#define WATCH_TASKS_MSG 19
-#define WATCH_TASKS_REPLY_MSG 20
-#define TASK_DESTROYED_MSG 21
-#define VM_MAP_PHYSICAL_MSG 22
-#define VM_MAP_PHYSICAL_REPLY_MSG 23
-#define VM_ALLOC_PHYSICAL_MSG 24
-#define VM_ALLOC_PHYSICAL_REPLY_MSG 25
-#define BLK_READ_MSG 26
-#define BLK_READ_REPLY_MSG 27
-#define BLK_WRITE_MSG 28
-#define BLK_WRITE_REPLY_MSG 29
-#define NET_OPEN_MSG 30
-#define NET_OPEN_REPLY_MSG 31
-#define NET_RECV_MSG 32
-#define NET_SEND_MSG 33
-#define NET_SEND_REPLY_MSG 34
-#define FS_OPEN_MSG 35
-#define FS_OPEN_REPLY_MSG 36
-#define FS_CLOSE_MSG 37
-#define FS_CLOSE_REPLY_MSG 38
-#define FS_READ_MSG 39
-#define FS_READ_REPLY_MSG 40
-#define FS_WRITE_MSG 41
-#define FS_WRITE_REPLY_MSG 42
-#define FS_READDIR_MSG 43
-#define FS_READDIR_REPLY_MSG 44
-#define FS_MKFILE_MSG 45
-#define FS_MKFILE_REPLY_MSG 46
-#define FS_MKDIR_MSG 47
-#define FS_MKDIR_REPLY_MSG 48
-#define FS_DELETE_MSG 49
-#define FS_DELETE_REPLY_MSG 50
-#define TCPIP_CONNECT_MSG 51
-#define TCPIP_CONNECT_REPLY_MSG 52
-#define TCPIP_CLOSE_MSG 53
-#define TCPIP_CLOSE_REPLY_MSG 54
-#define TCPIP_WRITE_MSG 55
-#define TCPIP_WRITE_REPLY_MSG 56
-#define TCPIP_READ_MSG 57
-#define TCPIP_READ_REPLY_MSG 58
-#define TCPIP_DNS_RESOLVE_MSG 59
-#define TCPIP_DNS_RESOLVE_REPLY_MSG 60
-#define TCPIP_DATA_MSG 61
-#define TCPIP_CLOSED_MSG 62
+#define NOTIFY_CHANNEL_MSG 7
+#define ASYNC_RECV_MSG 8
+#define ASYNC_RECV_REPLY_MSG 9
+#define PING_MSG 10
+#define PING_REPLY_MSG 11
+#define SPAWN_TASK_MSG 12
+#define SPAWN_TASK_REPLY_MSG 13
+#define DESTROY_TASK_MSG 14
+#define DESTROY_TASK_REPLY_MSG 15
+#define SERVICE_LOOKUP_MSG 16
+#define SERVICE_LOOKUP_REPLY_MSG 17
+#define SERVICE_REGISTER_MSG 18
+#define SERVICE_REGISTER_REPLY_MSG 19
+#define WATCH_TASKS_MSG 20
+#define WATCH_TASKS_REPLY_MSG 21
+#define TASK_DESTROYED_MSG 22
+#define VM_MAP_PHYSICAL_MSG 23
+#define VM_MAP_PHYSICAL_REPLY_MSG 24
+#define VM_ALLOC_PHYSICAL_MSG 25
+#define VM_ALLOC_PHYSICAL_REPLY_MSG 26
+#define VM_ALLOC_SHARED_MSG 27
+#define VM_ALLOC_SHARED_REPLY_MSG 28
+#define FORK_TASK_MSG 29
+#define FORK_TASK_REPLY_MSG 30
+#define BLK_READ_MSG 31
+#define BLK_READ_REPLY_MSG 32
+#define BLK_WRITE_MSG 33
+#define BLK_WRITE_REPLY_MSG 34
+#define BLK_OPEN_MSG 35
+#define BLK_OPEN_REPLY_MSG 36
+#define BLK_PROCESS_MSG 37
+#define BLK_PROCESS_REPLY_MSG 38
+#define NET_OPEN_MSG 39
+#define NET_OPEN_REPLY_MSG 40
+#define NET_SEND_MSG 41
+#define NET_SEND_REPLY_MSG 42
+#define FS_OPEN_MSG 43
+#define FS_OPEN_REPLY_MSG 44
+#define FS_CLOSE_MSG 45
+#define FS_CLOSE_REPLY_MSG 46
+#define FS_READ_MSG 47
+#define FS_READ_REPLY_MSG 48
+#define FS_WRITE_MSG 49
+#define FS_WRITE_REPLY_MSG 50
+#define FS_READDIR_MSG 51
+#define FS_READDIR_REPLY_MSG 52
+#define FS_MKFILE_MSG 53
+#define FS_MKFILE_REPLY_MSG 54
+#define FS_MKDIR_MSG 55
+#define FS_MKDIR_REPLY_MSG 56
+#define FS_DELETE_MSG 57
+#define FS_DELETE_REPLY_MSG 58
+#define FS_SYNC_MSG 59
+#define FS_SYNC_REPLY_MSG 60
+#define TCPIP_CONNECT_MSG 61
+#define TCPIP_CONNECT_REPLY_MSG 62
+#define TCPIP_CLOSE_MSG 63
+#define TCPIP_CLOSE_REPLY_MSG 64
+#define TCPIP_WRITE_MSG 65
+#define TCPIP_WRITE_REPLY_MSG 66
+#define TCPIP_READ_MSG 67
+#define TCPIP_READ_REPLY_MSG 68
+#define TCPIP_DNS_RESOLVE_MSG 69
+#define TCPIP_DNS_RESOLVE_REPLY_MSG 70
+#define TCPIP_DATA_MSG 71
+#define TCPIP_CLOSED_MSG 72
+#define BENCH_DATA_MSG 73
+#define BENCH_SYNC_MSG 74
+#define BENCH_SYNC_REPLY_MSG 75
 
 //
 //  各種マクロの定義
@@ -318,6 +389,7 @@ struct tcpip_closed_fields {
     struct notify_fields notify; \
     struct notify_irq_fields notify_irq; \
     struct notify_timer_fields notify_timer; \
+    struct notify_channel_fields notify_channel; \
     struct async_recv_fields async_recv; \
     struct async_recv_reply_fields async_recv_reply; \
     struct ping_fields ping; \
@@ -337,13 +409,20 @@ struct tcpip_closed_fields {
     struct vm_map_physical_reply_fields vm_map_physical_reply; \
     struct vm_alloc_physical_fields vm_alloc_physical; \
     struct vm_alloc_physical_reply_fields vm_alloc_physical_reply; \
+    struct vm_alloc_shared_fields vm_alloc_shared; \
+    struct vm_alloc_shared_reply_fields vm_alloc_shared_reply; \
+    struct fork_task_fields fork_task; \
+    struct fork_task_reply_fields fork_task_reply; \
     struct blk_read_fields blk_read; \
     struct blk_read_reply_fields blk_read_reply; \
     struct blk_write_fields blk_write; \
     struct blk_write_reply_fields blk_write_reply; \
+    struct blk_open_fields blk_open; \
+    struct blk_open_reply_fields blk_open_reply; \
+    struct blk_process_fields blk_process; \
+    struct blk_process_reply_fields blk_process_reply; \
     struct net_open_fields net_open; \
     struct net_open_reply_fields net_open_reply; \
-    struct net_recv_fields net_recv; \
     struct net_send_fields net_send; \
     struct net_send_reply_fields net_send_reply; \
     struct fs_open_fields fs_open; \
@@ -362,6 +441,8 @@ struct tcpip_closed_fields {
     struct fs_mkdir_reply_fields fs_mkdir_reply; \
     struct fs_delete_fields fs_delete; \
     struct fs_delete_reply_fields fs_delete_reply; \
+    struct fs_sync_fields fs_sync; \
+    struct fs_sync_reply_fields fs_sync_reply; \
     struct tcpip_connect_fields tcpip_connect; \
     struct tcpip_connect_reply_fields tcpip_connect_reply; \
     struct tcpip_close_fields tcpip_close; \
@@ -374,8 +455,11 @@ struct tcpip_closed_fields {
     struct tcpip_dns_resolve_reply_fields tcpip_dns_resolve_reply; \
     struct tcpip_data_fields tcpip_data; \
     struct tcpip_closed_fields tcpip_closed; \
+    struct bench_data_fields bench_data; \
+    struct bench_sync_fields bench_sync; \
+    struct bench_sync_reply_fields bench_sync_reply; \
 
-#define IPCSTUB_MSGID_MAX 62
+#define IPCSTUB_MSGID_MAX 75
 #define IPCSTUB_MSGID2STR \
     (const char *[]){ \
      \
@@ -390,92 +474,128 @@ struct tcpip_closed_fields {
      \
         [6] = "notify_timer", \
      \
-        [7] = "async_recv", \
-        [8] = "async_recv_reply", \
+        [7] = "notify_channel", \
+     \
+        [8] = "async_recv", \
+        [9] = "async_recv_reply", \
      \
-        [9] = "ping", \
-        [10] = "ping_reply", \
+        [10] = "ping", \
+        [11] = "ping_reply", \
      \
-        [11] = "spawn_task", \
-        [12] = "spawn_task_reply", \
+        [12] = "spawn_task", \
+        [13] = "spawn_task_reply", \
      \
-        [13] = "destroy_task", \
-        [14] = "destroy_task_reply", \
+        [14] = "destroy_task", \
+        [15] = "destroy_task_reply", \
      \
-        [15] = "service_lookup", \
-        [16] = "service_lookup_reply", \
+        [16] = "service_lookup", \
+        [17] = "service_lookup_reply", \
      \
-        [17] = "service_register", \
-        [18] = "service_register_reply", \
+        [18] = "service_register", \
+        [19] = "service_register_reply", \
      \
-        [19] = "watch_tasks", \
-        [20] = "watch_tasks_reply", \
+        [20] = "watch_tasks", \
+        [21] = "watch_tasks_reply", \
      \
-        [21] = "task_destroyed", \
+        [22] = "task_destroyed", \
      \
-        [22] = "vm_map_physical", \
-        [23] = "vm_map_physical_reply", \
+        [23] = "vm_map_physical", \
+        [24] = "vm_map_physical_reply", \
      \
-        [24] = "vm_alloc_physical", \
-        [25] = "vm_alloc_physical_reply", \
+        [25] = "vm_alloc_physical", \
+        [26] = "vm_alloc_physical_reply", \
      \
-        [26] = "blk_read", \
-        [27] = "blk_read_reply", \
+        [27] = "vm_alloc_shared", \
+        [28] = "vm_alloc_shared_reply", \
      \
-        [28] = "blk_write", \
-        [29] = "blk_write_reply", \
+        [29] = "fork_task", \
+        [30] = "fork_task_reply", \
      \
-        [30] = "net_open", \
-        [31] = "net_open_reply", \
+        [31] = "blk_read", \
+        [32] = "blk_read_reply", \
      \
-        [32] = "net_recv", \
+        [33] = "blk_write", \
+        [34] = "blk_write_reply", \
      \
-        [33] = "net_send", \
-        [34] = "net_send_reply", \
+        [35] = "blk_open", \
+        [36] = "blk_open_reply", \
      \
-        [35] = "fs_open", \
-        [36] = "fs_open_reply", \
+        [37] = "blk_process", \
+        [38] = "blk_process_reply", \
      \
-        [37] = "fs_close", \
-        [38] = "fs_close_reply", \
+        [39] = "net_open", \
+        [40] = "net_open_reply", \
      \
-        [39] = "fs_read", \
-        [40] = "fs_read_reply", \
+        [41] = "net_send", \
+        [42] = "net_send_reply", \
      \
-        [41] = "fs_write", \
-        [42] = "fs_write_reply", \
+        [43] = "fs_open", \
+        [44] = "fs_open_reply", \
      \
-        [43] = "fs_readdir", \
-        [44] = "fs_readdir_reply", \
+        [45] = "fs_close", \
+        [46] = "fs_close_reply", \
      \
-        [45] = "fs_mkfile", \
-        [46] = "fs_mkfile_reply", \
+        [47] = "fs_read", \
+        [48] = "fs_read_reply", \
      \
-        [47] = "fs_mkdir", \
-        [48] = "fs_mkdir_reply", \
+        [49] = "fs_write", \
+        [50] = "fs_write_reply", \
      \
-        [49] = "fs_delete", \
-        [50] = "fs_delete_reply", \
+        [51] = "fs_readdir", \
+        [52] = "fs_readdir_reply", \
      \
-        [51] = "tcpip_connect", \
-        [52] = "tcpip_connect_reply", \
+        [53] = "fs_mkfile", \
+        [54] = "fs_mkfile_reply", \
      \
-        [53] = "tcpip_close", \
-        [54] = "tcpip_close_reply", \
+        [55] = "fs_mkdir", \
+        [56] = "fs_mkdir_reply", \
      \
-        [55] = "tcpip_write", \
-        [56] = "tcpip_write_reply", \
+        [57] = "fs_delete", \
+        [58] = "fs_delete_reply", \
      \
-        [57] = "tcpip_read", \
-        [58] = "tcpip_read_reply", \
+        [59] = "fs_sync", \
+        [60] = "fs_sync_reply", \
      \
-        [59] = "tcpip_dns_resolve", \
-        [60] = "tcpip_dns_resolve_reply", \
+        [61] = "tcpip_connect", \
+        [62] = "tcpip_connect_reply", \
      \
-        [61] = "tcpip_data", \
+        [63] = "tcpip_close", \
+        [64] = "tcpip_close_reply", \
      \
-        [62] = "tcpip_closed", \
+        [65] = "tcpip_write", \
+        [66] = "tcpip_write_reply", \
      \
+        [67] = "tcpip_read", \
+        [68] = "tcpip_read_reply", \
+     \
+        [69] = "tcpip_dns_resolve", \
+        [70] = "tcpip_dns_resolve_reply", \
+     \
+        [71] = "tcpip_data", \
+     \
+        [72] = "tcpip_closed", \
+     \
+        [73] = "bench_data", \
+     \
+        [74] = "bench_sync", \
+        [75] = "bench_sync_reply", \
+     \
+    }
+
+#define IPCSTUB_PAGES_MSGIDS \
+    (const bool[IPCSTUB_MSGID_MAX + 1]){ \
+        [31] = true, \
+        [32] = true, \
+        [33] = true, \
+        [34] = true, \
+        [47] = true, \
+        [48] = true, \
+        [49] = true, \
+        [50] = true, \
+        [65] = true, \
+        [66] = true, \
+        [67] = true, \
+        [68] = true, \
     }
 
 #define IPCSTUB_STATIC_ASSERTIONS \
@@ -503,6 +623,10 @@ struct tcpip_closed_fields {
         sizeof(struct notify_timer_fields) < 4096, \
         "'notify_timer' message is too large, should be less than 4096 bytes" \
     ); \
+    _Static_assert( \
+        sizeof(struct notify_channel_fields) < 4096, \
+        "'notify_channel' message is too large, should be less than 4096 bytes" \
+    ); \
     _Static_assert( \
         sizeof(struct async_recv_fields) < 4096, \
         "'async_recv' message is too large, should be less than 4096 bytes" \
@@ -579,6 +703,22 @@ struct tcpip_closed_fields {
         sizeof(struct vm_alloc_physical_reply_fields) < 4096, \
         "'vm_alloc_physical_reply' message is too large, should be less than 4096 bytes" \
     ); \
+    _Static_assert( \
+        sizeof(struct vm_alloc_shared_fields) < 4096, \
+        "'vm_alloc_shared' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct vm_alloc_shared_reply_fields) < 4096, \
+        "'vm_alloc_shared_reply' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct fork_task_fields) < 4096, \
+        "'fork_task' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct fork_task_reply_fields) < 4096, \
+        "'fork_task_reply' message is too large, should be less than 4096 bytes" \
+    ); \
     _Static_assert( \
         sizeof(struct blk_read_fields) < 4096, \
         "'blk_read' message is too large, should be less than 4096 bytes" \
@@ -595,6 +735,22 @@ struct tcpip_closed_fields {
         sizeof(struct blk_write_reply_fields) < 4096, \
         "'blk_write_reply' message is too large, should be less than 4096 bytes" \
     ); \
+    _Static_assert( \
+        sizeof(struct blk_open_fields) < 4096, \
+        "'blk_open' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct blk_open_reply_fields) < 4096, \
+        "'blk_open_reply' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct blk_process_fields) < 4096, \
+        "'blk_process' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct blk_process_reply_fields) < 4096, \
+        "'blk_process_reply' message is too large, should be less than 4096 bytes" \
+    ); \
     _Static_assert( \
         sizeof(struct net_open_fields) < 4096, \
         "'net_open' message is too large, should be less than 4096 bytes" \
@@ -603,10 +759,6 @@ struct tcpip_closed_fields {
         sizeof(struct net_open_reply_fields) < 4096, \
         "'net_open_reply' message is too large, should be less than 4096 bytes" \
     ); \
-    _Static_assert( \
-        sizeof(struct net_recv_fields) < 4096, \
-        "'net_recv' message is too large, should be less than 4096 bytes" \
-    ); \
     _Static_assert( \
         sizeof(struct net_send_fields) < 4096, \
         "'net_send' message is too large, should be less than 4096 bytes" \
@@ -679,6 +831,14 @@ struct tcpip_closed_fields {
         sizeof(struct fs_delete_reply_fields) < 4096, \
         "'fs_delete_reply' message is too large, should be less than 4096 bytes" \
     ); \
+    _Static_assert( \
+        sizeof(struct fs_sync_fields) < 4096, \
+        "'fs_sync' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct fs_sync_reply_fields) < 4096, \
+        "'fs_sync_reply' message is too large, should be less than 4096 bytes" \
+    ); \
     _Static_assert( \
         sizeof(struct tcpip_connect_fields) < 4096, \
         "'tcpip_connect' message is too large, should be less than 4096 bytes" \
@@ -727,4 +887,16 @@ struct tcpip_closed_fields {
         sizeof(struct tcpip_closed_fields) < 4096, \
         "'tcpip_closed' message is too large, should be less than 4096 bytes" \
     ); \
+    _Static_assert( \
+        sizeof(struct bench_data_fields) < 4096, \
+        "'bench_data' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct bench_sync_fields) < 4096, \
+        "'bench_sync' message is too large, should be less than 4096 bytes" \
+    ); \
+    _Static_assert( \
+        sizeof(struct bench_sync_reply_fields) < 4096, \
+        "'bench_sync_reply' message is too large, should be less than 4096 bytes" \
+    ); \
 
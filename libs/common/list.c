@@ -85,11 +85,19 @@ void list_remove(list_elem_t *elem) {
 
 // エントリをリストの末尾に追加する。O(1)。
 void list_push_back(list_t *list, list_elem_t *new_tail) {
-    DEBUG_ASSERT(!list_contains(list, new_tail));
+    // 既にいずれかのリストに入っていないかを確認する。list_contains関数で調べるとO(n)に
+    // なってしまうので使わない。
     DEBUG_ASSERT(!list_is_linked(new_tail));
     list_insert(list->prev, list, new_tail);
 }
 
+// エントリnextの直前に新しいエントリを追加する。nextにリスト自体を渡すと末尾に追加する。
+// O(1)。
+void list_insert_before(list_elem_t *next, list_elem_t *new) {
+    DEBUG_ASSERT(!list_is_linked(new));
+    list_insert(next->prev, next, new);
+}
+
 // リストの先頭エントリを取り出す。空の場合はNULLを返す。O(1)。
 list_elem_t *list_pop_front(list_t *list) {
     struct list *head = list->next;
@@ -11,3 +11,12 @@ const char *msgtype2str(int type) {
 
     return IPCSTUB_MSGID2STR[type];
 }
+
+// メッセージの種類がページを添付するもの (先頭にpages型のフィールドを持つ) かどうかを返す。
+bool msgtype_has_pages(int type) {
+    if (type <= 0 || type > IPCSTUB_MSGID_MAX) {
+        return false;
+    }
+
+    return IPCSTUB_PAGES_MSGIDS[type];
+}
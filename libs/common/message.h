@@ -8,19 +8,15 @@
 #define IPC_RECV    (1 << 17)
 #define IPC_NOBLOCK (1 << 18)
 #define IPC_KERNEL  (1 << 19)
+#define IPC_REPLY   (1 << 20)  // 送信処理のみノンブロッキングにする (返信用)
+#define IPC_ASYNC   (1 << 21)  // 宛先のキューに入れて即座に戻る (非同期送信)
 #define IPC_CALL    (IPC_SEND | IPC_RECV)
 
-#define NOTIFY_TIMER       (1 << 0)
-#define NOTIFY_IRQ         (1 << 1)
-#define NOTIFY_ABORTED     (1 << 2)
-#define NOTIFY_ASYNC_BASE  3
-#define NOTIFY_ASYNC(tid)  (1 << (NOTIFY_ASYNC_BASE + tid))
-#define NOTIFY_ASYNC_START (NOTIFY_ASYNC(0))
-#define NOTIFY_ASYNC_END   (NOTIFY_ASYNC(NUM_TASKS_MAX))
-
-// 各タスクは専用のASYNC用ビットフィールドをnotification_tに持つ
-STATIC_ASSERT(NOTIFY_ASYNC_BASE + NUM_TASKS_MAX < sizeof(notifications_t) * 8,
-              "too many tasks for notifications_t");
+#define NOTIFY_TIMER   (1 << 0)
+#define NOTIFY_IRQ     (1 << 1)
+#define NOTIFY_ABORTED (1 << 2)
+#define NOTIFY_ASYNC   (1 << 3)  // 未受信の非同期メッセージがある
+#define NOTIFY_CHANNEL (1 << 4)  // チャネルにデータが届いた
 
 struct message {
     int32_t type;  // メッセージの種類 (負の数の場合はエラー値)
@@ -40,4 +36,30 @@ struct message {
 STATIC_ASSERT(sizeof(struct message) < 2048,
               "sizeof(struct message) too large");
 
+// ipc_batchシステムコールで一度に送信・受信できるメッセージの最大数
+#define IPC_BATCH_MAX 32
+
+// ipc_batchシステムコールで送信するメッセージ
+struct ipc_batch_send {
+    task_t dst;        // 宛先タスク
+    error_t result;    // 送信結果 (カーネルが設定する)
+    struct message m;  // 送信するメッセージ
+};
+
+// メッセージに添付できるページ数の最大値
+#define MESSAGE_PAGES_MAX 16
+// 添付されたページを受け取る仮想アドレス領域。カーネルが各タスクのこの領域から空いている
+// 仮想アドレスを選んでマップする。
+#define MESSAGE_PAGES_BASE 0x40000000
+#define MESSAGE_PAGES_END  0x41000000
+
+// メッセージに添付されたページ (IDLのpages型フィールド)。メッセージデータの先頭に置かれる。
+// 送信に成功すると、ページは送信元からアンマップされて宛先タスクの所有になり、uaddrは宛先
+// タスクでの仮想アドレスに書き換えられる。
+struct message_pages {
+    uaddr_t uaddr;  // 先頭の仮想アドレス (ページ境界)
+    size_t len;     // 長さ。切り上げたページ数分が移動する (0なら何も添付しない)
+};
+
 const char *msgtype2str(int type);
+bool msgtype_has_pages(int type);
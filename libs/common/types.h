@@ -73,10 +73,16 @@ typedef __builtin_va_list va_list;
 
 // アトミックにポインタの値を読み込む
 #define atomic_load(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+// アトミックにポインタの値を書き込む
+#define atomic_store(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
 // アトミックにポインタの値にビット論理和代入 (|=) を行う
 #define atomic_fetch_and_or(ptr, value) __sync_fetch_and_or(ptr, value)
 // アトミックにポインタの値にビット論理積代入 (&=) を行う
 #define atomic_fetch_and_and(ptr, value) __sync_fetch_and_and(ptr, value)
+// アトミックにポインタの値に加算代入 (+=) を行う
+#define atomic_fetch_and_add(ptr, value) __sync_fetch_and_add(ptr, value)
+// アトミックにポインタの値に減算代入 (-=) を行う
+#define atomic_fetch_and_sub(ptr, value) __sync_fetch_and_sub(ptr, value)
 // Compare-and-Swap (CAS) 操作: ptrの値がoldの場合に、newを代入して真を返す
 #define compare_and_swap(ptr, old, new)                                        \
     __sync_bool_compare_and_swap(ptr, old, new)
@@ -136,6 +142,8 @@ typedef __builtin_va_list va_list;
 
 // メモリページサイズ
 #define PAGE_SIZE 4096
+// PAGE_LARGEでマップする大きなページ (Sv32のメガページ) のサイズ
+#define LARGE_PAGE_SIZE (4 * 1024 * 1024)
 // ページフレーム番号のオフセット
 #define PFN_OFFSET 12
 // 物理アドレスからページフレーム番号を取り出す
@@ -149,23 +157,37 @@ typedef __builtin_va_list va_list;
 #define VM_SERVER 1
 
 // システムコール番号
-#define SYS_IPC          1
-#define SYS_NOTIFY       2
-#define SYS_SERIAL_WRITE 3
-#define SYS_SERIAL_READ  4
-#define SYS_TASK_CREATE  5
-#define SYS_TASK_DESTROY 6
-#define SYS_TASK_EXIT    7
-#define SYS_TASK_SELF    8
-#define SYS_PM_ALLOC     9
-#define SYS_VM_MAP       10
-#define SYS_VM_UNMAP     11
-#define SYS_IRQ_LISTEN   12
-#define SYS_IRQ_UNLISTEN 13
-#define SYS_TIME         14
-#define SYS_UPTIME       15
-#define SYS_HINAVM       16
-#define SYS_SHUTDOWN     17
+#define SYS_IPC               1
+#define SYS_NOTIFY            2
+#define SYS_SERIAL_WRITE      3
+#define SYS_SERIAL_READ       4
+#define SYS_TASK_CREATE       5
+#define SYS_TASK_DESTROY      6
+#define SYS_TASK_EXIT         7
+#define SYS_TASK_SELF         8
+#define SYS_PM_ALLOC          9
+#define SYS_VM_MAP            10
+#define SYS_VM_UNMAP          11
+#define SYS_IRQ_LISTEN        12
+#define SYS_IRQ_UNLISTEN      13
+#define SYS_TIME              14
+#define SYS_UPTIME            15
+#define SYS_HINAVM            16
+#define SYS_SHUTDOWN          17
+#define SYS_TASK_SET_PRIORITY 18
+#define SYS_IPC_BATCH         19
+#define SYS_PM_FREE           20
+#define SYS_VM_MAP_RANGE      21
+#define SYS_VM_UNMAP_RANGE    22
+#define SYS_VM_PADDR          23
+#define SYS_VM_PROTECT        24
+#define SYS_VM_SHARE          25
+
+// タスクの優先度 (値が小さいほど優先度が高い)
+#define NUM_TASK_PRIORITIES   32  // 優先度の段階数
+#define TASK_PRIORITY_HIGHEST 0   // 最も高い優先度
+#define TASK_PRIORITY_LOWEST  31  // 最も低い優先度
+#define TASK_PRIORITY_DEFAULT 16  // タスク生成時の優先度
 
 // pm_alloc() のフラグ
 #define PM_ALLOC_UNINITIALIZED 0         // ゼロクリアされていなくてもよい
@@ -177,6 +199,7 @@ typedef __builtin_va_list va_list;
 #define PAGE_WRITABLE   (1 << 2)  // 書き込み可能
 #define PAGE_EXECUTABLE (1 << 3)  // 実行可能
 #define PAGE_USER       (1 << 4)  // ユーザー空間からアクセス可能
+#define PAGE_LARGE      (1 << 5)  // LARGE_PAGE_SIZE単位でマップする
 
 // ページフォルトの理由
 #define PAGE_FAULT_READ    (1 << 0)  // ページを読み込もうとして発生
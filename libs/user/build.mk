@@ -1,3 +1,4 @@
 objs-y += printf.o syscall.o malloc.o init.o ipc.o task.o driver.o dmabuf.o
+objs-y += channel.o pages.o
 subdirs-y += $(ARCH) virtio
 global-cflags-y += -I$(top_dir)/libs/user/arch/$(ARCH)
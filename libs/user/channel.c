@@ -0,0 +1,183 @@
+// チャネル: 共有メモリ上のリングバッファによるタスク間のデータ転送。
+//
+// 共有メモリ領域の先頭ページにヘッダ (struct channel_header) を置き、その次のページから
+// データ領域が始まる。headとtailはデータ領域のサイズで折り返さないカウンタで、データ領域上の
+// 位置は下位ビットだけを使って求める。
+#include <libs/common/print.h>
+#include <libs/common/string.h>
+#include <libs/user/channel.h>
+#include <libs/user/ipc.h>
+
+// レコードのヘッダを含めたサイズを返す。
+static uint32_t record_size(uint32_t len) {
+    return ALIGN_UP(sizeof(struct channel_record) + len, CHANNEL_RECORD_ALIGN);
+}
+
+// 共有メモリ領域の管理構造体を初期化する。
+static void init(struct channel *ch, task_t peer, uaddr_t uaddr, size_t size,
+                 bool notify) {
+    ch->header = (struct channel_header *) uaddr;
+    ch->data = (uint8_t *) (uaddr + PAGE_SIZE);
+    ch->size = size;
+    ch->head = atomic_load(&ch->header->head);
+    ch->tail = atomic_load(&ch->header->tail);
+    ch->next = 0;
+    ch->peer = peer;
+    ch->notify = notify;
+}
+
+// peerとの間で使うチャネルを作成する。sizeはデータ領域のサイズで、PAGE_SIZE以上の2のべき乗で
+// なければならない。peer_uaddrには相手側の仮想アドレスが返るので、何らかのメッセージで相手に
+// 伝えてchannel_attach関数を呼んでもらうこと。
+//
+// notifyが真の場合は、送信側になったときに受信側へNOTIFY_CHANNEL通知を送る。
+error_t channel_create(struct channel *ch, task_t peer, size_t size,
+                       bool notify, uaddr_t *peer_uaddr) {
+    if (size < PAGE_SIZE || (size & (size - 1)) != 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // VMサーバに共有メモリ領域を割り当ててもらう。ゼロクリアされている。
+    struct message m;
+    m.type = VM_ALLOC_SHARED_MSG;
+    m.vm_alloc_shared.peer = peer;
+    m.vm_alloc_shared.size = PAGE_SIZE + size;
+    error_t err = ipc_call(VM_SERVER, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    uaddr_t uaddr = m.vm_alloc_shared_reply.uaddr;
+    struct channel_header *header = (struct channel_header *) uaddr;
+    header->size = size;
+    atomic_store(&header->magic, CHANNEL_MAGIC);
+
+    init(ch, peer, uaddr, size, notify);
+    *peer_uaddr = m.vm_alloc_shared_reply.peer_uaddr;
+    return OK;
+}
+
+// channel_create関数で相手が作成したチャネルを使い始める。uaddrは相手から伝えられた仮想
+// アドレス、sizeは双方で取り決めたデータ領域のサイズ。
+error_t channel_attach(struct channel *ch, task_t peer, uaddr_t uaddr,
+                       size_t size, bool notify) {
+    if (!IS_ALIGNED(uaddr, PAGE_SIZE) || size < PAGE_SIZE
+        || (size & (size - 1)) != 0) {
+        return ERR_INVALID_ARG;
+    }
+
+    // ヘッダの内容が取り決めと一致するかを確認する。
+    struct channel_header *header = (struct channel_header *) uaddr;
+    if (atomic_load(&header->magic) != CHANNEL_MAGIC || header->size != size) {
+        return ERR_INVALID_ARG;
+    }
+
+    init(ch, peer, uaddr, size, notify);
+    return OK;
+}
+
+// 送信側: lenバイトのレコードをチャネル上に確保し、データを書き込む領域を返す。空きがなければ
+// NULLを返す。書き込み終わったらchannel_commit関数で公開すること。
+void *channel_reserve(struct channel *ch, size_t len) {
+    uint32_t size = record_size(len);
+    if (len > ch->size || size > ch->size) {
+        return NULL;
+    }
+
+    uint32_t head = ch->head;
+    uint32_t offset = head & (ch->size - 1);
+    uint32_t contiguous = ch->size - offset;
+
+    // データ領域の末尾に収まらない場合は、残りをパディングで埋めて先頭から書く。
+    uint32_t needed = (size > contiguous) ? contiguous + size : size;
+    uint32_t tail = atomic_load(&ch->header->tail);
+    if (head - tail + needed > ch->size) {
+        return NULL;
+    }
+
+    if (size > contiguous) {
+        struct channel_record *padding =
+            (struct channel_record *) &ch->data[offset];
+        padding->len = CHANNEL_PADDING;
+        head += contiguous;
+        offset = 0;
+    }
+
+    struct channel_record *record = (struct channel_record *) &ch->data[offset];
+    record->len = len;
+    ch->next = head + size;
+    return record->data;
+}
+
+// 送信側: channel_reserve関数で確保したレコードを受信側に公開する。
+void channel_commit(struct channel *ch) {
+    uint32_t old_head = ch->head;
+    ch->head = ch->next;
+
+    // レコードの内容を書き終えてから書き込み位置を更新する。
+    atomic_store(&ch->header->head, ch->head);
+
+    // チャネルが空だった場合は、受信側が通知を待っているかもしれないので通知する。
+    //
+    // 受信側はtailを更新してからheadを読み込むので、読み込み位置の更新と書き込み位置の更新
+    // の順序がどちらであっても、どちらかが相手の更新を必ず観測できる。
+    if (ch->notify && atomic_load(&ch->header->tail) == old_head) {
+        OOPS_OK(ipc_notify(ch->peer, NOTIFY_CHANNEL));
+    }
+}
+
+// 送信側: データをコピーしてレコードとして送る。空きがなければERR_WOULD_BLOCKを返す。
+error_t channel_send(struct channel *ch, const void *data, size_t len) {
+    void *buf = channel_reserve(ch, len);
+    if (!buf) {
+        return ERR_WOULD_BLOCK;
+    }
+
+    memcpy(buf, data, len);
+    channel_commit(ch);
+    return OK;
+}
+
+// 受信側: 先頭のレコードのデータを指すポインタを返し、lenにその長さを設定する。チャネルが
+// 空であればNULLを返す。データを使い終わったらchannel_consume関数で解放すること。
+//
+// データは共有メモリ上にあり送信側から書き換えられうるので、検証が必要な値は一旦コピー
+// してから使うこと。
+void *channel_peek(struct channel *ch, size_t *len) {
+    while (true) {
+        uint32_t tail = ch->tail;
+        uint32_t head = atomic_load(&ch->header->head);
+        if (head == tail) {
+            return NULL;
+        }
+
+        uint32_t offset = tail & (ch->size - 1);
+        uint32_t contiguous = ch->size - offset;
+        struct channel_record *record =
+            (struct channel_record *) &ch->data[offset];
+        uint32_t record_len = record->len;
+        if (record_len == CHANNEL_PADDING) {
+            // パディング: データ領域の先頭に戻る。
+            ch->tail += contiguous;
+            atomic_store(&ch->header->tail, ch->tail);
+            continue;
+        }
+
+        uint32_t size = record_size(record_len);
+        if (record_len > ch->size || size > contiguous || size > head - tail) {
+            WARN("channel: invalid record length %u from #%d", record_len,
+                 ch->peer);
+            return NULL;
+        }
+
+        *len = record_len;
+        ch->next = tail + size;
+        return record->data;
+    }
+}
+
+// 受信側: channel_peek関数で参照したレコードを解放し、送信側が再利用できるようにする。
+void channel_consume(struct channel *ch) {
+    ch->tail = ch->next;
+    atomic_store(&ch->header->tail, ch->tail);
+}
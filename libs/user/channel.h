@@ -0,0 +1,51 @@
+#pragma once
+#include <libs/common/types.h>
+
+// チャネルの共有メモリ領域の先頭にあるヘッダのマジックナンバー ("CHNL")
+#define CHANNEL_MAGIC 0x4c4e4843
+// チャネルの各レコードのアライメント
+#define CHANNEL_RECORD_ALIGN 8
+// パディングレコードの長さ。データ領域の末尾に収まらないレコードを先頭から書く際に使う。
+#define CHANNEL_PADDING 0xffffffff
+
+// チャネルの共有メモリ領域の先頭ページに置かれるヘッダ。送信側と受信側が互いに書き込む
+// フィールドは、キャッシュラインの取り合いを避けるために別のキャッシュラインに置く。
+struct channel_header {
+    uint32_t magic;               // CHANNEL_MAGIC
+    uint32_t size;                // データ領域のサイズ (2のべき乗)
+    uint32_t head __aligned(64);  // 次に書き込む位置 (送信側のみ更新する)
+    uint32_t tail __aligned(64);  // 次に読み込む位置 (受信側のみ更新する)
+};
+
+// チャネルの各レコードのヘッダ。直後にデータが続く。
+struct channel_record {
+    uint32_t len;       // データの長さ、またはCHANNEL_PADDING
+    uint32_t reserved;  // 未使用 (データを8バイト境界に揃えるため)
+    uint8_t data[];     // データ
+};
+
+// チャネル: 2つのタスク間で共有メモリ上のリングバッファを使い、カーネルを介さずに可変長の
+// レコードを一方向に送る (Single-Producer/Single-Consumer)。
+//
+// 送信側はリングバッファが空の状態からレコードを書き込んだときにだけ受信側にNOTIFY_CHANNEL
+// 通知を送るので、受信側は通知を受け取ったらチャネルが空になるまで読み込むこと。
+struct channel {
+    struct channel_header *header;  // 共有メモリ上のヘッダ
+    uint8_t *data;                  // 共有メモリ上のデータ領域
+    uint32_t size;                  // データ領域のサイズ (ヘッダの値は信用しない)
+    uint32_t head;                  // 送信側: 公開済みの書き込み位置
+    uint32_t tail;                  // 受信側: 読み込み済みの位置
+    uint32_t next;                  // 予約・参照中のレコードの次の位置
+    task_t peer;                    // 相手のタスクID
+    bool notify;                    // レコードの到着を相手に通知するか
+};
+
+error_t channel_create(struct channel *ch, task_t peer, size_t size,
+                       bool notify, uaddr_t *peer_uaddr);
+error_t channel_attach(struct channel *ch, task_t peer, uaddr_t uaddr,
+                       size_t size, bool notify);
+void *channel_reserve(struct channel *ch, size_t len);
+void channel_commit(struct channel *ch);
+error_t channel_send(struct channel *ch, const void *data, size_t len);
+void *channel_peek(struct channel *ch, size_t *len);
+void channel_consume(struct channel *ch);
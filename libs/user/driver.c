@@ -25,6 +25,7 @@ error_t driver_map_pages(paddr_t paddr, size_t size, int map_flags,
 // 物理メモリ領域を確保する。
 //
 // 引数 map_flags にはメモリ領域の権限 PAGE_(READABLE|WRITABLE|EXECUTABLE) を指定する。
+// 大きなDMAバッファではPAGE_LARGEも指定すると、LARGE_PAGE_SIZE単位でマップされる。
 error_t driver_alloc_pages(size_t size, int map_flags, uaddr_t *uaddr,
                            paddr_t *paddr) {
     struct message m;
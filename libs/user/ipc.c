@@ -13,11 +13,14 @@ struct async_message {
     struct message m;  // メッセージ
 };
 
-// このタスクから他のタスクに向けて送信される非同期メッセージリスト。
-// 他のタスクから問い合わせ (ASYNC_RECV_MSG) があると、このリストからメッセージを探す。
+// このタスクから他のタスクに向けて送信される非同期メッセージリスト。宛先タスクのカーネル内の
+// キューが一杯の場合にのみ使われる。他のタスクから問い合わせ (ASYNC_RECV_MSG) があると、
+// このリストからメッセージを探す。
 static list_t async_messages = LIST_INIT(async_messages);
 // 受信済みの通知 (ビットフィールド)。
 static notifications_t pending_notifications = 0;
+// 受信済みのNOTIFY_ASYNC通知の送信元タスク。
+static task_t pending_async_src = 0;
 
 // ASYNC_RECV_MSGを受信した際の処理 (ノンブロッキング)
 static error_t async_reply(task_t dst) {
@@ -29,7 +32,7 @@ static error_t async_reply(task_t dst) {
                 // 既にメッセージを1つ送信済みであればipc_replyが失敗してしまう
                 // (宛先タスクが受信待ち状態でない) ため、通知を送っておいて
                 // 再度ASYNC_RECV_MSGを送らせる。
-                return ipc_notify(dst, NOTIFY_ASYNC(task_self()));
+                return ipc_notify(dst, NOTIFY_ASYNC);
             }
 
             // 未送信メッセージを返信する
@@ -43,9 +46,30 @@ static error_t async_reply(task_t dst) {
     return OK;
 }
 
+// dst宛ての未送信の非同期メッセージが送信キューに残っているかどうかを返す。
+static bool has_async_messages_to(task_t dst) {
+    LIST_FOR_EACH (am, &async_messages, struct async_message, next) {
+        if (am->dst == dst) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 // 非同期メッセージを送信する (ノンブロッキング)
 error_t ipc_send_async(task_t dst, struct message *m) {
-    // メッセージを送信キューに挿入する
+    // 基本的にはカーネル内の宛先タスクのキューに入れる。ただし、送信キューにdst宛ての
+    // メッセージが残っている場合は、順序を保つためにそちらに続けて入れる。
+    if (!has_async_messages_to(dst)) {
+        error_t err = sys_ipc(dst, 0, m, IPC_SEND | IPC_ASYNC);
+        if (err != ERR_WOULD_BLOCK) {
+            return err;
+        }
+    }
+
+    // カーネル内のキューに入れられなかったので、メッセージを送信キューに挿入して宛先タスクに
+    // 取りに来てもらう
     struct async_message *am = malloc(sizeof(*am));
     am->dst = dst;
     memcpy(&am->m, m, sizeof(am->m));
@@ -53,7 +77,7 @@ error_t ipc_send_async(task_t dst, struct message *m) {
     list_push_back(&async_messages, &am->next);
 
     // 送信先タスクに通知を送る
-    return ipc_notify(dst, NOTIFY_ASYNC(task_self()));
+    return ipc_notify(dst, NOTIFY_ASYNC);
 }
 
 // メッセージを送信する。宛先タスクが受信状態になるまでブロックする。
@@ -102,10 +126,16 @@ static error_t recv_notification_as_message(struct message *m) {
             m->type = NOTIFY_TIMER_MSG;
             err = OK;
             break;
+        // チャネル通知
+        case NOTIFY_CHANNEL:
+            m->type = NOTIFY_CHANNEL_MSG;
+            err = OK;
+            break;
         // 非同期メッセージ受信通知
-        case NOTIFY_ASYNC_START ... NOTIFY_ASYNC_END: {
+        case NOTIFY_ASYNC: {
             // 通知の送信元に対して受信待ちメッセージを問い合わせる
-            task_t src = index - NOTIFY_ASYNC_BASE;
+            task_t src = pending_async_src;
+            pending_async_src = 0;
             m->type = ASYNC_RECV_MSG;
             err = ipc_call(src, m);
             break;
@@ -122,6 +152,46 @@ static error_t recv_notification_as_message(struct message *m) {
     return err;
 }
 
+// オープン受信で受け取ったメッセージを処理する。呼び出し元に返すべきメッセージであれば真を
+// 返し、errに結果を設定する。ライブラリ内部で処理したメッセージであれば偽を返す。
+static bool handle_received_message(struct message *m, error_t *err) {
+    // メッセージの種類に応じた処理を行う。
+    switch (m->type) {
+        // 通知処理: 通知を受信済み通知ビットフィールドに追加する。
+        case NOTIFY_MSG:
+            if (m->src != FROM_KERNEL) {
+                WARN(
+                    "received a notification from a non-kernel task #%d, ignoring",
+                    m->src);
+                return false;
+            }
+
+            if (m->notify.notifications & NOTIFY_ASYNC) {
+                // 非同期メッセージの送信元は、前のものを処理してから次を受け取るので
+                // ひとつだけ覚えておけばよい。
+                DEBUG_ASSERT(!pending_async_src);
+                pending_async_src = m->notify.async_src;
+            }
+
+            pending_notifications |= m->notify.notifications;
+            *err = recv_notification_as_message(m);
+            return true;
+        // 非同期メッセージ問い合わせ処理: 送信元タスクへの非同期メッセージがあれば返す。
+        case ASYNC_RECV_MSG: {
+            error_t err = async_reply(m->src);
+            if (err != OK) {
+                WARN("failed to send a async message to #%d: %s", m->src,
+                     err2str(err));
+            }
+            return false;
+        }
+        // その他のメッセージ: エラーでなければそのまま返す。
+        default:
+            *err = IS_ERROR(m->type) ? m->type : OK;
+            return true;
+    }
+}
+
 // 任意のタスクからのメッセージを受信する (オープン受信)。通知・非同期メッセージパッシング周り
 // の処理も透過的に行う。
 static error_t ipc_recv_any(struct message *m) {
@@ -137,36 +207,95 @@ static error_t ipc_recv_any(struct message *m) {
             return err;
         }
 
-        // メッセージの種類に応じた処理を行う。
-        switch (m->type) {
-            // 通知処理: 通知を受信済み通知ビットフィールドに追加する。
-            case NOTIFY_MSG:
-                if (m->src != FROM_KERNEL) {
-                    WARN(
-                        "received a notification from a non-kernel task #%d, ignoring",
-                        m->src);
-                    continue;
-                }
-
-                pending_notifications |= m->notify.notifications;
-                return recv_notification_as_message(m);
-            // 非同期メッセージ問い合わせ処理: 送信元タスクへの非同期メッセージがあれば返す。
-            case ASYNC_RECV_MSG: {
-                error_t err = async_reply(m->src);
-                if (err != OK) {
-                    WARN("failed to send a async message to #%d: %s", m->src,
-                         err2str(err));
-                }
+        if (handle_received_message(m, &err)) {
+            return err;
+        }
+    }
+}
+
+// 返信を送信し、続けて任意のタスクからのメッセージを受信する (オープン受信)。ipc_reply関数と
+// ipc_recv関数を続けて呼び出すのと同じだが、1回のシステムコールで済み、カーネルが返信先の
+// タスクへ直接切り替えられる (ダイレクトハンドオフ)。サーバのメインループで使う。
+error_t ipc_reply_recv(task_t dst, struct message *m) {
+    if (pending_notifications) {
+        // 受信済み通知があれば、ブロックせずにそれを返す。
+        ipc_reply(dst, m);
+        return ipc_recv_any(m);
+    }
+
+    error_t err = sys_ipc(dst, IPC_ANY, m, IPC_SEND | IPC_RECV | IPC_REPLY);
+    if (err != OK) {
+        // 返信に失敗した (または受信に失敗した)。ipc_reply関数と同様に警告を出して、
+        // 通常の受信処理を行う。
+        OOPS_OK(err);
+        return ipc_recv_any(m);
+    }
+
+    if (handle_received_message(m, &err)) {
+        return err;
+    }
+
+    return ipc_recv_any(m);
+}
+
+// 複数の返信をまとめて送信し、続けて最大max_recvs個のメッセージをrecvsに受信する (オープン
+// 受信)。受信できるメッセージがなければ最初の1つが届くまでブロックし、2つ目以降は既に届いて
+// いるものだけを受信する。送信と受信を合わせて1回のシステムコールで行うので、多くの
+// メッセージを処理するサーバのメインループで使う。
+//
+// 受信したメッセージの数を返す。各メッセージの送信結果はsends[i].resultに設定される。
+// 受信したメッセージがエラーの場合は、そのメッセージの種類 (type) がエラー値になる。
+int ipc_batch(struct ipc_batch_send *sends, int num_sends,
+              struct message *recvs, int max_recvs) {
+    DEBUG_ASSERT(max_recvs > 0);
+
+    if (pending_notifications) {
+        // 受信済み通知があれば、ブロックせずにそれを返す。
+        int ret = sys_ipc_batch(sends, num_sends, NULL, 0);
+        if (IS_ERROR(ret)) {
+            return ret;
+        }
+
+        error_t err = recv_notification_as_message(&recvs[0]);
+        if (err != OK) {
+            recvs[0].type = err;
+        }
+
+        return 1;
+    }
+
+    while (true) {
+        int num_recvs = sys_ipc_batch(sends, num_sends, recvs, max_recvs);
+        if (IS_ERROR(num_recvs)) {
+            return num_recvs;
+        }
+
+        // 通知や非同期メッセージの問い合わせなど、ライブラリ内部で処理するメッセージを
+        // 取り除いて前に詰める。
+        int n = 0;
+        for (int i = 0; i < num_recvs; i++) {
+            error_t err;
+            if (!handle_received_message(&recvs[i], &err)) {
                 continue;
             }
-            // その他のメッセージ: エラーでなければそのまま返す。
-            default:
-                if (IS_ERROR(m->type)) {
-                    return m->type;
-                }
 
-                return OK;
+            if (err != OK) {
+                recvs[i].type = err;
+            }
+
+            if (n != i) {
+                memcpy(&recvs[n], &recvs[i], sizeof(struct message));
+            }
+
+            n++;
+        }
+
+        if (n > 0) {
+            return n;
         }
+
+        // 返すべきメッセージがなかったので受信し直す。返信は送信済み。
+        num_sends = 0;
     }
 }
 
@@ -234,3 +363,11 @@ task_t ipc_lookup(const char *name) {
     ASSERT(m.type == SERVICE_LOOKUP_REPLY_MSG);
     return m.service_lookup_reply.task;
 }
+
+// task_fork関数で作成した子タスクで呼ばれ、親タスクから引き継いだ状態を捨てる。親タスク
+// 宛ての通知や、親タスクが送るはずの非同期メッセージを子タスクが扱わないようにするため。
+void ipc_reset_after_fork(void) {
+    list_init(&async_messages);
+    pending_notifications = 0;
+    pending_async_src = 0;
+}
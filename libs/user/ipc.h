@@ -7,8 +7,12 @@ error_t ipc_send_noblock(task_t dst, struct message *m);
 error_t ipc_send_async(task_t dst, struct message *m);
 void ipc_reply(task_t dst, struct message *m);
 void ipc_reply_err(task_t dst, error_t error);
+error_t ipc_reply_recv(task_t dst, struct message *m);
+int ipc_batch(struct ipc_batch_send *sends, int num_sends,
+              struct message *recvs, int max_recvs);
 error_t ipc_recv(task_t src, struct message *m);
 error_t ipc_call(task_t dst, struct message *m);
 error_t ipc_notify(task_t dst, notifications_t notifications);
 error_t ipc_register(const char *name);
 task_t ipc_lookup(const char *name);
+void ipc_reset_after_fork(void);
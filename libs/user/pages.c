@@ -0,0 +1,39 @@
+// メッセージに添付するページ (IDLのpages型フィールド) の割り当て・解放。
+//
+// ページを添付したメッセージを送信すると、ページは送信元からアンマップされて宛先タスクに
+// 移る。受け取ったページは使い回して返信に添付するか、pages_free関数で解放すること。
+#include <libs/common/print.h>
+#include <libs/user/ipc.h>
+#include <libs/user/pages.h>
+#include <libs/user/syscall.h>
+
+// メッセージに添付できるsizeバイト (ページ単位に切り上げる) のメモリ領域を割り当てる。
+// 失敗した場合はNULLを返す。
+void *pages_alloc(size_t size) {
+    struct message m;
+    m.type = VM_ALLOC_PHYSICAL_MSG;
+    m.vm_alloc_physical.size = ALIGN_UP(size, PAGE_SIZE);
+    m.vm_alloc_physical.alloc_flags = 0;
+    m.vm_alloc_physical.map_flags = PAGE_READABLE | PAGE_WRITABLE;
+    error_t err = ipc_call(VM_SERVER, &m);
+    if (err != OK) {
+        WARN("failed to allocate pages: %s", err2str(err));
+        return NULL;
+    }
+
+    return (void *) m.vm_alloc_physical_reply.uaddr;
+}
+
+// pages_alloc関数で割り当てた、またはメッセージで受け取ったメモリ領域を解放する。
+//
+// メッセージで受け取ったページはアンマップした時点でカーネルが解放する。まだ送信して
+// いないpages_alloc関数のページは、タスクが終了するまで物理ページが残る。
+void pages_free(void *ptr, size_t size) {
+    uaddr_t uaddr = (uaddr_t) ptr;
+    DEBUG_ASSERT(IS_ALIGNED(uaddr, PAGE_SIZE));
+
+    size_t num_pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    if (num_pages > 0) {
+        OOPS_OK(sys_vm_unmap_range(sys_task_self(), uaddr, num_pages));
+    }
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include <libs/common/types.h>
+
+void *pages_alloc(size_t size);
+void pages_free(void *ptr, size_t size);
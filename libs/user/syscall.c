@@ -8,6 +8,13 @@ error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags) {
     return arch_syscall(dst, src, (uintptr_t) m, flags, 0, SYS_IPC);
 }
 
+// ipc_batchシステムコール: 複数のメッセージの送受信
+int sys_ipc_batch(struct ipc_batch_send *sends, int num_sends,
+                  struct message *recvs, int max_recvs) {
+    return arch_syscall((uintptr_t) sends, num_sends, (uintptr_t) recvs,
+                        max_recvs, 0, SYS_IPC_BATCH);
+}
+
 // notifyシステムコール: 通知の送信
 error_t sys_notify(task_t dst, notifications_t notifications) {
     return arch_syscall(dst, notifications, 0, 0, 0, SYS_NOTIFY);
@@ -41,11 +48,21 @@ task_t sys_task_self(void) {
     return arch_syscall(0, 0, 0, 0, 0, SYS_TASK_SELF);
 }
 
+// task_set_priorityシステムコール: タスクの優先度の変更
+error_t sys_task_set_priority(task_t task, int priority) {
+    return arch_syscall(task, priority, 0, 0, 0, SYS_TASK_SET_PRIORITY);
+}
+
 // pm_allocシステムコール: 物理メモリの割り当て
 pfn_t sys_pm_alloc(task_t tid, size_t size, unsigned flags) {
     return arch_syscall(tid, size, flags, 0, 0, SYS_PM_ALLOC);
 }
 
+// pm_freeシステムコール: 物理メモリの解放
+error_t sys_pm_free(task_t tid, paddr_t paddr, size_t size) {
+    return arch_syscall(tid, paddr, size, 0, 0, SYS_PM_FREE);
+}
+
 // vm_mapシステムコール: ページのマップ
 error_t sys_vm_map(task_t task, uaddr_t uaddr, paddr_t paddr, unsigned attrs) {
     return arch_syscall(task, uaddr, paddr, attrs, 0, SYS_VM_MAP);
@@ -56,6 +73,35 @@ error_t sys_vm_unmap(task_t task, uaddr_t uaddr) {
     return arch_syscall(task, uaddr, 0, 0, 0, SYS_VM_UNMAP);
 }
 
+// vm_map_rangeシステムコール: 連続したページのまとめてマップ
+error_t sys_vm_map_range(task_t task, uaddr_t uaddr, paddr_t paddr,
+                         size_t num_pages, unsigned attrs) {
+    return arch_syscall(task, uaddr, paddr, num_pages, attrs,
+                        SYS_VM_MAP_RANGE);
+}
+
+// vm_unmap_rangeシステムコール: 連続したページのまとめてアンマップ
+error_t sys_vm_unmap_range(task_t task, uaddr_t uaddr, size_t num_pages) {
+    return arch_syscall(task, uaddr, num_pages, 0, 0, SYS_VM_UNMAP_RANGE);
+}
+
+// vm_paddrシステムコール: マップされている物理ページ番号の取得
+pfn_t sys_vm_paddr(task_t task, uaddr_t uaddr) {
+    return arch_syscall(task, uaddr, 0, 0, 0, SYS_VM_PADDR);
+}
+
+// vm_protectシステムコール: ページの属性の変更
+error_t sys_vm_protect(task_t task, uaddr_t uaddr, size_t num_pages,
+                       unsigned attrs) {
+    return arch_syscall(task, uaddr, num_pages, attrs, 0, SYS_VM_PROTECT);
+}
+
+// vm_shareシステムコール: 他のタスクのページを同じ仮想アドレスにマップ
+error_t sys_vm_share(task_t src, task_t dst, uaddr_t uaddr, size_t num_pages,
+                     unsigned attrs) {
+    return arch_syscall(src, dst, uaddr, num_pages, attrs, SYS_VM_SHARE);
+}
+
 // irq_listenシステムコール: 割り込み通知の購読
 error_t sys_irq_listen(unsigned irq) {
     return arch_syscall(irq, 0, 0, 0, 0, SYS_IRQ_LISTEN);
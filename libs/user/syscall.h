@@ -4,8 +4,11 @@
 #include <libs/common/types.h>
 
 struct message;
+struct ipc_batch_send;
 
 error_t sys_ipc(task_t dst, task_t src, struct message *m, unsigned flags);
+int sys_ipc_batch(struct ipc_batch_send *sends, int num_sends,
+                  struct message *recvs, int max_recvs);
 error_t sys_notify(task_t dst, notifications_t notifications);
 task_t sys_task_create(const char *name, vaddr_t ip, task_t pager);
 task_t sys_hinavm(const char *name, hinavm_inst_t *insts, size_t num_insts,
@@ -13,9 +16,19 @@ task_t sys_hinavm(const char *name, hinavm_inst_t *insts, size_t num_insts,
 error_t sys_task_destroy(task_t task);
 __noreturn void sys_task_exit(void);
 task_t sys_task_self(void);
+error_t sys_task_set_priority(task_t task, int priority);
 pfn_t sys_pm_alloc(task_t tid, size_t size, unsigned flags);
+error_t sys_pm_free(task_t tid, paddr_t paddr, size_t size);
 error_t sys_vm_map(task_t task, uaddr_t uaddr, paddr_t paddr, unsigned attrs);
 error_t sys_vm_unmap(task_t task, uaddr_t uaddr);
+error_t sys_vm_map_range(task_t task, uaddr_t uaddr, paddr_t paddr,
+                         size_t num_pages, unsigned attrs);
+error_t sys_vm_unmap_range(task_t task, uaddr_t uaddr, size_t num_pages);
+pfn_t sys_vm_paddr(task_t task, uaddr_t uaddr);
+error_t sys_vm_protect(task_t task, uaddr_t uaddr, size_t num_pages,
+                       unsigned attrs);
+error_t sys_vm_share(task_t src, task_t dst, uaddr_t uaddr, size_t num_pages,
+                     unsigned attrs);
 error_t sys_irq_listen(unsigned irq);
 error_t sys_irq_unlisten(unsigned irq);
 int sys_serial_write(const char *buf, size_t len);
@@ -1,15 +1,55 @@
+#include <libs/user/ipc.h>
 #include <libs/user/syscall.h>
 #include <libs/user/task.h>
 
+// キャッシュした実行中タスクのタスクID (0ならまだ取得していない)
+static task_t self_tid = 0;
+// task_fork関数で作成した子タスクで実行する関数とその引数
+static void (*fork_entry)(void *arg);
+static void *fork_arg;
+
+// 子タスクのエントリーポイント (start.S)
+void fork_start(void);
+
 // 実行中タスクのタスクIDを取得する。
 task_t task_self(void) {
-    static task_t tid = 0;
-    if (tid) {
+    if (self_tid) {
         // 既にタスクIDを取得しているので、キャッシュした値を返す。
-        return tid;
+        return self_tid;
     }
 
     // タスクIDは一度取得したら変わらないので、キャッシュしておく。
-    tid = sys_task_self();
-    return tid;
+    self_tid = sys_task_self();
+    return self_tid;
+}
+
+// task_fork関数で作成した子タスクで、スタックを設定した後に呼ばれる。
+void hinaos_fork_main(void) {
+    // 親タスクから引き継いだ状態を捨てる。
+    self_tid = 0;
+    ipc_reset_after_fork();
+
+    fork_entry(fork_arg);
+}
+
+// 実行中タスクを複製した子タスクを作成し、子タスクでentry(arg)を実行させる。子タスクの
+// IDを返す。entryから戻ると子タスクは終了する。
+//
+// 子タスクは呼び出し時点のグローバル変数やヒープの内容をコピーオンライトで引き継ぐので、
+// 初期化済みの状態から素早く処理を始められる。ただし、スタックは先頭から使い直すので
+// 呼び出し元には戻らない。また、MMIO領域や共有メモリ (チャネルなど) は引き継がない。
+task_t task_fork(void (*entry)(void *arg), void *arg) {
+    // 子タスクはこの時点のメモリの内容を引き継ぐので、VMサーバに依頼する前に設定しておく。
+    fork_entry = entry;
+    fork_arg = arg;
+
+    struct message m;
+    m.type = FORK_TASK_MSG;
+    m.fork_task.ip = (uaddr_t) fork_start;
+    error_t err = ipc_call(VM_SERVER, &m);
+    if (err != OK) {
+        return err;
+    }
+
+    return m.fork_task_reply.task;
 }
@@ -2,3 +2,4 @@
 #include <libs/common/types.h>
 
 task_t task_self(void);
+task_t task_fork(void (*entry)(void *arg), void *arg);
@@ -2,16 +2,44 @@
 #include "fs.h"
 #include <libs/common/print.h>
 #include <libs/common/string.h>
+#include <libs/user/channel.h>
 #include <libs/user/ipc.h>
 #include <libs/user/malloc.h>
-#include <servers/virtio_blk/virtio_blk.h>  // SECTOR_SIZE
+#include <libs/user/syscall.h>
+#include <servers/virtio_blk/virtio_blk.h>  // SECTOR_SIZE, BLK_CHANNEL_SIZE, ...
+
+// ひとつの要求でまとめて読み書きできるブロックの最大数。
+#define RUN_BLOCKS_MAX (BLK_REQUEST_MAX / BLOCK_SIZE)
 
 // ブロックデバイスドライバサーバのタスクID。
 static task_t blk_server;
-// キャッシュされたブロックのリスト。
-static list_t cached_blocks = LIST_INIT(cached_blocks);
-// 変更済みブロックのリスト。ディスクに書き戻す必要がある。
+// 読み書き要求をデバイスドライバに送るチャネル。
+static struct channel req_channel;
+// デバイスドライバから処理結果を受け取るチャネル。
+static struct channel resp_channel;
+// 処理結果をまだ受け取っていない要求の数。
+static int num_pending = 0;
+// キャッシュされたブロックのハッシュテーブル。ブロック番号で引く。
+static list_t block_hash_table[BLOCK_HASH_SIZE];
+// 固定されていないブロックのリスト。先頭ほど長く使われていない (LRU)。
+static list_t lru_blocks = LIST_INIT(lru_blocks);
+// ディスクから読み込み中のブロックのリスト。
+static list_t loading_blocks = LIST_INIT(loading_blocks);
+// キャッシュされたブロックの数。
+static int num_cached = 0;
+// 処理中の要求の世代。block_release_all関数を呼ぶたびに進める。
+static unsigned current_gen = 1;
+// キャッシュの統計情報: ヒット、ミス、先読み、解放したブロックの数。
+static unsigned num_hits = 0;
+static unsigned num_misses = 0;
+static unsigned num_prefetched = 0;
+static unsigned num_evictions = 0;
+// 変更済みブロックのリスト。ディスクに書き戻す必要がある。ブロック番号順に並んでいる。
 static list_t dirty_blocks = LIST_INIT(dirty_blocks);
+// 変更済みブロックの数。
+static int num_dirty = 0;
+// 処理結果がエラーだった要求の、最後のものの結果。書き込みが成功したかを確認するのに使う。
+static error_t io_error = OK;
 
 // ブロック番号をセクタ番号に変換する。
 static uint64_t block_to_sector(block_t index) {
@@ -23,24 +51,234 @@ static bool block_is_dirty(struct block *block) {
     return list_is_linked(&block->dirty_next);
 }
 
-// ブロックをディスクに書き込む。
-static void block_write(struct block *block) {
-    unsigned sector_base = block_to_sector(block->index);
-    // 各セクタごとに書き込む
-    for (int offset = 0; offset < BLOCK_SIZE; offset += SECTOR_SIZE) {
+// ブロック番号に対応するハッシュテーブルのバケットを返す。
+static list_t *hash_bucket(block_t index) {
+    return &block_hash_table[index % BLOCK_HASH_SIZE];
+}
+
+// キャッシュされたブロックを探す。なければNULLを返す。
+static struct block *lookup_cache(block_t index) {
+    LIST_FOR_EACH (b, hash_bucket(index), struct block, hash_next) {
+        if (b->index == index) {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+// 読み込み要求の処理結果を、読み込み中のブロックにコピーする。
+static error_t complete_read(struct blk_channel_response *resp, size_t len) {
+    uint64_t sector = resp->sector;
+    uint32_t read_len = resp->len;
+    if (!IS_ALIGNED(sector * SECTOR_SIZE, BLOCK_SIZE)
+        || !IS_ALIGNED(read_len, BLOCK_SIZE) || read_len > BLK_REQUEST_MAX
+        || len - sizeof(*resp) < read_len) {
+        return ERR_UNEXPECTED;
+    }
+
+    block_t first = (sector * SECTOR_SIZE) / BLOCK_SIZE;
+    for (uint32_t i = 0; i < read_len / BLOCK_SIZE; i++) {
+        struct block *b = lookup_cache(first + i);
+        if (!b || !b->loading) {
+            return ERR_UNEXPECTED;
+        }
+
+        // ブロックキャッシュに読み込んだディスクデータをコピーし、LRUリストに移す。
+        memcpy(b->data, &resp->data[i * BLOCK_SIZE], BLOCK_SIZE);
+        b->loading = false;
+        list_remove(&b->lru_next);
+        list_push_back(&lru_blocks, &b->lru_next);
+    }
+
+    return OK;
+}
+
+// 要求チャネルに溜まった要求をデバイスドライバに処理させ、すべての処理結果を受け取る。読み込み
+// 要求の結果は、読み込み中のブロックに書き込む。
+static error_t process_requests(void) {
+    error_t ret = OK;
+    while (num_pending > 0) {
         struct message m;
-        m.type = BLK_WRITE_MSG;
-        m.blk_write.sector = sector_base + (offset / SECTOR_SIZE);
-        m.blk_write.data_len = SECTOR_SIZE;
-        memcpy(m.blk_write.data, block->data + offset, SECTOR_SIZE);
+        m.type = BLK_PROCESS_MSG;
         error_t err = ipc_call(blk_server, &m);
         if (err != OK) {
-            OOPS("failed to write block %d: %s", block->index, err2str(err));
+            OOPS("failed to process block requests: %s", err2str(err));
+            ret = err;
+            break;
+        }
+
+        struct blk_channel_response *resp;
+        size_t len;
+        while ((resp = channel_peek(&resp_channel, &len)) != NULL) {
+            error_t result =
+                (len < sizeof(*resp)) ? ERR_UNEXPECTED : resp->result;
+            if (result == OK && resp->len > 0) {
+                result = complete_read(resp, len);
+            }
+
+            if (result != OK) {
+                OOPS("failed to read/write sector %d: %s", (int) resp->sector,
+                     err2str(result));
+                ret = result;
+                io_error = result;
+            }
+
+            channel_consume(&resp_channel);
+            num_pending--;
         }
     }
+
+    return ret;
+}
+
+// 要求チャネルに、indexから連続するnum_blocks個のブロックの読み書き要求を追加する。書き込み
+// 要求の場合は、書き込むデータを続けて埋めること。
+static struct blk_channel_request *push_request(block_t index, int num_blocks,
+                                                bool is_write) {
+    DEBUG_ASSERT(num_blocks > 0 && num_blocks <= RUN_BLOCKS_MAX);
+
+    size_t data_len = num_blocks * BLOCK_SIZE;
+    size_t len = sizeof(struct blk_channel_request) + (is_write ? data_len : 0);
+    struct blk_channel_request *req = channel_reserve(&req_channel, len);
+    if (!req) {
+        // 要求チャネルが一杯なので、先に溜まっている要求を処理させる。
+        process_requests();
+        req = channel_reserve(&req_channel, len);
+        ASSERT(req != NULL);
+    }
+
+    req->sector = block_to_sector(index);
+    req->len = data_len;
+    req->is_write = is_write;
+    return req;
+}
+
+// ディスク上で連続するブロック (blocks[0]からblocks[num_blocks - 1]まで) を、ひとつの
+// 要求でディスクに書き込む要求を追加する。実際に書き込まれるのはprocess_requests関数を
+// 呼んだとき。
+static void write_blocks(struct block **blocks, int num_blocks) {
+    struct blk_channel_request *req =
+        push_request(blocks[0]->index, num_blocks, true);
+    for (int i = 0; i < num_blocks; i++) {
+        DEBUG_ASSERT(blocks[i]->index == blocks[0]->index + i);
+        memcpy(&req->data[i * BLOCK_SIZE], blocks[i]->data, BLOCK_SIZE);
+    }
+
+    channel_commit(&req_channel);
+    num_pending++;
 }
 
-// ブロックをブロックキャッシュに読み込む。
+// ブロックをディスクに書き込む要求を追加する。
+static void block_write(struct block *block) {
+    write_blocks(&block, 1);
+}
+
+// ブロックを処理中の要求で参照したことを記録し、LRUリストの末尾に移動する。
+static void touch_block(struct block *block) {
+    block->last_used = current_gen;
+    if (block->pin_count == 0) {
+        list_remove(&block->lru_next);
+        list_push_back(&lru_blocks, &block->lru_next);
+    }
+}
+
+// 最も長く使われていないブロックをキャッシュから解放する。解放できるブロックがなければ
+// falseを返す。
+static bool evict_block(void) {
+    if (list_is_empty(&lru_blocks)) {
+        return false;
+    }
+
+    // LRUリストは参照された順に並んでいるので、先頭のブロックが処理中の要求で参照されて
+    // いれば、残りのブロックもすべて参照されている。
+    struct block *b = LIST_CONTAINER(lru_blocks.next, struct block, lru_next);
+    if (b->last_used == current_gen) {
+        return false;
+    }
+
+    // 変更済みであれば、先にディスクに書き戻す。書き込めなかった場合は、変更を失わない
+    // よう解放せずに変更済みのまま残す。処理中の要求 (読み込み要求) を先に済ませておき、
+    // このブロックの書き込み要求の結果だけを受け取る。
+    if (block_is_dirty(b)) {
+        process_requests();
+        block_write(b);
+        if (process_requests() != OK) {
+            return false;
+        }
+
+        list_remove(&b->dirty_next);
+        num_dirty--;
+    }
+
+    list_remove(&b->lru_next);
+    list_remove(&b->hash_next);
+    free(b);
+    num_cached--;
+    num_evictions++;
+    return true;
+}
+
+// indicesで指定したブロックのうち、キャッシュされていないものをまとめてディスクから読み込む。
+// ディスク上で連続するブロックはひとつの要求にまとめ、すべての要求を一度にデバイスドライバ
+// に処理させる。
+static error_t read_blocks(const block_t *indices, int num_indices) {
+    struct block *run[RUN_BLOCKS_MAX];
+    int run_len = 0;
+    for (int i = 0; i < num_indices; i++) {
+        block_t index = indices[i];
+        if (lookup_cache(index)) {
+            continue;
+        }
+
+        // 直前のブロックの次のブロックでなければ、それまでのブロックの読み込み要求を送る。
+        if (run_len > 0
+            && (run_len == RUN_BLOCKS_MAX
+                || index != run[run_len - 1]->index + 1)) {
+            push_request(run[0]->index, run_len, false);
+            channel_commit(&req_channel);
+            num_pending++;
+            run_len = 0;
+        }
+
+        // キャッシュが一杯であれば、使われていないブロックを解放して空きを作る。
+        while (num_cached >= BLOCK_CACHE_MAX && evict_block()) {}
+
+        // ブロックキャッシュのメモリ領域を確保して、読み込み中のブロックとして登録する。
+        struct block *new_block = malloc(sizeof(struct block));
+        new_block->index = index;
+        new_block->pin_count = 0;
+        new_block->last_used = current_gen;
+        new_block->loading = true;
+        list_elem_init(&new_block->dirty_next);
+        list_push_back(hash_bucket(index), &new_block->hash_next);
+        list_push_back(&loading_blocks, &new_block->lru_next);
+        num_cached++;
+        run[run_len++] = new_block;
+    }
+
+    if (run_len > 0) {
+        push_request(run[0]->index, run_len, false);
+        channel_commit(&req_channel);
+        num_pending++;
+    }
+
+    error_t err = process_requests();
+
+    // 読み込めなかったブロックを取り除く。
+    LIST_FOR_EACH (b, &loading_blocks, struct block, lru_next) {
+        list_remove(&b->lru_next);
+        list_remove(&b->hash_next);
+        free(b);
+        num_cached--;
+    }
+
+    return err;
+}
+
+// ブロックをブロックキャッシュに読み込む。返したブロックは、処理中の要求の間 (次に
+// block_release_all関数を呼ぶまで) は解放されない。それ以降も使う場合はblock_pin関数
+// で固定すること。
 error_t block_read(block_t index, struct block **block) {
     if (index == 0xffff) {
         OOPS("invalid block index: %x", index);
@@ -48,74 +286,206 @@ error_t block_read(block_t index, struct block **block) {
     }
 
     // 既にキャッシュされていれば、それを返す。
-    LIST_FOR_EACH (b, &cached_blocks, struct block, cache_next) {
-        if (b->index == index) {
-            *block = b;
-            return OK;
-        }
+    struct block *cached = lookup_cache(index);
+    if (cached) {
+        num_hits++;
+        touch_block(cached);
+        *block = cached;
+        return OK;
     }
 
-    // ブロックキャッシュのメモリ領域を確保して、各セクタを読み込む。
+    // ブロック全体を一度の要求で読み込む。
     TRACE("block %d is not in cache, reading from disk", index);
-    struct block *new_block = malloc(sizeof(struct block));
-    for (int offset = 0; offset < BLOCK_SIZE; offset += SECTOR_SIZE) {
-        // デバイスドライバサーバに対して、セクタ読み込み要求を送る。
-        struct message m;
-        m.type = BLK_READ_MSG;
-        m.blk_read.sector = block_to_sector(index) + (offset / SECTOR_SIZE);
-        m.blk_read.len = SECTOR_SIZE;
-        error_t err = ipc_call(blk_server, &m);
+    num_misses++;
+    error_t err = read_blocks(&index, 1);
+    cached = lookup_cache(index);
+    if (!cached) {
+        OOPS("failed to read block %d: %s", index, err2str(err));
+        return (err != OK) ? err : ERR_UNEXPECTED;
+    }
 
-        if (err != OK) {
-            OOPS("failed to read block %d: %s", index, err2str(err));
-            free(new_block);
-            return err;
-        }
+    *block = cached;
+    return OK;
+}
 
-        if (m.type != BLK_READ_REPLY_MSG) {
-            OOPS("unexpected reply message type \"%s\" (expected=%s)",
-                 msgtype2str(m.type), msgtype2str(BLK_READ_REPLY_MSG));
-            free(new_block);
-            return ERR_UNEXPECTED;
+// 近いうちに読み込まれるブロックを先読みする。キャッシュされていないブロックの読み込み要求を
+// まとめてデバイスドライバに送るので、1つずつblock_read関数で読み込むよりも速い。
+void block_prefetch(const block_t *indices, int num_indices) {
+    for (int i = 0; i < num_indices; i++) {
+        if (indices[i] == 0xffff) {
+            OOPS("invalid block index: %x", indices[i]);
+            return;
         }
 
-        if (m.blk_read_reply.data_len != SECTOR_SIZE) {
-            OOPS("invalid data length from the device: %d",
-                 m.blk_read_reply.data_len);
-            free(new_block);
-            return ERR_UNEXPECTED;
+        if (!lookup_cache(indices[i])) {
+            num_prefetched++;
         }
+    }
+
+    read_blocks(indices, num_indices);
+}
 
-        // ブロックキャッシュに読み込んだディスクデータをコピーする。
-        memcpy(&new_block->data[offset], m.blk_read_reply.data, SECTOR_SIZE);
+// ブロックをキャッシュに固定し、解放されないようにする。
+void block_pin(struct block *block) {
+    if (block->pin_count == 0) {
+        list_remove(&block->lru_next);
     }
 
-    // ブロックキャッシュをリストに追加し、そのポインタを返す。
-    new_block->index = index;
-    list_elem_init(&new_block->cache_next);
-    list_elem_init(&new_block->dirty_next);
-    list_push_back(&cached_blocks, &new_block->cache_next);
-    *block = new_block;
-    return OK;
+    block->pin_count++;
 }
 
-// ブロックを変更済みにする。
+// block_pin関数による固定を解除する。
+void block_unpin(struct block *block) {
+    DEBUG_ASSERT(block->pin_count > 0);
+
+    block->pin_count--;
+    if (block->pin_count == 0) {
+        // 直前まで使われていたブロックとしてLRUリストの末尾に戻す。
+        block->last_used = current_gen;
+        list_push_back(&lru_blocks, &block->lru_next);
+    }
+}
+
+// ブロックを変更済みにする。ディスクに書き戻すのはblock_flush関数を呼んだとき。
 void block_mark_as_dirty(struct block *block) {
-    if (!block_is_dirty(block)) {
-        list_push_back(&dirty_blocks, &block->dirty_next);
+    if (block_is_dirty(block)) {
+        return;
+    }
+
+    // 書き戻す際にディスク上の位置の順に書き込めるよう、ブロック番号順に挿入する。ファイル
+    // への追記のように番号順に変更されることが多いので、末尾から挿入位置を探す。
+    list_elem_t *next = &dirty_blocks;
+    while (next->prev != &dirty_blocks) {
+        struct block *prev =
+            LIST_CONTAINER(next->prev, struct block, dirty_next);
+        if (prev->index < block->index) {
+            break;
+        }
+
+        next = next->prev;
     }
+
+    list_insert_before(next, &block->dirty_next);
+    block->dirtied_at = sys_uptime();
+    num_dirty++;
 }
 
-// 変更済みブロックをすべてディスクに書き込む。
-void block_flush_all(void) {
+// 変更済みブロックの数を返す。
+int block_num_dirty(void) {
+    return num_dirty;
+}
+
+// 最も古い変更済みブロックが変更されてからの経過秒数を返す。変更済みブロックがなければ
+// -1を返す。
+int block_dirty_age(void) {
+    if (num_dirty == 0) {
+        return -1;
+    }
+
+    // 変更済みリストはブロック番号順なので、全て調べる。
+    int oldest = LIST_CONTAINER(dirty_blocks.next, struct block, dirty_next)
+                     ->dirtied_at;
     LIST_FOR_EACH (b, &dirty_blocks, struct block, dirty_next) {
-        block_write(b);
-        list_remove(&b->dirty_next);
+        oldest = MIN(oldest, b->dirtied_at);
+    }
+
+    return sys_uptime() - oldest;
+}
+
+// 変更済みブロックを、ブロック番号の小さい順に最大max_blocks個ディスクに書き込む。ディスク
+// 上で連続するブロックは、ひとつの要求にまとめて書き込む。
+//
+// 書き込みに失敗した場合は、今回書き込もうとしたブロックをすべて変更済みのまま残し (どの
+// ブロックが書き込めたかは分からないので、次回まとめて書き直す)、エラーを返す。
+error_t block_flush(int max_blocks) {
+    struct block *run[RUN_BLOCKS_MAX];
+    int run_len = 0;
+    int num_written = 0;
+    io_error = OK;
+    LIST_FOR_EACH (b, &dirty_blocks, struct block, dirty_next) {
+        if (num_written >= max_blocks) {
+            break;
+        }
+
+        // 直前のブロックの次のブロックでなければ、それまでのブロックを書き込む。
+        if (run_len > 0
+            && (run_len == RUN_BLOCKS_MAX
+                || b->index != run[run_len - 1]->index + 1)) {
+            write_blocks(run, run_len);
+            run_len = 0;
+        }
+
+        run[run_len++] = b;
+        num_written++;
+    }
+
+    if (run_len > 0) {
+        write_blocks(run, run_len);
+    }
+
+    // 書き込み要求をまとめてデバイスドライバに処理させる。要求チャネルが一杯になった時点で
+    // 処理させた分も含めて、ひとつでも失敗していればエラーを返す。
+    process_requests();
+    if (io_error != OK) {
+        return io_error;
+    }
+
+    // 書き込んだブロックは変更済みリストの先頭から順に並んでいる。
+    for (int i = 0; i < num_written; i++) {
+        list_pop_front(&dirty_blocks);
+        num_dirty--;
+    }
+
+    return OK;
+}
+
+// 変更済みブロックをすべてディスクに書き込む。
+error_t block_flush_all(void) {
+    while (num_dirty > 0) {
+        error_t err = block_flush(FLUSH_BLOCKS_MAX);
+        if (err != OK) {
+            return err;
+        }
+    }
+
+    return OK;
+}
+
+// 処理中の要求で参照したブロックを解放できるようにし、上限を超えた分のブロックを
+// キャッシュから解放する。要求の処理を終えるたびに呼ぶこと。
+void block_release_all(void) {
+    current_gen++;
+
+    unsigned old_evictions = num_evictions;
+    while (num_cached > BLOCK_CACHE_MAX && evict_block()) {}
+
+    if (num_evictions != old_evictions) {
+        TRACE("block cache: %d blocks, hits=%u, misses=%u, prefetched=%u, "
+              "evictions=%u",
+              num_cached, num_hits, num_misses, num_prefetched, num_evictions);
     }
 }
 
 // ブロックキャッシュレイヤの初期化。
 void block_init(void) {
+    for (int i = 0; i < BLOCK_HASH_SIZE; i++) {
+        list_init(&block_hash_table[i]);
+    }
+
     // デバイスドライバサーバのタスクIDを取得する。
     blk_server = ipc_lookup("blk_device");
+
+    // 読み書きのデータはチャネルを介して受け渡す。要求の処理はblk_process RPCで同期的に
+    // 行うので、通知は不要。
+    uaddr_t req_uaddr, resp_uaddr;
+    ASSERT_OK(channel_create(&req_channel, blk_server, BLK_CHANNEL_SIZE, false,
+                             &req_uaddr));
+    ASSERT_OK(channel_create(&resp_channel, blk_server, BLK_CHANNEL_SIZE, false,
+                             &resp_uaddr));
+
+    struct message m;
+    m.type = BLK_OPEN_MSG;
+    m.blk_open.req_channel = req_uaddr;
+    m.blk_open.resp_channel = resp_uaddr;
+    ASSERT_OK(ipc_call(blk_server, &m));
 }
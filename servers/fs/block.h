@@ -6,6 +6,16 @@
 // ブロックのサイズ (バイト)
 #define BLOCK_SIZE 4096
 
+// ブロックキャッシュに保持するブロック数の上限
+#define BLOCK_CACHE_MAX 256
+// ブロックキャッシュのハッシュテーブルのバケット数
+#define BLOCK_HASH_SIZE 64
+// 変更済みブロックがこの数 (キャッシュの1/4) を超えたら、変更されてからの経過時間に関わらず
+// ディスクに書き戻す
+#define DIRTY_BLOCKS_MAX (BLOCK_CACHE_MAX / 4)
+// 一度の書き戻しでディスクに書き込むブロックの最大数
+#define FLUSH_BLOCKS_MAX 32
+
 // ブロック番号
 typedef uint16_t block_t;
 
@@ -14,14 +24,30 @@ typedef uint16_t block_t;
 // ストレージデバイスの内容を読み書きする際には、まずデバイスからBLOCK_SIZE分のデータを一気に
 // 読み出してブロックキャッシュとして追加し、ファイルシステム実装はメモリ上にあるキャッシュデータ
 // を読み書きする。
+//
+// キャッシュしたブロックの数がBLOCK_CACHE_MAXを超えると、最も長く使われていないブロック
+// から解放する。ただし、処理中の要求で参照したブロックと、block_pin関数で固定された
+// ブロックは解放しない。
 struct block {
     block_t index;             // ディスク上のブロック番号
-    list_elem_t cache_next;    // ブロックキャッシュのリストの要素
+    unsigned pin_count;        // 固定されている数 (0でなければ解放しない)
+    unsigned last_used;        // 最後に参照された要求の世代
+    bool loading;              // ディスクから読み込み中か
+    list_elem_t hash_next;     // ハッシュテーブルのバケットのリストの要素
+    list_elem_t lru_next;      // LRUリスト (固定時を除く) または読み込み中リストの要素
     list_elem_t dirty_next;    // 変更済みブロックキャッシュのリストの要素
+    int dirtied_at;            // 変更済みになった時刻 (起動からの経過秒数)
     uint8_t data[BLOCK_SIZE];  // ブロックの内容
 };
 
 error_t block_read(block_t index, struct block **block);
+void block_prefetch(const block_t *indices, int num_indices);
+void block_pin(struct block *block);
+void block_unpin(struct block *block);
 void block_mark_as_dirty(struct block *block);
-void block_flush_all(void);
+int block_num_dirty(void);
+int block_dirty_age(void);
+error_t block_flush(int max_blocks);
+error_t block_flush_all(void);
+void block_release_all(void);
 void block_init(void);
@@ -132,11 +132,54 @@ static error_t lookup(const char *path, bool parent_dir,
     UNREACHABLE();
 }
 
+// ファイル内のi番目のデータブロックを読み込む前に呼ばれ、順番に読まれていれば続くデータ
+// ブロックを先読みする。
+static void readahead(struct readahead *ra, struct hinafs_entry *entry, int i) {
+    // 直前に読んだブロックをもう一度読んでいる。ブロックの途中で区切って読まれると、次の
+    // 読み込みはそのブロックの続きから始まるので、順番に読まれているものとして扱う。
+    if (i == ra->next - 1) {
+        return;
+    }
+
+    bool sequential = i == ra->next;
+    ra->next = i + 1;
+    if (!sequential) {
+        // 順番に読まれていないので、先読みはせず、先読みするブロック数も元に戻す。
+        ra->end = i + 1;
+        ra->window = READ_AHEAD_MIN;
+        return;
+    }
+
+    if (i < ra->end) {
+        // 先読み済みのブロックを読んでいる。
+        return;
+    }
+
+    // 先読み済みのブロックを読み終えたので、次の範囲を先読みする。ファイルの末尾より先は
+    // 読まない。
+    int num_blocks = ALIGN_UP(entry->size, BLOCK_SIZE) / BLOCK_SIZE;
+    int end = MIN(MIN(i + ra->window, num_blocks), BLOCKS_PER_ENTRY);
+    block_t indices[READ_AHEAD_MAX];
+    int num_indices = 0;
+    for (int j = i; j < end; j++) {
+        if (entry->blocks[j]) {
+            indices[num_indices++] = entry->blocks[j];
+        }
+    }
+
+    block_prefetch(indices, num_indices);
+    ra->end = end;
+
+    // 先読みが役に立っているので、次はより多くのブロックを先読みする。
+    ra->window = MIN(ra->window * 2, READ_AHEAD_MAX);
+}
+
 // ファイルの読み書き
 //
 // ディレクトリエントリ (entry_block) が示すファイルに対して、読み込み・書き込みを行う。
+// 読み込みの場合は、raが示す状態に従って続くデータブロックを先読みする。
 static error_t readwrite(struct block *entry_block, void *buf, size_t size,
-                         size_t offset, bool write) {
+                         size_t offset, bool write, struct readahead *ra) {
     // 本当にファイルなのかをチェックする
     struct hinafs_entry *entry = (struct hinafs_entry *) entry_block->data;
     if (entry->type != FS_TYPE_FILE) {
@@ -173,6 +216,10 @@ static error_t readwrite(struct block *entry_block, void *buf, size_t size,
             block_mark_as_dirty(entry_block);
         }
 
+        if (!write && ra) {
+            readahead(ra, entry, i);
+        }
+
         // データブロックを読み込む。書き込み操作だとしても一旦読み込んでブロックキャッシュ上で
         // 変更する。
         struct block *data_block;
@@ -182,7 +229,8 @@ static error_t readwrite(struct block *entry_block, void *buf, size_t size,
             return err;
         }
 
-        size_t copy_len = MIN(size - total_len, BLOCK_SIZE);
+        // 読み書きはブロックの末尾まで。残りは次のデータブロックで行う。
+        size_t copy_len = MIN(size - total_len, BLOCK_SIZE - first_offset);
         if (write) {
             // データブロックへ書き込んで変更済みブロックとして登録する
             memcpy(&data_block->data[first_offset], buf + total_len, copy_len);
@@ -363,8 +411,15 @@ error_t fs_find(const char *path, struct block **entry_block) {
 
 // ファイルの読み書き。
 error_t fs_readwrite(struct block *entry_block, void *buf, size_t size,
-                     size_t offset, bool write) {
-    return readwrite(entry_block, buf, size, offset, write);
+                     size_t offset, bool write, struct readahead *ra) {
+    return readwrite(entry_block, buf, size, offset, write, ra);
+}
+
+// 先読みの状態を初期化する。ファイルの先頭からの読み込みを順番どおりの読み込みとみなす。
+void fs_readahead_init(struct readahead *ra) {
+    ra->next = 0;
+    ra->end = 0;
+    ra->window = READ_AHEAD_MIN;
 }
 
 // ディレクトリのindex番目エントリをひとつ取得する。
@@ -428,12 +483,17 @@ void fs_init(void) {
         PANIC("invalid root directory type: %x", root_dir->type);
     }
 
+    // ルートディレクトリとビットマップブロックは常に参照するので、キャッシュに固定する。
+    block_pin(root_dir_block);
+
     // 各ビットマップブロックを読み込む
     for (int i = 0; i < NUM_BITMAP_BLOCKS; i++) {
         err = block_read(BITMAP_FIRST_BLOCK + i, &bitmap_blocks[i]);
         if (err != OK) {
             PANIC("failed to read the bitmap block: %s", err2str(err));
         }
+
+        block_pin(bitmap_blocks[i]);
     }
 
     INFO("successfully loaded the file system");
@@ -61,10 +61,23 @@ STATIC_ASSERT(sizeof(struct hinafs_header) == BLOCK_SIZE,
 STATIC_ASSERT(sizeof(struct hinafs_entry) == BLOCK_SIZE,
               "hinafs_entry size must be equal to block size");
 
+// 先読みするブロック数の最小値と最大値
+#define READ_AHEAD_MIN 4
+#define READ_AHEAD_MAX 32
+
+// 開いているファイルごとの先読みの状態。ファイルが先頭から順番に読まれている間は、先読み
+// したブロックを読み終えるたびに、先読みするブロック数を倍に増やしていく。
+struct readahead {
+    int next;    // 順番に読まれている場合に次に読まれるブロック (ファイル内の番号)
+    int end;     // 先読み済みの範囲の末尾 (ファイル内の番号。この番号は含まない)
+    int window;  // 次に先読みするブロック数
+};
+
+void fs_readahead_init(struct readahead *ra);
 error_t fs_find(const char *path, struct block **entry_block);
 error_t fs_create(const char *path, uint8_t type);
 error_t fs_readwrite(struct block *entry_block, void *buf, size_t size,
-                     size_t offset, bool write);
+                     size_t offset, bool write, struct readahead *ra);
 error_t fs_readdir(const char *path, int index, struct hinafs_entry **entry);
 error_t fs_delete(const char *path);
 void fs_init(void);
@@ -4,6 +4,8 @@
 #include <libs/common/print.h>
 #include <libs/common/string.h>
 #include <libs/user/ipc.h>
+#include <libs/user/pages.h>
+#include <libs/user/syscall.h>
 
 // 開いているファイルの一覧。インデックスがファイルディスクリプタとして使われる。
 // 全タスクで共有される。
@@ -37,6 +39,7 @@ static struct open_file *lookup_open_file(task_t task, int fd) {
 
 // ファイル管理構造体を開放する。
 static void free_open_file(struct open_file *file) {
+    block_unpin(file->entry_block);
     file->used = false;
 }
 
@@ -73,11 +76,15 @@ static int do_open(task_t task, const char *path) {
         return ERR_NO_RESOURCES;
     }
 
+    // 閉じるまでエントリのブロックがキャッシュから解放されないようにする。
+    block_pin(entry_block);
+
     struct open_file *file = &open_files[fd - 1];
     file->entry_block = entry_block;
     file->entry = (struct hinafs_entry *) entry_block->data;
     file->task = task;
     file->offset = 0;
+    fs_readahead_init(&file->ra);
     return fd;
 }
 
@@ -96,8 +103,8 @@ static int do_readwrite(task_t task, int fd, void *buf, size_t len,
         }
     }
 
-    error_t err =
-        fs_readwrite(file->entry_block, buf, len, file->offset, write);
+    error_t err = fs_readwrite(file->entry_block, buf, len, file->offset,
+                               write, &file->ra);
     if (err != OK) {
         return err;
     }
@@ -116,13 +123,21 @@ void main(void) {
     m.type = WATCH_TASKS_MSG;
     ASSERT_OK(ipc_call(VM_SERVER, &m));
 
+    // 変更済みブロックを定期的に書き戻すためにタイマーを設定する。
+    ASSERT_OK(sys_time(WRITE_BACK_INTERVAL));
+
     // ファイルシステムサーバとして登録
     ASSERT_OK(ipc_register("fs"));
     TRACE("ready");
 
     while (true) {
-        // 変更済みブロックをディスクに書き戻す
-        block_flush_all();
+        // 変更済みブロックが溜まりすぎていれば、定期的な書き戻しを待たずに書き戻す
+        if (block_num_dirty() > DIRTY_BLOCKS_MAX) {
+            block_flush(FLUSH_BLOCKS_MAX);
+        }
+
+        // 使われなくなったブロックキャッシュを解放する
+        block_release_all();
 
         struct message m;
         error_t err = ipc_recv(IPC_ANY, &m);
@@ -137,6 +152,36 @@ void main(void) {
                 do_task_destroyed(m.task_destroyed.task);
                 break;
             }
+            case NOTIFY_TIMER_MSG: {
+                // 変更されてからDIRTY_EXPIRE_TIME秒以上経った変更済みブロックがあれば書き
+                // 戻す。すぐにまた変更されるブロックを何度も書き込まないよう、しばらく待って
+                // から書き戻す。一度に書き戻す量を制限して、書き戻しきれなかった分は他の
+                // 要求を処理してから続きを書き戻す。書き込みに失敗した場合は、次の周期で
+                // 書き直す。
+                error_t err = OK;
+                if (block_dirty_age() >= DIRTY_EXPIRE_TIME) {
+                    err = block_flush(FLUSH_BLOCKS_MAX);
+                }
+
+                int timeout =
+                    (err == OK && block_dirty_age() >= DIRTY_EXPIRE_TIME)
+                        ? WRITE_BACK_CONTINUE_INTERVAL
+                        : WRITE_BACK_INTERVAL;
+                ASSERT_OK(sys_time(timeout));
+                break;
+            }
+            case FS_SYNC_MSG: {
+                // 変更済みブロックをすべて書き戻してから返信する。
+                error_t err = block_flush_all();
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                m.type = FS_SYNC_REPLY_MSG;
+                ipc_reply(m.src, &m);
+                break;
+            }
             case FS_OPEN_MSG: {
                 char path[sizeof(m.fs_open.path)];
                 strcpy_safe(path, sizeof(path), m.fs_open.path);
@@ -159,32 +204,41 @@ void main(void) {
                 break;
             }
             case FS_READ_MSG: {
-                uint8_t buf[512];
-                size_t len = MIN(m.fs_read.len, sizeof(buf));
+                // 添付されたページに直接読み込み、そのまま返す。
+                uint8_t *buf = (uint8_t *) m.fs_read.buf;
+                size_t buf_len = m.fs_read.buf_len;
+                size_t len = MIN(m.fs_read.len, buf_len);
                 int read_len =
                     do_readwrite(m.src, m.fs_read.fd, buf, len, false);
                 if (IS_ERROR(read_len)) {
+                    pages_free(buf, buf_len);
                     ipc_reply_err(m.src, read_len);
                     break;
                 }
 
                 m.type = FS_READ_REPLY_MSG;
-                memcpy(m.fs_read_reply.data, buf, read_len);
-                m.fs_read_reply.data_len = read_len;
+                m.fs_read_reply.data = (uaddr_t) buf;
+                m.fs_read_reply.data_len = buf_len;
+                m.fs_read_reply.read_len = read_len;
                 ipc_reply(m.src, &m);
                 break;
             }
             case FS_WRITE_MSG: {
-                size_t len = MIN(m.fs_write.data_len, sizeof(m.fs_write.data));
-                size_t written_len = do_readwrite(m.src, m.fs_write.fd,
-                                                  m.fs_write.data, len, true);
+                // 添付されたページから書き込み、ページはそのまま返す。
+                uint8_t *data = (uint8_t *) m.fs_write.data;
+                size_t data_len = m.fs_write.data_len;
+                int written_len =
+                    do_readwrite(m.src, m.fs_write.fd, data, data_len, true);
                 if (IS_ERROR(written_len)) {
                     WARN("failed to write a file (%s)", err2str(written_len));
+                    pages_free(data, data_len);
                     ipc_reply_err(m.src, written_len);
                     break;
                 }
 
                 m.type = FS_WRITE_REPLY_MSG;
+                m.fs_write_reply.buf = (uaddr_t) data;
+                m.fs_write_reply.buf_len = data_len;
                 m.fs_write_reply.written_len = written_len;
                 ipc_reply(m.src, &m);
                 break;
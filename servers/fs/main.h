@@ -1,8 +1,11 @@
 #pragma once
+#include "fs.h"
 #include <libs/common/types.h>
 
-#define WRITE_BACK_INTERVAL 1000
-#define OPEN_FILES_MAX      64
+#define WRITE_BACK_INTERVAL          1000  // 変更済みブロックを書き戻す周期 (ミリ秒)
+#define WRITE_BACK_CONTINUE_INTERVAL 10    // 書き戻しきれなかった分の続きを書き戻すまでの時間
+#define DIRTY_EXPIRE_TIME            3     // 変更済みブロックを書き戻すまでの猶予 (秒)
+#define OPEN_FILES_MAX               64
 
 // 開いているファイルの情報
 struct open_file {
@@ -11,4 +14,5 @@ struct open_file {
     struct hinafs_entry *entry;  // ファイルのエントリ
     struct block *entry_block;   // ファイルのエントリがあるブロック
     uint32_t offset;             // 現在のオフセット (読み書き操作をすると動く)
+    struct readahead ra;         // 先読みの状態
 };
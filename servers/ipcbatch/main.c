@@ -0,0 +1,63 @@
+#include <libs/common/print.h>
+#include <libs/user/ipc.h>
+#include <libs/user/syscall.h>
+
+// 送信する返信と受信したメッセージのバッファ
+static struct ipc_batch_send replies[IPC_BATCH_MAX];
+static struct message msgs[IPC_BATCH_MAX];
+
+void main(void) {
+    // ipcbatchサーバとして登録する
+    ASSERT_OK(ipc_register("ipcbatch"));
+    TRACE("ready");
+
+    int batch_size = 1;    // 一度に受信するメッセージの最大数
+    int num_replies = 0;   // 次の受信処理で送信する返信の数
+    int num_received = 0;  // 受信したbench_dataメッセージの数
+    int num_batches = 0;   // 受信処理の呼び出し回数
+
+    // メインループ: 前回のメッセージへの返信と次のメッセージの受信を1回のシステムコール
+    // で行う。
+    while (true) {
+        int num_msgs = ipc_batch(replies, num_replies, msgs, batch_size);
+        ASSERT_OK(num_msgs);
+
+        for (int i = 0; i < num_replies; i++) {
+            if (replies[i].result != OK) {
+                WARN("failed to reply to #%d: %s", replies[i].dst,
+                     err2str(replies[i].result));
+            }
+        }
+
+        num_replies = 0;
+        num_batches++;
+        for (int i = 0; i < num_msgs; i++) {
+            struct message *m = &msgs[i];
+            switch (m->type) {
+                case BENCH_DATA_MSG:
+                    num_received++;
+                    break;
+                case BENCH_SYNC_MSG: {
+                    struct ipc_batch_send *reply = &replies[num_replies++];
+                    reply->dst = m->src;
+                    reply->m.type = BENCH_SYNC_REPLY_MSG;
+                    reply->m.bench_sync_reply.num_received = num_received;
+                    reply->m.bench_sync_reply.num_batches = num_batches;
+
+                    batch_size = m->bench_sync.batch_size;
+                    if (batch_size < 1 || batch_size > IPC_BATCH_MAX) {
+                        batch_size = IPC_BATCH_MAX;
+                    }
+
+                    num_received = 0;
+                    num_batches = 0;
+                    break;
+                }
+                default:
+                    WARN("unhandled message: %s (%x)", msgtype2str(m->type),
+                         m->type);
+                    break;
+            }
+        }
+    }
+}
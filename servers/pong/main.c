@@ -8,22 +8,25 @@ void main(void) {
     TRACE("ready");
 
     // メインループ
+    struct message m;
+    ASSERT_OK(ipc_recv(IPC_ANY, &m));
     while (true) {
-        struct message m;
-        ASSERT_OK(ipc_recv(IPC_ANY, &m));
         switch (m.type) {
             case PING_MSG: {
                 DBG("received ping message from #%d (value=%d)", m.src,
                     m.ping.value);
 
+                // 返信と次のメッセージの受信を1回のシステムコールで行う。
                 m.type = PING_REPLY_MSG;
                 m.ping_reply.value = 42;
-                ipc_reply(m.src, &m);
-                break;
+                ASSERT_OK(ipc_reply_recv(m.src, &m));
+                continue;
             }
             default:
                 WARN("unhandled message: %s (%x)", msgtype2str(m.type), m.type);
                 break;
         }
+
+        ASSERT_OK(ipc_recv(IPC_ANY, &m));
     }
 }
@@ -5,6 +5,7 @@
 #include <libs/common/string.h>
 #include <libs/user/ipc.h>
 #include <libs/user/syscall.h>
+#include <libs/user/task.h>
 
 static void do_echo(struct args *args) {
     for (int i = 1; i < args->argc; i++) {
@@ -41,6 +42,22 @@ static void do_write(struct args *args) {
              strlen(args->argv[2]));
 }
 
+// ブロックキャッシュ (1MiB) より大きなファイルを書き込んで読み込み直し、内容が一致するか
+// 確認する。
+static void do_fscheck(struct args *args) {
+    int kib = (args->argc >= 2) ? atoi(args->argv[1]) : 2048;
+    if (kib <= 0) {
+        WARN("Usage: fscheck [KIB]");
+        return;
+    }
+
+    if (fs_check("fscheck.bin", kib * 1024)) {
+        INFO("fscheck: %d KiB written and read back successfully", kib);
+    } else {
+        WARN("fscheck: file contents mismatch");
+    }
+}
+
 static void do_listdir(struct args *args) {
     const char *path;
     if (args->argc < 2) {
@@ -97,6 +114,39 @@ static void do_start(struct args *args) {
     }
 }
 
+// forkコマンドで子タスクと親タスクが別々に読み書きする変数
+static int fork_value = 0;
+
+// forkコマンドで作成した子タスクで実行される。
+static void fork_child(void *arg) {
+    INFO("fork: child: value=%d", fork_value);
+    fork_value = (int) arg;
+    INFO("fork: child: updated value=%d", fork_value);
+}
+
+static void do_fork(struct args *args) {
+    // 子タスクには親タスクの書き込んだ値が見え、子タスクの書き込みは親タスクから
+    // 見えないことを確認する。
+    fork_value = 1;
+    task_t child = task_fork(fork_child, (void *) 2);
+    if (IS_ERROR(child)) {
+        WARN("failed to fork: %s", err2str(child));
+        return;
+    }
+
+    // 子タスクが終了するまで待つ
+    while (true) {
+        struct message m;
+        ASSERT_OK(ipc_recv(IPC_ANY, &m));
+
+        if (m.type == TASK_DESTROYED_MSG && m.task_destroyed.task == child) {
+            break;
+        }
+    }
+
+    INFO("fork: parent: value=%d", fork_value);
+}
+
 static void do_sleep(struct args *args) {
     if (args->argc != 2) {
         WARN("Usage: sleep <SECONDS>");
@@ -138,11 +188,162 @@ static void do_ping(struct args *args) {
     ASSERT(m.ping_reply.value == 42);
 }
 
+// 計測の開始を秒の境界に合わせる。新しい秒になった時点の経過時間を返す。
+static int wait_for_next_second(void) {
+    int start = sys_uptime();
+    while (sys_uptime() == start) {}
+    return sys_uptime();
+}
+
+// pongサーバとのメッセージの往復 (ipc_call) を指定した秒数だけ繰り返し、1往復あたりの
+// 時間を計測する。
+static void do_ipcbench(struct args *args) {
+    int seconds = (args->argc >= 2) ? atoi(args->argv[1]) : 3;
+    if (seconds <= 0) {
+        WARN("Usage: ipcbench [SECONDS]");
+        return;
+    }
+
+    task_t pong_server = ipc_lookup("pong");
+    int start = wait_for_next_second();
+    unsigned count = 0;
+    while (sys_uptime() < start + seconds) {
+        // システムコールの回数を減らすため、経過時間は64往復ごとに確認する。
+        for (int i = 0; i < 64; i++) {
+            struct message m;
+            m.type = PING_MSG;
+            m.ping.value = i;
+            ASSERT_OK(ipc_call(pong_server, &m));
+        }
+
+        count += 64;
+    }
+
+    unsigned per_sec = count / seconds;
+    INFO(
+        "ipcbench: %u round trips in %d seconds (%u/sec, %u ns/round trip)",
+        count, seconds, per_sec, per_sec ? 1000000000 / per_sec : 0);
+}
+
+// ipcbatchサーバのバッチサイズを設定し、受信数のカウンタを取得・リセットする。
+static void ipcbatch_sync(task_t server, int batch_size, unsigned *received,
+                          unsigned *batches) {
+    struct message m;
+    m.type = BENCH_SYNC_MSG;
+    m.bench_sync.batch_size = batch_size;
+    ASSERT_OK(ipc_call(server, &m));
+    *received = m.bench_sync_reply.num_received;
+    *batches = m.bench_sync_reply.num_batches;
+}
+
+static void do_ipcbatch(struct args *args) {
+    int seconds = (args->argc >= 2) ? atoi(args->argv[1]) : 1;
+    if (seconds <= 0) {
+        WARN("Usage: ipcbatch [SECONDS]");
+        return;
+    }
+
+    task_t server = ipc_lookup("ipcbatch");
+    for (int batch_size = 1; batch_size <= 8; batch_size *= 2) {
+        unsigned received, batches;
+        ipcbatch_sync(server, batch_size, &received, &batches);
+
+        int start = wait_for_next_second();
+        unsigned total_received = 0;
+        unsigned total_batches = 0;
+        unsigned num_syncs = 0;
+        while (sys_uptime() < start + seconds) {
+            // 非同期メッセージをまとめて送り、サーバに溜まったところで同期する。
+            for (int i = 0; i < 8; i++) {
+                struct message m;
+                m.type = BENCH_DATA_MSG;
+                m.bench_data.value = i;
+                ASSERT_OK(ipc_send_async(server, &m));
+            }
+
+            ipcbatch_sync(server, batch_size, &received, &batches);
+            total_received += received;
+            total_batches += batches;
+            num_syncs++;
+        }
+
+        // 同期メッセージも受信したメッセージとして数える。
+        unsigned total = total_received + num_syncs;
+        unsigned per_batch_x10 = total_batches ? total * 10 / total_batches : 0;
+        INFO("ipcbatch: batch size %d: %u messages/sec (%u.%u messages per "
+             "receive)",
+             batch_size, total / seconds, per_batch_x10 / 10,
+             per_batch_x10 % 10);
+    }
+}
+
+// pmbenchで同時に保持する割り当ての数
+#define PMBENCH_SLOTS 64
+
+// pmbenchで使う疑似乱数 (xorshift32)。
+static uint32_t pmbench_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void do_pmbench(struct args *args) {
+    int seconds = (args->argc >= 2) ? atoi(args->argv[1]) : 1;
+    if (seconds <= 0) {
+        WARN("Usage: pmbench [SECONDS]");
+        return;
+    }
+
+    // ランダムに選んだスロットの領域を解放し、ランダムな大きさ (1〜16ページ) の領域を
+    // 割り当て直すことを繰り返す。物理メモリが断片化していくので、空き領域の探索が遅いと
+    // 性能が落ちる。
+    task_t self = sys_task_self();
+    paddr_t paddrs[PMBENCH_SLOTS];
+    size_t sizes[PMBENCH_SLOTS];
+    memset(paddrs, 0, sizeof(paddrs));
+    uint32_t rand_state = 0x12345678;  // 毎回同じ系列にするため、シードは固定
+    int start = wait_for_next_second();
+    unsigned count = 0;
+    while (sys_uptime() < start + seconds) {
+        // システムコールの回数を減らすため、経過時間は64回ごとに確認する。
+        for (int i = 0; i < 64; i++) {
+            int slot = pmbench_rand(&rand_state) % PMBENCH_SLOTS;
+            if (paddrs[slot]) {
+                ASSERT_OK(sys_pm_free(self, paddrs[slot], sizes[slot]));
+            }
+
+            size_t size = (pmbench_rand(&rand_state) % 16 + 1) * PAGE_SIZE;
+            pfn_t pfn = sys_pm_alloc(self, size, 0);
+            ASSERT_OK(pfn);
+            paddrs[slot] = PFN2PADDR(pfn);
+            sizes[slot] = size;
+        }
+
+        count += 64;
+    }
+
+    for (int i = 0; i < PMBENCH_SLOTS; i++) {
+        if (paddrs[i]) {
+            ASSERT_OK(sys_pm_free(self, paddrs[i], sizes[i]));
+        }
+    }
+
+    unsigned per_sec = count / seconds;
+    INFO("pmbench: %u alloc/free pairs in %d seconds (%u/sec, %u ns/pair)",
+         count, seconds, per_sec, per_sec ? 1000000000 / per_sec : 0);
+}
+
 static void do_uptime(struct args *args) {
     printf("%d seconds\n", sys_uptime());
 }
 
 __noreturn static void do_shutdown(struct args *args) {
+    // ファイルシステムサーバが書き戻していないデータを失わないようにする。
+    fs_sync();
+
     INFO("shutting down...");
     sys_shutdown();
 }
@@ -154,12 +355,25 @@ static struct command commands[] = {
     {.name = "http", .run = do_http, .help = "Fetch a URL"},
     {.name = "cat", .run = do_cat, .help = "Show file contents"},
     {.name = "write", .run = do_write, .help = "Write text to a file"},
+    {.name = "fscheck",
+     .run = do_fscheck,
+     .help = "Write a large file and verify its contents"},
     {.name = "ls", .run = do_listdir, .help = "List files in a directory"},
     {.name = "mkdir", .run = do_mkdir, .help = "Create a directory"},
     {.name = "delete", .run = do_delete, .help = "Delete a file or directory"},
     {.name = "start", .run = do_start, .help = "Launch a task from bootfs"},
+    {.name = "fork", .run = do_fork, .help = "Test copy-on-write task fork"},
     {.name = "sleep", .run = do_sleep, .help = "Pause for a while"},
     {.name = "ping", .run = do_ping, .help = "Send a ping to pong server"},
+    {.name = "ipcbench",
+     .run = do_ipcbench,
+     .help = "Measure IPC round-trip latency to pong server"},
+    {.name = "ipcbatch",
+     .run = do_ipcbatch,
+     .help = "Measure batched IPC throughput to ipcbatch server"},
+    {.name = "pmbench",
+     .run = do_pmbench,
+     .help = "Measure physical memory allocator throughput"},
     {.name = "uptime", .run = do_uptime, .help = "Show seconds since boot"},
     {.name = "shutdown", .run = do_shutdown, .help = "Shut down the system"},
     {.name = NULL},
@@ -3,6 +3,7 @@
 #include <libs/common/string.h>
 #include <libs/user/ipc.h>
 #include <libs/user/malloc.h>
+#include <libs/user/pages.h>
 
 void fs_read(const char *path) {
     task_t fs_server = ipc_lookup("fs");
@@ -20,11 +21,21 @@ void fs_read(const char *path) {
     ASSERT(m.type == FS_OPEN_REPLY_MSG);
     int fd = m.fs_open_reply.fd;
 
+    // 読み込み用のバッファ。ページごとfsサーバに渡し、読み込んだデータと共に返してもらう。
+    // エラーの場合はfsサーバが解放する。
+    char *buf = pages_alloc(FS_READ_BUF_SIZE);
+    size_t buf_len = FS_READ_BUF_SIZE;
+    if (!buf) {
+        return;
+    }
+
     while (true) {
         m.type = FS_READ_MSG;
+        m.fs_read.buf = (uaddr_t) buf;
+        m.fs_read.buf_len = buf_len;
         m.fs_read.fd = fd;
-        m.fs_read.len = PAGE_SIZE;
-        error_t err = err = ipc_call(fs_server, &m);
+        m.fs_read.len = buf_len - 1;  // ヌル終端の分を残しておく
+        error_t err = ipc_call(fs_server, &m);
         if (err == ERR_EOF) {
             break;
         }
@@ -35,10 +46,10 @@ void fs_read(const char *path) {
         }
 
         ASSERT(m.type == FS_READ_REPLY_MSG);
-        unsigned end =
-            MIN(sizeof(m.fs_read_reply.data) - 1, m.fs_read_reply.data_len);
-        m.fs_read_reply.data[end] = '\0';
-        DBG("%s", m.fs_read_reply.data);
+        buf = (char *) m.fs_read_reply.data;
+        buf_len = m.fs_read_reply.data_len;
+        buf[MIN(buf_len - 1, m.fs_read_reply.read_len)] = '\0';
+        DBG("%s", buf);
     }
 }
 
@@ -47,7 +58,7 @@ void fs_write(const char *path, const uint8_t *buf, size_t len) {
     ASSERT_OK(fs_server);
 
     struct message m;
-    if (len > sizeof(m.fs_write.data)) {
+    if (len > MESSAGE_PAGES_MAX * PAGE_SIZE) {
         WARN("too large data to write");
         return;
     }
@@ -71,17 +82,30 @@ void fs_write(const char *path, const uint8_t *buf, size_t len) {
     ASSERT(m.type == FS_OPEN_REPLY_MSG);
     int fd = m.fs_open_reply.fd;
 
+    // 書き込むデータをページに用意して、ページごとfsサーバに渡す。
+    uint8_t *data = pages_alloc(len);
+    if (!data) {
+        return;
+    }
+
+    memcpy(data, buf, len);
     m.type = FS_WRITE_MSG;
-    m.fs_write.fd = fd;
-    memcpy(m.fs_write.data, buf, len);
+    m.fs_write.data = (uaddr_t) data;
     m.fs_write.data_len = len;
+    m.fs_write.fd = fd;
     err = ipc_call(fs_server, &m);
     if (IS_ERROR(err)) {
         WARN("failed to write into a file: %s", err2str(err));
+        // 送信できなかった場合はページがまだ手元に残っているので解放する。fsサーバが
+        // エラーを返した場合は、fsサーバ側で解放されている。
+        if (m.type == FS_WRITE_MSG) {
+            pages_free(data, len);
+        }
         return;
     }
 
     ASSERT(m.type == FS_WRITE_REPLY_MSG);
+    pages_free((void *) m.fs_write_reply.buf, m.fs_write_reply.buf_len);
 }
 
 void fs_listdir(const char *path) {
@@ -142,3 +166,170 @@ void fs_delete(const char *path) {
 
     ASSERT(m.type == FS_DELETE_REPLY_MSG);
 }
+
+error_t fs_sync(void) {
+    task_t fs_server = ipc_lookup("fs");
+    ASSERT_OK(fs_server);
+
+    struct message m;
+    m.type = FS_SYNC_MSG;
+    error_t err = ipc_call(fs_server, &m);
+    if (IS_ERROR(err)) {
+        WARN("failed to sync: %s", err2str(err));
+        return err;
+    }
+
+    ASSERT(m.type == FS_SYNC_REPLY_MSG);
+    return OK;
+}
+
+// fs_check関数で書き込むデータ。ブロックごとに値をずらし、ブロックの取り違えも検出できる
+// ようにする。
+static uint8_t check_pattern(size_t offset) {
+    return (offset + (offset / PAGE_SIZE) * 7) & 0xff;
+}
+
+// ファイルを開く。createがtrueであれば、ファイルが存在しない場合に作成する。
+static int open_file(task_t fs_server, const char *path, bool create) {
+    struct message m;
+    if (create) {
+        m.type = FS_MKFILE_MSG;
+        strcpy_safe(m.fs_mkfile.path, sizeof(m.fs_mkfile.path), path);
+        error_t err = ipc_call(fs_server, &m);
+        if (err != OK && err != ERR_ALREADY_EXISTS) {
+            WARN("failed to create a file: '%s' (%s)", path, err2str(err));
+            return err;
+        }
+    }
+
+    m.type = FS_OPEN_MSG;
+    strcpy_safe(m.fs_open.path, sizeof(m.fs_open.path), path);
+    error_t err = ipc_call(fs_server, &m);
+    if (IS_ERROR(err)) {
+        WARN("failed to open a file: '%s' (%s)", path, err2str(err));
+        return err;
+    }
+
+    ASSERT(m.type == FS_OPEN_REPLY_MSG);
+    return m.fs_open_reply.fd;
+}
+
+// ファイルを閉じる。
+static void close_file(task_t fs_server, int fd) {
+    struct message m;
+    m.type = FS_CLOSE_MSG;
+    m.fs_close.fd = fd;
+    OOPS_OK(ipc_call(fs_server, &m));
+}
+
+// sizeバイト (FS_WRITE_BUF_SIZEの倍数に切り上げる) のファイルを書き込み、ディスクに書き
+// 戻してから読み込み直して、内容が一致するかを確認する。ブロックキャッシュより大きな
+// ファイルを指定すると、書き戻しやキャッシュからの追い出しを経ても内容が壊れないことを
+// 確認できる。
+bool fs_check(const char *path, size_t size) {
+    task_t fs_server = ipc_lookup("fs");
+    ASSERT_OK(fs_server);
+
+    size = ALIGN_UP(size, FS_WRITE_BUF_SIZE);
+    int fd = open_file(fs_server, path, true);
+    if (IS_ERROR(fd)) {
+        return false;
+    }
+
+    // 一度のfs_write RPCで送れる大きさずつ書き込む。返ってきたページは次の書き込みに
+    // 使い回す。エラーの場合はfsサーバが解放する。
+    uint8_t *data = pages_alloc(FS_WRITE_BUF_SIZE);
+    if (!data) {
+        close_file(fs_server, fd);
+        return false;
+    }
+
+    struct message m;
+    for (size_t offset = 0; offset < size; offset += FS_WRITE_BUF_SIZE) {
+        for (size_t i = 0; i < FS_WRITE_BUF_SIZE; i++) {
+            data[i] = check_pattern(offset + i);
+        }
+
+        m.type = FS_WRITE_MSG;
+        m.fs_write.data = (uaddr_t) data;
+        m.fs_write.data_len = FS_WRITE_BUF_SIZE;
+        m.fs_write.fd = fd;
+        error_t err = ipc_call(fs_server, &m);
+        if (IS_ERROR(err)) {
+            WARN("failed to write into a file: %s", err2str(err));
+            if (m.type == FS_WRITE_MSG) {
+                pages_free(data, FS_WRITE_BUF_SIZE);
+            }
+            close_file(fs_server, fd);
+            return false;
+        }
+
+        ASSERT(m.type == FS_WRITE_REPLY_MSG);
+        data = (uint8_t *) m.fs_write_reply.buf;
+    }
+
+    pages_free(data, FS_WRITE_BUF_SIZE);
+    close_file(fs_server, fd);
+
+    if (fs_sync() != OK) {
+        return false;
+    }
+
+    // 先頭から読み込み直して、書き込んだ内容と比較する。
+    fd = open_file(fs_server, path, false);
+    if (IS_ERROR(fd)) {
+        return false;
+    }
+
+    uint8_t *buf = pages_alloc(FS_READ_BUF_SIZE);
+    size_t buf_len = FS_READ_BUF_SIZE;
+    if (!buf) {
+        close_file(fs_server, fd);
+        return false;
+    }
+
+    bool ok = true;
+    size_t offset = 0;
+    while (ok) {
+        m.type = FS_READ_MSG;
+        m.fs_read.buf = (uaddr_t) buf;
+        m.fs_read.buf_len = buf_len;
+        m.fs_read.fd = fd;
+        m.fs_read.len = buf_len;
+        error_t err = ipc_call(fs_server, &m);
+        if (err == ERR_EOF) {
+            break;
+        }
+
+        if (IS_ERROR(err)) {
+            WARN("failed to read a file: %s", err2str(err));
+            close_file(fs_server, fd);
+            return false;
+        }
+
+        ASSERT(m.type == FS_READ_REPLY_MSG);
+        buf = (uint8_t *) m.fs_read_reply.data;
+        buf_len = m.fs_read_reply.data_len;
+        for (size_t i = 0; i < m.fs_read_reply.read_len; i++) {
+            if (buf[i] != check_pattern(offset + i)) {
+                WARN("%s: mismatch at offset %d: expected %x, got %x", path,
+                     offset + i, check_pattern(offset + i), buf[i]);
+                ok = false;
+                break;
+            }
+        }
+
+        offset += m.fs_read_reply.read_len;
+    }
+
+    pages_free(buf, buf_len);
+    close_file(fs_server, fd);
+
+    if (ok && offset != size) {
+        WARN("%s: unexpected file size: expected %d, got %d", path, size,
+             offset);
+        ok = false;
+    }
+
+    return ok;
+}
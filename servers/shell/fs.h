@@ -1,8 +1,16 @@
 #pragma once
+#include <libs/common/message.h>
 #include <libs/common/types.h>
 
+// ファイルの読み込みに使うバッファのサイズ。一度のfs_read RPCでこのサイズまで読み込む。
+#define FS_READ_BUF_SIZE (4 * PAGE_SIZE)
+// ファイルの書き込みに使うバッファのサイズ。一度のfs_write RPCで送れる最大のサイズ。
+#define FS_WRITE_BUF_SIZE (MESSAGE_PAGES_MAX * PAGE_SIZE)
+
 void fs_read(const char *path);
 void fs_write(const char *path, const uint8_t *buf, size_t len);
 void fs_listdir(const char *path);
 void fs_mkdir(const char *path);
 void fs_delete(const char *path);
+error_t fs_sync(void);
+bool fs_check(const char *path, size_t size);
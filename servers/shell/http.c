@@ -4,18 +4,23 @@
 #include <libs/common/string.h>
 #include <libs/user/ipc.h>
 #include <libs/user/malloc.h>
+#include <libs/user/pages.h>
+
+// 受信に使うバッファのサイズ
+#define RX_BUF_SIZE (4 * PAGE_SIZE)
 
 static task_t tcpip_server;
+static uint8_t *rx_buf;  // 受信に使うバッファ (TCP/IPサーバとの間で行き来する)
 
-static void send(int sock, const uint8_t *buf, size_t len) {
+// pages_alloc関数で割り当てたbufをページごとTCP/IPサーバに渡して送信する。
+static void send(int sock, uint8_t *buf, size_t len) {
     struct message m;
-    ASSERT(len < sizeof(m.tcpip_write.data));
-
     m.type = TCPIP_WRITE_MSG;
-    m.tcpip_write.sock = sock;
-    memcpy(m.tcpip_write.data, buf, len);
+    m.tcpip_write.data = (uaddr_t) buf;
     m.tcpip_write.data_len = len;
+    m.tcpip_write.sock = sock;
     ASSERT_OK(ipc_call(tcpip_server, &m));
+    pages_free((void *) m.tcpip_write_reply.buf, m.tcpip_write_reply.buf_len);
 }
 
 static void received(int sock, uint8_t *buf, size_t len) {
@@ -25,6 +30,21 @@ static void received(int sock, uint8_t *buf, size_t len) {
     return;
 }
 
+// 受信済みデータを読み込む。バッファはページごとTCP/IPサーバに渡し、データと共に返して
+// もらう。
+static void recv(int sock) {
+    struct message m;
+    m.type = TCPIP_READ_MSG;
+    m.tcpip_read.buf = (uaddr_t) rx_buf;
+    m.tcpip_read.buf_len = RX_BUF_SIZE;
+    m.tcpip_read.sock = sock;
+    m.tcpip_read.len = RX_BUF_SIZE - 1;  // ヌル終端の分を残しておく
+    ASSERT_OK(ipc_call(tcpip_server, &m));
+
+    rx_buf = (uint8_t *) m.tcpip_read_reply.data;
+    received(sock, rx_buf, m.tcpip_read_reply.read_len);
+}
+
 static error_t parse_ipaddr(const char *str, uint32_t *ip_addr) {
     char *s_orig = strdup(str);
     char *s = s_orig;
@@ -116,8 +136,10 @@ void http_get(const char *url) {
     ASSERT_OK(ipc_call(tcpip_server, &m));
     int sock = m.tcpip_connect_reply.sock;
 
-    int buf_len = 1024;
-    char *buf = malloc(buf_len);
+    // リクエストはページ上に組み立てて、コピーせずにTCP/IPサーバに渡す。
+    char *buf = pages_alloc(PAGE_SIZE);
+    rx_buf = pages_alloc(RX_BUF_SIZE);
+    ASSERT(buf != NULL && rx_buf != NULL);
 
     char *p = buf;
     for (const char *s = "GET /"; *s; s++) {
@@ -132,7 +154,6 @@ void http_get(const char *url) {
     *p = '\0';
 
     send(sock, (uint8_t *) buf, strlen(buf));
-    free(buf);
 
     while (1) {
         error_t err = ipc_recv(IPC_ANY, &m);
@@ -140,13 +161,8 @@ void http_get(const char *url) {
 
         switch (m.type) {
             case TCPIP_CLOSED_MSG: {
-                m.type = TCPIP_READ_MSG;
-                m.tcpip_read.sock = m.tcpip_closed.sock;
-                error_t err = ipc_call(tcpip_server, &m);
-
-                ASSERT_OK(err);
-                received(sock, m.tcpip_read_reply.data,
-                         m.tcpip_read_reply.data_len);
+                recv(m.tcpip_closed.sock);
+                pages_free(rx_buf, RX_BUF_SIZE);
 
                 m.type = TCPIP_CLOSE_MSG;
                 m.tcpip_close.sock = m.tcpip_close.sock;
@@ -154,13 +170,7 @@ void http_get(const char *url) {
                 return;
             }
             case TCPIP_DATA_MSG: {
-                m.type = TCPIP_READ_MSG;
-                m.tcpip_read.sock = m.tcpip_data.sock;
-                error_t err = ipc_call(tcpip_server, &m);
-
-                ASSERT_OK(err);
-                received(sock, m.tcpip_read_reply.data,
-                         m.tcpip_read_reply.data_len);
+                recv(m.tcpip_data.sock);
                 break;
             }
             default:
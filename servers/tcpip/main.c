@@ -7,12 +7,17 @@
 #include <libs/common/list.h>
 #include <libs/common/print.h>
 #include <libs/common/string.h>
+#include <libs/user/channel.h>
 #include <libs/user/ipc.h>
 #include <libs/user/malloc.h>
+#include <libs/user/pages.h>
 #include <libs/user/syscall.h>
+#include <servers/virtio_net/virtio_net.h>  // NET_RX_CHANNEL_SIZE
 
 // ネットワークデバイスドライバサーバ
 static task_t net_device;
+// ネットワークデバイスドライバから受信パケットを受け取るチャネル
+static struct channel rx_channel;
 // ソケット管理構造体
 static struct socket sockets[SOCKETS_MAX];
 
@@ -82,6 +87,16 @@ void callback_ethernet_transmit(mbuf_t pkt) {
     }
 }
 
+// ネットワークデバイスから届いたパケットをチャネルが空になるまで処理する。
+static void receive_packets(void) {
+    void *pkt;
+    size_t len;
+    while ((pkt = channel_peek(&rx_channel, &len)) != NULL) {
+        ethernet_receive(pkt, len);
+        channel_consume(&rx_channel);
+    }
+}
+
 // PCBからソケット構造体を取得する。
 static struct socket *get_socket_from_pcb(struct tcp_pcb *pcb) {
     ASSERT(pcb->arg != NULL);
@@ -134,10 +149,15 @@ void main(void) {
     m.type = WATCH_TASKS_MSG;
     ASSERT_OK(ipc_call(VM_SERVER, &m));
 
-    // ネットワークデバイスドライバに接続し、MACアドレスを取得する。
+    // ネットワークデバイスドライバに接続し、MACアドレスを取得する。受信パケットは共有
+    // メモリ上のチャネルで受け取る。
     net_device = ipc_lookup("net_device");
     ASSERT_OK(net_device);
+    uaddr_t rx_channel_uaddr;
+    ASSERT_OK(channel_create(&rx_channel, net_device, NET_RX_CHANNEL_SIZE,
+                             false, &rx_channel_uaddr));
     m.type = NET_OPEN_MSG;
+    m.net_open.rx_channel = rx_channel_uaddr;
     ASSERT_OK(ipc_call(net_device, &m));
     ASSERT(m.type == NET_OPEN_REPLY_MSG);
 
@@ -154,9 +174,9 @@ void main(void) {
         ASSERT_OK(err);
 
         switch (m.type) {
-            case NET_RECV_MSG: {
+            case NOTIFY_CHANNEL_MSG: {
                 // ネットワークデバイスからパケットが届いた。
-                ethernet_receive(m.net_recv.payload, m.net_recv.payload_len);
+                receive_packets();
                 dhcp_receive();
                 break;
             }
@@ -191,9 +211,9 @@ void main(void) {
                 ASSERT_OK(sys_time(TIMER_INTERVAL));
                 break;
             }
-            case NET_RECV_MSG: {
+            case NOTIFY_CHANNEL_MSG: {
                 // ネットワークデバイスからパケットが届いた。
-                ethernet_receive(m.net_recv.payload, m.net_recv.payload_len);
+                receive_packets();
                 dhcp_receive();
                 dns_receive();
                 break;
@@ -235,31 +255,40 @@ void main(void) {
                 break;
             }
             case TCPIP_WRITE_MSG: {
+                // 添付されたページから送信バッファに移し、ページはそのまま返す。
+                void *data = (void *) m.tcpip_write.data;
+                size_t data_len = m.tcpip_write.data_len;
                 struct socket *sock = lookup_socket(m.src, m.tcpip_write.sock);
                 if (!sock) {
+                    pages_free(data, data_len);
                     ipc_reply_err(m.src, ERR_INVALID_ARG);
                     break;
                 }
 
-                tcp_write(sock->tcp_pcb, m.tcpip_write.data,
-                          m.tcpip_write.data_len);
+                tcp_write(sock->tcp_pcb, data, data_len);
 
                 m.type = TCPIP_WRITE_REPLY_MSG;
+                m.tcpip_write_reply.buf = (uaddr_t) data;
+                m.tcpip_write_reply.buf_len = data_len;
                 ipc_reply(m.src, &m);
                 break;
             }
             case TCPIP_READ_MSG: {
+                // 添付されたページに直接読み込み、そのまま返す。
+                void *buf = (void *) m.tcpip_read.buf;
+                size_t buf_len = m.tcpip_read.buf_len;
                 struct socket *sock = lookup_socket(m.src, m.tcpip_read.sock);
                 if (!sock) {
+                    pages_free(buf, buf_len);
                     ipc_reply_err(m.src, ERR_INVALID_ARG);
                     break;
                 }
 
+                size_t len = MIN(m.tcpip_read.len, buf_len);
                 m.type = TCPIP_READ_REPLY_MSG;
-                m.tcpip_read_reply.data_len =
-                    tcp_read(sock->tcp_pcb, m.tcpip_read_reply.data,
-                             sizeof(m.tcpip_read_reply.data));
-
+                m.tcpip_read_reply.data = (uaddr_t) buf;
+                m.tcpip_read_reply.data_len = buf_len;
+                m.tcpip_read_reply.read_len = tcp_read(sock->tcp_pcb, buf, len);
                 ipc_reply(m.src, &m);
                 break;
             }
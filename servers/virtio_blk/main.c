@@ -1,19 +1,40 @@
 #include "virtio_blk.h"
 #include <libs/common/print.h>
 #include <libs/common/string.h>
+#include <libs/user/channel.h>
 #include <libs/user/dmabuf.h>
 #include <libs/user/driver.h>
 #include <libs/user/ipc.h>
+#include <libs/user/pages.h>
 #include <libs/user/syscall.h>
 #include <libs/user/virtio/virtio_mmio.h>
 
 static struct virtio_mmio device;      // virtioデバイスの管理構造体
 static struct virtio_virtq *requestq;  // 読み書き処理要求用virtqueue
 static dmabuf_t dmabuf;                // 読み書き処理要求用virtqueueで使われるバッファ
+static task_t channel_owner;           // チャネルを登録したタスク (0なら未登録)
+static struct channel req_channel;     // 読み書き要求を受け取るチャネル
+static struct channel resp_channel;    // 処理結果を返すチャネル
+static task_t process_waiter;          // blk_processの返信を待つタスク (0ならなし)
+static size_t resp_budget;             // 応答チャネルに書き込んでよい残りバイト数
+static int num_channel_inflight;       // チャネルから受け取って処理中の要求の数
+static struct inflight_request inflight[NUM_REQUEST_BUFFERS];  // 処理中の要求
 
-// ディスクの読み書き
-static error_t read_write(task_t task, uint64_t sector, void *buf, size_t len,
-                          bool is_write) {
+// blk_process RPCごとに応答チャネルに書き込んでよいバイト数。データ領域の末尾に収まらない
+// レコードの分だけパディングで無駄になるので、データ領域の半分までにしておく。
+#define RESP_BUDGET (BLK_CHANNEL_SIZE / 2)
+
+STATIC_ASSERT(sizeof(struct blk_channel_response) + BLK_REQUEST_MAX
+                  + sizeof(struct channel_record)
+                  <= RESP_BUDGET,
+              "a response must fit in the response channel budget");
+
+// ディスクの読み書き要求をvirtqueueに追加する。書き込み要求の場合は、dataの内容を書き込む。
+// 処理が終わると割り込みで通知されるので、irq_handler関数で結果を処理する。
+//
+// 呼び出し側は、要求を追加し終えたらvirtq_notify関数でデバイスに通知すること。
+static error_t submit(uint64_t sector, const void *data, size_t len,
+                      bool is_write, struct inflight_request **inflight_req) {
     // 読み込むバイト数はセクタサイズにアラインされている必要がある
     if (!IS_ALIGNED(len, SECTOR_SIZE)) {
         return ERR_INVALID_ARG;
@@ -24,11 +45,10 @@ static error_t read_write(task_t task, uint64_t sector, void *buf, size_t len,
         return ERR_TOO_LARGE;
     }
 
-    // 処理要求用のバッファを割り当てる
+    // 処理要求用のバッファを割り当てる。空きがなければ、処理中の要求が終わるのを待つ。
     struct virtio_blk_req *req;
     paddr_t paddr;
     if ((req = dmabuf_alloc(dmabuf, &paddr)) == NULL) {
-        WARN("no free TX buffers");
         return ERR_TRY_AGAIN;
     }
 
@@ -36,8 +56,9 @@ static error_t read_write(task_t task, uint64_t sector, void *buf, size_t len,
     req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
     req->reserved = 0;
     req->sector = sector;
+    req->status = 0xff;
     if (is_write) {
-        memcpy(req->data, buf, len);
+        memcpy(req->data, data, len);
     }
 
     // ディスクリプタチェーン[0]: type, reserved, sector (デバイスからは読み込み専用)
@@ -57,39 +78,196 @@ static error_t read_write(task_t task, uint64_t sector, void *buf, size_t len,
     // virtqueueにディスクリプタチェーンを追加
     int index_or_err = virtq_push(requestq, chain, 3);
     if (IS_ERROR(index_or_err)) {
+        dmabuf_free(dmabuf, paddr);
         return index_or_err;
     }
 
-    // virtio-blkに通知
-    virtq_notify(&device, requestq);
+    // 処理中の要求として記録する。DMAバッファと同じ数だけ用意しているので必ず空きがある。
+    struct inflight_request *r = NULL;
+    for (int i = 0; i < NUM_REQUEST_BUFFERS; i++) {
+        if (!inflight[i].used) {
+            r = &inflight[i];
+            break;
+        }
+    }
 
-    // 処理を終えるまでビジーウェイトする
-    while (virtq_is_empty(requestq))
-        ;
+    ASSERT(r != NULL);
+    r->used = true;
+    r->paddr = paddr;
+    r->req = req;
+    r->sector = sector;
+    r->len = len;
+    r->is_write = is_write;
+    r->rpc_src = 0;
+    r->buf = NULL;
+    r->buf_len = 0;
+    *inflight_req = r;
+    return OK;
+}
 
-    // virtqueueから処理が終わったディスクリプタチェーンを取り出す
-    size_t total_len;
-    int n = virtq_pop(requestq, chain, 3, &total_len);
-    if (IS_ERROR(n)) {
-        WARN("virtq_pop returned an error: %s", err2str(n));
-        dmabuf_free(dmabuf, paddr);
-        return ERR_UNEXPECTED;
+// 応答チャネルに処理結果を書き込む。読み込み要求の場合はdataの内容も書き込む。
+static void push_response(uint64_t sector, error_t result, const void *data,
+                          uint32_t len) {
+    struct blk_channel_response *resp =
+        channel_reserve(&resp_channel, sizeof(*resp) + len);
+    if (!resp) {
+        // 応答チャネルの空きはresp_budgetで確保しているので、相手が応答を読み込まずに
+        // 要求を送ってきた場合にのみ起きる。
+        WARN("response channel is full, dropping a response");
+        return;
+    }
+
+    resp->sector = sector;
+    resp->result = result;
+    resp->len = len;
+    if (len > 0) {
+        memcpy(resp->data, data, len);
+    }
+
+    channel_commit(&resp_channel);
+}
+
+// 要求チャネルに溜まった読み書き要求をデバイスに送る。DMAバッファが足りない、または応答
+// チャネルに書き込める残りバイト数が足りない場合は、残りの要求を後回しにする。
+//
+// チャネルから受け取った要求がすべて処理し終わったら、blk_process RPCに返信する。
+static void process_channel(void) {
+    bool submitted = false;
+    struct blk_channel_request *req;
+    size_t len;
+    while ((req = channel_peek(&req_channel, &len)) != NULL) {
+        // 共有メモリ上の値は相手に書き換えられうるので、コピーしてから検証する。
+        uint64_t sector = req->sector;
+        uint32_t data_len = req->len;
+        bool is_write = req->is_write;
+        error_t result = OK;
+        if (len < sizeof(*req) || !IS_ALIGNED(data_len, SECTOR_SIZE)
+            || data_len > BLK_REQUEST_MAX
+            || (is_write && len - sizeof(*req) < data_len)) {
+            result = ERR_INVALID_ARG;
+        }
+
+        // 処理結果を書き込む応答チャネルの空きを確保する。
+        size_t read_len = (result == OK && !is_write) ? data_len : 0;
+        size_t resp_len =
+            ALIGN_UP(sizeof(struct channel_record)
+                         + sizeof(struct blk_channel_response) + read_len,
+                     CHANNEL_RECORD_ALIGN);
+        if (resp_len > resp_budget) {
+            break;
+        }
+
+        // デバイスに要求を送る。書き込むデータはDMAバッファにコピーされる。
+        struct inflight_request *r;
+        if (result == OK) {
+            result = submit(sector, req->data, data_len, is_write, &r);
+            if (result == ERR_TRY_AGAIN) {
+                // DMAバッファが空くまで待つ。
+                break;
+            }
+        }
+
+        resp_budget -= resp_len;
+        if (result == OK) {
+            num_channel_inflight++;
+            submitted = true;
+        } else {
+            push_response(sector, result, NULL, 0);
+        }
+
+        channel_consume(&req_channel);
+    }
+
+    if (submitted) {
+        // virtio-blkに通知
+        virtq_notify(&device, requestq);
     }
 
-    // ディスクリプタチェーンの内容を確認する。ここで送ったディスクリプタチェーンに対する
-    // 応答が返ってきているはず。
-    ASSERT(n == 3);
-    ASSERT(chain[0].desc_index == index_or_err);
-    ASSERT(chain[1].len == len);
-    ASSERT(req->status == VIRTIO_BLK_S_OK);
+    // 処理中の要求がなくなったら返信する。まだ要求チャネルに要求が残っていれば、相手は
+    // 応答を読み込んだ後に再びblk_process RPCを呼ぶ。
+    if (process_waiter && num_channel_inflight == 0) {
+        struct message m;
+        m.type = BLK_PROCESS_REPLY_MSG;
+        ipc_reply(process_waiter, &m);
+        process_waiter = 0;
+    }
+}
 
-    // 読み込み処理の場合は読み込んだデータをメモリバッファにコピーする
-    if (!is_write) {
-        memcpy(buf, req->data, len);
+// デバイスが処理を終えた要求の結果を、要求元に返す。
+static void complete(struct inflight_request *r, error_t result) {
+    if (r->rpc_src) {
+        // blk_read/blk_write RPCの呼び出し元に返信する。
+        struct message m;
+        if (result != OK) {
+            pages_free(r->buf, r->buf_len);
+            ipc_reply_err(r->rpc_src, result);
+        } else if (r->is_write) {
+            m.type = BLK_WRITE_REPLY_MSG;
+            m.blk_write_reply.buf = (uaddr_t) r->buf;
+            m.blk_write_reply.buf_len = r->buf_len;
+            ipc_reply(r->rpc_src, &m);
+        } else {
+            // 添付されたページに読み込んだデータをコピーし、そのまま返す。
+            memcpy(r->buf, r->req->data, r->len);
+            m.type = BLK_READ_REPLY_MSG;
+            m.blk_read_reply.data = (uaddr_t) r->buf;
+            m.blk_read_reply.data_len = r->buf_len;
+            ipc_reply(r->rpc_src, &m);
+        }
+    } else {
+        // 応答チャネルに処理結果を書き込む。読み込んだデータも直接書き込む。
+        uint32_t read_len = (result == OK && !r->is_write) ? r->len : 0;
+        push_response(r->sector, result, r->req->data, read_len);
+        num_channel_inflight--;
     }
 
-    dmabuf_free(dmabuf, paddr);
-    return OK;
+    dmabuf_free(dmabuf, r->paddr);
+    r->used = false;
+}
+
+// 割り込みハンドラ
+static void irq_handler(void) {
+    // 割り込みを受信したことをデバイスに通知する
+    uint8_t status = virtio_read_interrupt_status(&device);
+    virtio_ack_interrupt(&device, status);
+
+    // 割り込みの原因: デバイスがvirtqueueを更新した
+    if (status & VIRTIO_ISR_STATUS_QUEUE) {
+        // 処理が終わった要求を見ていくループ。要求を送った順に終わるとは限らない。
+        struct virtio_chain_entry chain[3];
+        size_t total_len;
+        int n;
+        while ((n = virtq_pop(requestq, chain, 3, &total_len)) > 0) {
+            // ディスクリプタチェーンの先頭のアドレスから、対応する要求を探す。
+            struct inflight_request *r = NULL;
+            for (int i = 0; i < NUM_REQUEST_BUFFERS; i++) {
+                if (inflight[i].used && inflight[i].paddr == chain[0].addr) {
+                    r = &inflight[i];
+                    break;
+                }
+            }
+
+            if (!r || n != 3) {
+                WARN("unexpected descriptor chain from the device");
+                continue;
+            }
+
+            error_t result =
+                (r->req->status == VIRTIO_BLK_S_OK) ? OK : ERR_UNEXPECTED;
+            if (result != OK) {
+                WARN("failed to %s sector %d (status=%d)",
+                     r->is_write ? "write" : "read", (int) r->sector,
+                     r->req->status);
+            }
+
+            complete(r, result);
+        }
+    }
+
+    // DMAバッファが空いたので、チャネルに残っている要求を処理する。
+    if (process_waiter) {
+        process_channel();
+    }
 }
 
 // virtio-blkデバイスを初期化する
@@ -108,11 +286,12 @@ static void init_device(void) {
     // virtqueueへのポインタを取得する。
     requestq = virtq_get(&device, 0);
 
-    // 割り込みは使わないので無効化しておく。代わりにビジーウェイトで処理の完了を待つ。
-    requestq->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
-
     // 処理要求用のDMAバッファを作成する。
     dmabuf = dmabuf_create(sizeof(struct virtio_blk_req), NUM_REQUEST_BUFFERS);
+    ASSERT(dmabuf != NULL);
+
+    // 処理の完了は割り込みで受け取る。
+    ASSERT_OK(sys_irq_listen(VIRTIO_BLK_IRQ));
 }
 
 void main(void) {
@@ -127,35 +306,90 @@ void main(void) {
         struct message m;
         ASSERT_OK(ipc_recv(IPC_ANY, &m));
         switch (m.type) {
+            // 割り込み処理
+            case NOTIFY_IRQ_MSG:
+                irq_handler();
+                break;
             case BLK_READ_MSG: {
-                uint8_t buf[SECTOR_SIZE];
-                size_t len = m.blk_read.len;
-                error_t err =
-                    read_write(m.src, m.blk_read.sector, buf, len, false);
+                // 添付されたページに直接読み込み、処理が終わったらそのまま返す。
+                uint8_t *buf = (uint8_t *) m.blk_read.buf;
+                size_t buf_len = m.blk_read.buf_len;
+                struct inflight_request *r;
+                error_t err = ERR_INVALID_ARG;
+                if (m.blk_read.len <= buf_len) {
+                    err = submit(m.blk_read.sector, NULL, m.blk_read.len,
+                                 false, &r);
+                }
+
                 if (err != OK) {
+                    pages_free(buf, buf_len);
                     ipc_reply_err(m.src, err);
                     break;
                 }
 
-                m.type = BLK_READ_REPLY_MSG;
-                m.blk_read_reply.data_len = m.blk_read.len;
-                memcpy(m.blk_read_reply.data, buf, len);
-                ipc_reply(m.src, &m);
+                r->rpc_src = m.src;
+                r->buf = buf;
+                r->buf_len = buf_len;
+                virtq_notify(&device, requestq);
                 break;
             }
             case BLK_WRITE_MSG: {
+                // 添付されたページから書き込み、処理が終わったらページをそのまま返す。
+                uint8_t *data = (uint8_t *) m.blk_write.data;
+                size_t data_len = m.blk_write.data_len;
+                struct inflight_request *r;
                 error_t err =
-                    read_write(m.src, m.blk_write.sector, m.blk_write.data,
-                               m.blk_write.data_len, true);
+                    submit(m.blk_write.sector, data, data_len, true, &r);
                 if (err != OK) {
+                    pages_free(data, data_len);
                     ipc_reply_err(m.src, err);
                     break;
                 }
 
-                m.type = BLK_WRITE_REPLY_MSG;
+                r->rpc_src = m.src;
+                r->buf = data;
+                r->buf_len = data_len;
+                virtq_notify(&device, requestq);
+                break;
+            }
+            case BLK_OPEN_MSG: {
+                if (channel_owner) {
+                    ipc_reply_err(m.src, ERR_ALREADY_USED);
+                    break;
+                }
+
+                // 要求の処理はblk_process RPCで依頼されるので、通知は不要。
+                error_t err = channel_attach(&req_channel, m.src,
+                                             m.blk_open.req_channel,
+                                             BLK_CHANNEL_SIZE, false);
+                if (err == OK) {
+                    err = channel_attach(&resp_channel, m.src,
+                                         m.blk_open.resp_channel,
+                                         BLK_CHANNEL_SIZE, false);
+                }
+
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                channel_owner = m.src;
+                m.type = BLK_OPEN_REPLY_MSG;
                 ipc_reply(m.src, &m);
                 break;
             }
+            case BLK_PROCESS_MSG: {
+                if (!channel_owner || m.src != channel_owner) {
+                    ipc_reply_err(m.src, ERR_NOT_ALLOWED);
+                    break;
+                }
+
+                // 要求をデバイスに送り、すべて処理し終わったら返信する。
+                process_waiter = m.src;
+                resp_budget = RESP_BUDGET;
+                process_channel();
+                break;
+            }
             default:
                 WARN("unhandled message: %d", m.type);
                 break;
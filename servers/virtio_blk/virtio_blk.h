@@ -8,14 +8,17 @@
 
 #define VIRTIO_BLK_S_OK 0   // 処理成功
 
-// 読み書き処理要求用DMAバッファの数。逐次的に処理するため、ひとつで十分。
-#define NUM_REQUEST_BUFFERS 1
+// 読み書き処理要求用DMAバッファの数。同時にデバイスに処理させられる要求の最大数でもある。
+#define NUM_REQUEST_BUFFERS 8
 
 // セクタのサイズ (バイト数)。ディスクの読み書きの最小単位。
 #define SECTOR_SIZE 512
 
+// 1回の要求で読み書きできる最大バイト数。連続する複数のブロックをまとめて読み書きできる。
+#define BLK_REQUEST_MAX (16 * 1024)
+
 // 一度に読み書きできる最大バイト数。セクタサイズにアラインされている必要がある。
-#define REQUEST_BUFFER_SIZE SECTOR_SIZE
+#define REQUEST_BUFFER_SIZE BLK_REQUEST_MAX
 
 STATIC_ASSERT(IS_ALIGNED(REQUEST_BUFFER_SIZE, SECTOR_SIZE),
               "virtio-blk buffer size must be aligned to the sector size");
@@ -28,3 +31,37 @@ struct virtio_blk_req {
     uint8_t data[REQUEST_BUFFER_SIZE];  // 読み書きするデータ
     uint8_t status;                     // 処理結果。成功ならばVIRTIO_BLK_S_OK。
 } __packed;
+
+// デバイスに処理させている読み書き要求
+struct inflight_request {
+    bool used;                   // この管理構造体を利用中か
+    paddr_t paddr;               // DMAバッファの物理アドレス
+    struct virtio_blk_req *req;  // DMAバッファ
+    uint64_t sector;             // 先頭のセクタ番号
+    uint32_t len;                // 読み書きするバイト数
+    bool is_write;               // 書き込み要求かどうか
+    task_t rpc_src;              // blk_read/blk_write RPCの呼び出し元 (チャネルなら0)
+    uint8_t *buf;                // RPCに添付されたページ
+    size_t buf_len;              // RPCに添付されたページのサイズ
+};
+
+// ブロックデバイスのチャネル (要求・応答それぞれ) のデータ領域のサイズ。最大サイズの要求を
+// 複数溜められる大きさにする。
+#define BLK_CHANNEL_SIZE (64 * 1024)
+
+// 要求チャネルで送る読み書き要求
+struct blk_channel_request {
+    uint64_t sector;  // 先頭のセクタ番号
+    uint32_t len;     // 読み書きするバイト数 (セクタサイズの倍数、BLK_REQUEST_MAX以下)
+    bool is_write;    // 書き込み要求かどうか
+    uint8_t data[];   // 書き込むデータ (書き込み要求の場合のみ)
+};
+
+// 応答チャネルで返す処理結果。要求の順ではなく、デバイスが処理を終えた順に返される。
+// そのため、同じセクタへの読み書き要求を同時に送ってはならない。
+struct blk_channel_response {
+    uint64_t sector;  // 要求の先頭のセクタ番号
+    error_t result;   // 処理結果
+    uint32_t len;     // 読み込んだバイト数 (書き込み要求の場合は0)
+    uint8_t data[];   // 読み込んだデータ
+};
@@ -1,13 +1,15 @@
 #include "virtio_net.h"
 #include <libs/common/print.h>
 #include <libs/common/string.h>
+#include <libs/user/channel.h>
 #include <libs/user/dmabuf.h>
 #include <libs/user/driver.h>
 #include <libs/user/ipc.h>
 #include <libs/user/syscall.h>
 #include <libs/user/virtio/virtio_mmio.h>
 
-static task_t tcpip_server;            // TCP/IPサーバのタスクID
+static struct channel rx_channel;      // 受信パケットをTCP/IPサーバに渡すチャネル
+static bool rx_channel_ready = false;  // rx_channelが使えるかどうか
 static struct virtio_mmio device;      // virtioデバイスの管理構造体
 static struct virtio_virtq *rx_virtq;  // 受信パケット用virtqueue
 static struct virtio_virtq *tx_virtq;  // 送信パケット用virtqueue
@@ -82,12 +84,15 @@ static void irq_handler(void) {
             // ディスクリプタの物理アドレスから対応する仮想アドレスを得る
             struct virtio_net_req *req = dmabuf_p2v(rx_dmabuf, chain[0].addr);
 
-            // TCP/IPサーバにパケットを送信する
-            struct message m;
-            m.type = NET_RECV_MSG;
-            memcpy(m.net_recv.payload, &req->payload, total_len);
-            m.net_recv.payload_len = total_len;
-            OOPS_OK(ipc_send(tcpip_server, &m));
+            // チャネルを介してTCP/IPサーバにパケットを渡す。チャネルが一杯であれば、
+            // 受信バッファが溢れた場合と同様にパケットを破棄する。
+            if (rx_channel_ready) {
+                error_t err =
+                    channel_send(&rx_channel, &req->payload, total_len);
+                if (err != OK) {
+                    WARN("RX channel is full, dropping a packet");
+                }
+            }
 
             // 受信したメモリバッファを再度キューに戻す
             virtq_push(rx_virtq, chain, 1);
@@ -165,7 +170,16 @@ void main(void) {
                 break;
             // ネットワークデバイスを開く
             case NET_OPEN_MSG: {
-                tcpip_server = m.src;  // 受信したパケットの送信先
+                // 受信したパケットを書き込むチャネル
+                error_t err =
+                    channel_attach(&rx_channel, m.src, m.net_open.rx_channel,
+                                   NET_RX_CHANNEL_SIZE, true);
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                rx_channel_ready = true;
                 m.type = NET_OPEN_REPLY_MSG;
                 memcpy(m.net_open_reply.macaddr, macaddr,
                        sizeof(m.net_open_reply.macaddr));
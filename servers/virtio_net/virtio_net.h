@@ -6,6 +6,7 @@
 #define NUM_TX_BUFFERS             128
 #define NUM_RX_BUFFERS             128
 #define VIRTIO_NET_MAX_PACKET_SIZE 1514
+#define NET_RX_CHANNEL_SIZE        (64 * 1024)  // 受信パケット用チャネルのサイズ
 
 #define VIRTIO_NET_F_MAC       (1 << 5)
 #define VIRTIO_NET_F_MRG_RXBUF (1 << 15)
@@ -1,10 +1,13 @@
 #include "bootfs.h"
 #include <libs/common/print.h>
 #include <libs/common/string.h>
+#include <libs/user/syscall.h>
 
 extern char __bootfs[];            // BootFSイメージ
+extern char __bootfs_end[];        // BootFSイメージの終端
 static struct bootfs_file *files;  // BootFSのファイルリスト
 static unsigned num_files;         // BootFS内のファイル数
+static paddr_t image_paddr;        // BootFSイメージの物理アドレス (0なら不明)
 
 // BootFSからファイルを読み込む。
 void bootfs_read(struct bootfs_file *file, offset_t off, void *buf,
@@ -13,6 +16,16 @@ void bootfs_read(struct bootfs_file *file, offset_t off, void *buf,
     memcpy(buf, p, len);
 }
 
+// BootFS上のファイルのoffバイト目の物理アドレスを返す。ファイルの内容をタスクに直接
+// マップできない場合は0を返す。
+paddr_t bootfs_paddr(struct bootfs_file *file, offset_t off) {
+    if (!image_paddr) {
+        return 0;
+    }
+
+    return image_paddr + file->offset + off;
+}
+
 // BootFSのファイルを開く。
 struct bootfs_file *bootfs_open(const char *path) {
     // ファイル名が一致するエントリを探す。
@@ -42,6 +55,19 @@ void bootfs_init(void) {
     files =
         (struct bootfs_file *) (((uaddr_t) &__bootfs) + header->header_size);
 
+    // BootFSイメージの物理アドレスを調べる。VMサーバの各セグメントはカーネルが連続した
+    // 物理メモリ領域に読み込むので、先頭と末尾のページの物理アドレスの差がイメージの
+    // 大きさと一致すれば、イメージ全体が連続していると分かる。
+    pfn_t first = sys_vm_paddr(sys_task_self(), (uaddr_t) __bootfs);
+    pfn_t last = sys_vm_paddr(sys_task_self(), (uaddr_t) __bootfs_end - 1);
+    size_t last_offset = ALIGN_DOWN(__bootfs_end - 1 - __bootfs, PAGE_SIZE);
+    if (!IS_ERROR(first) && !IS_ERROR(last)
+        && PFN2PADDR(last) - PFN2PADDR(first) == last_offset) {
+        image_paddr = PFN2PADDR(first);
+    } else {
+        WARN("bootfs: image is not physically contiguous, disabling zero-copy");
+    }
+
     TRACE("bootfs: found following %d files", num_files);
     for (unsigned i = 0; i < num_files; i++) {
         TRACE("bootfs: \"%s\" (%d KiB)", files[i].name, files[i].len / 1024);
@@ -19,4 +19,5 @@ struct bootfs_file {
 struct bootfs_file *bootfs_open(const char *path);
 struct bootfs_file *bootfs_open_iter(unsigned index);
 void bootfs_read(struct bootfs_file *file, offset_t off, void *buf, size_t len);
+paddr_t bootfs_paddr(struct bootfs_file *file, offset_t off);
 void bootfs_init(void);
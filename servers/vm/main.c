@@ -10,6 +10,9 @@
 #include <libs/user/task.h>
 
 // BootFSにあるサーバのうちBOOT_SERVERSで指定されているものを自動起動する。
+//
+// BOOT_SERVERSの各サーバ名には "virtio_net:4" のように優先度を指定できる。指定しない
+// 場合はTASK_PRIORITY_DEFAULTで実行される。
 static void spawn_servers(void) {
     int num_launched = 0;
     struct bootfs_file *file;
@@ -22,8 +25,17 @@ static void spawn_servers(void) {
             // ファイル名とサーバ名が一致すれば起動する。
             size_t len = strlen(file->name);
             if (!strncmp(file->name, startups, len)
-                && (startups[len] == '\0' || startups[len] == ' ')) {
-                ASSERT_OK(task_spawn(file));
+                && (startups[len] == '\0' || startups[len] == ' '
+                    || startups[len] == ':')) {
+                task_t tid = task_spawn(file);
+                ASSERT_OK(tid);
+
+                // 優先度が指定されていれば設定する。
+                if (startups[len] == ':') {
+                    int priority = atoi(&startups[len + 1]);
+                    OOPS_OK(sys_task_set_priority(tid, priority));
+                }
+
                 num_launched++;
                 break;
             }
@@ -46,7 +58,11 @@ static void spawn_servers(void) {
 }
 
 void main(void) {
+    // 他のタスクのページフォルト処理を待たせないよう、最も高い優先度で動作する。
+    ASSERT_OK(sys_task_set_priority(task_self(), TASK_PRIORITY_HIGHEST));
+
     bootfs_init();
+    page_fault_init();
     spawn_servers();
 
     // service_dump() を後で呼び出すためのタイマーを設定する。
@@ -132,6 +148,21 @@ void main(void) {
                 ipc_reply(m.src, &m);
                 break;
             }
+            case FORK_TASK_MSG: {
+                struct task *task = task_find(m.src);
+                ASSERT(task);
+
+                task_t task_or_err = task_clone(task, m.fork_task.ip);
+                if (IS_ERROR(task_or_err)) {
+                    ipc_reply_err(m.src, task_or_err);
+                    break;
+                }
+
+                m.type = FORK_TASK_REPLY_MSG;
+                m.fork_task_reply.task = task_or_err;
+                ipc_reply(m.src, &m);
+                break;
+            }
             case DESTROY_TASK_MSG: {
                 task_destroy_by_tid(m.destroy_task.task);
                 m.type = DESTROY_TASK_REPLY_MSG;
@@ -158,9 +189,14 @@ void main(void) {
 
                 paddr_t paddr;
                 uaddr_t uaddr;
-                alloc_pages(task, m.vm_alloc_physical.size,
-                            m.vm_alloc_physical.alloc_flags,
-                            m.vm_alloc_physical.map_flags, &paddr, &uaddr);
+                error_t err = alloc_pages(task, m.vm_alloc_physical.size,
+                                          m.vm_alloc_physical.alloc_flags,
+                                          m.vm_alloc_physical.map_flags,
+                                          &paddr, &uaddr);
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
 
                 m.type = VM_ALLOC_PHYSICAL_REPLY_MSG;
                 m.vm_alloc_physical_reply.uaddr = uaddr;
@@ -168,6 +204,37 @@ void main(void) {
                 ipc_reply(m.src, &m);
                 break;
             }
+            case VM_ALLOC_SHARED_MSG: {
+                struct task *task = task_find(m.src);
+                ASSERT(task);
+
+                task_t peer_tid = m.vm_alloc_shared.peer;
+                size_t size = m.vm_alloc_shared.size;
+                if (peer_tid <= 0 || peer_tid > NUM_TASKS_MAX
+                    || peer_tid == task->tid || !task_find(peer_tid)) {
+                    ipc_reply_err(m.src, ERR_INVALID_TASK);
+                    break;
+                }
+
+                if (size == 0 || !IS_ALIGNED(size, PAGE_SIZE)) {
+                    ipc_reply_err(m.src, ERR_INVALID_ARG);
+                    break;
+                }
+
+                uaddr_t uaddr, peer_uaddr;
+                error_t err = alloc_shared_pages(task, task_find(peer_tid),
+                                                 size, &uaddr, &peer_uaddr);
+                if (err != OK) {
+                    ipc_reply_err(m.src, err);
+                    break;
+                }
+
+                m.type = VM_ALLOC_SHARED_REPLY_MSG;
+                m.vm_alloc_shared_reply.uaddr = uaddr;
+                m.vm_alloc_shared_reply.peer_uaddr = peer_uaddr;
+                ipc_reply(m.src, &m);
+                break;
+            }
             case EXCEPTION_MSG: {
                 if (m.src != FROM_KERNEL) {
                     WARN("forged EXCEPTION_MSG from #%d, ignoring...", m.src);
@@ -2,8 +2,219 @@
 #include "bootfs.h"
 #include "task.h"
 #include <libs/common/print.h>
+#include <libs/common/string.h>
 #include <libs/user/syscall.h>
 
+// スクラッチウィンドウのページ数。コピーオンライトでは複製元と複製先の2ページを使う。
+#define SCRATCH_PAGES (FAULT_AROUND_PAGES > 2 ? FAULT_AROUND_PAGES : 2)
+
+// セグメントの内容をコピーするための仮想アドレス領域 (スクラッチウィンドウ)。ここで確保した
+// メモリ領域は実際には使われず、ページフォルト処理のたびに用意した物理ページがまとめて
+// マップされる。
+static __aligned(PAGE_SIZE) uint8_t scratch[SCRATCH_PAGES * PAGE_SIZE];
+
+// ページフォルト処理を初期化する。
+void page_fault_init(void) {
+    // scratchはカーネルによって起動時にマップされているため、一度だけアンマップしておく。
+    ASSERT_OK(
+        sys_vm_unmap_range(sys_task_self(), (uaddr_t) scratch, SCRATCH_PAGES));
+}
+
+// uaddrから始まるnum_pages個のページ (物理アドレスはpaddrから連続) に、セグメントの内容を
+// ELFイメージからコピーする。ページはゼロクリア済みなので、ファイル上に内容がある部分だけを
+// コピーすればよい。
+static void fill_pages(struct task *task, elf_phdr_t *phdr, uaddr_t uaddr,
+                       paddr_t paddr, size_t num_pages) {
+    uaddr_t copy_start = MAX(uaddr, phdr->p_vaddr);
+    uaddr_t copy_end =
+        MIN(uaddr + num_pages * PAGE_SIZE, phdr->p_vaddr + phdr->p_filesz);
+    if (copy_start >= copy_end) {
+        // .bssセクションなど、ファイル上に内容がない範囲
+        return;
+    }
+
+    // コピー先のページだけをスクラッチウィンドウにまとめてマップする。これにより、
+    // scratchの仮想アドレスを介して物理ページの内容にアクセスできるようになる。
+    offset_t map_offset = ALIGN_DOWN(copy_start, PAGE_SIZE) - uaddr;
+    size_t map_pages =
+        (ALIGN_UP(copy_end, PAGE_SIZE) - uaddr - map_offset) / PAGE_SIZE;
+    ASSERT_OK(sys_vm_map_range(sys_task_self(), (uaddr_t) scratch,
+                               paddr + map_offset, map_pages,
+                               PAGE_READABLE | PAGE_WRITABLE));
+
+    // BootFSからセグメントの内容を読み込む。
+    bootfs_read(task->file, phdr->p_offset + (copy_start - phdr->p_vaddr),
+                &scratch[copy_start - uaddr - map_offset],
+                copy_end - copy_start);
+
+    ASSERT_OK(
+        sys_vm_unmap_range(sys_task_self(), (uaddr_t) scratch, map_pages));
+}
+
+// ページフォルトが起きたアドレスを含むセグメントを探す。見つからなければNULLを返す。
+static elf_phdr_t *find_segment(struct task *task, uaddr_t uaddr) {
+    for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
+        if (task->phdrs[i].p_type != PT_LOAD) {
+            // PT_LOAD以外の、メモリ上に展開されないセグメントは無視する。
+            continue;
+        }
+
+        // ページフォルトが起きたアドレスがセグメントの範囲内にあるかどうかを調べる。
+        uaddr_t start = task->phdrs[i].p_vaddr;
+        uaddr_t end = start + task->phdrs[i].p_memsz;
+        if (start <= uaddr && uaddr < end) {
+            return &task->phdrs[i];
+        }
+    }
+
+    return NULL;
+}
+
+// セグメントのうち、BootFS上のファイルのページを直接マップできる範囲の終端を返す。範囲は
+// セグメントの先頭から始まり、直接マップできない場合は空の範囲になる。
+//
+// 直接マップできるのは、ELFファイル上の内容がそのままメモリ上の内容になるページのみ。
+// .bssセクションのようにファイル上に内容がない部分を含むセグメントでは、末尾の中途半端な
+// ページの残りをゼロで埋める必要があるので、そのページは直接マップしない。
+static uaddr_t shared_end(struct task *task, elf_phdr_t *phdr) {
+    uaddr_t start = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+    if (!IS_ALIGNED(phdr->p_vaddr, PAGE_SIZE)
+        || !IS_ALIGNED(phdr->p_offset, PAGE_SIZE)
+        || phdr->p_offset + phdr->p_filesz > task->file->len
+        || !bootfs_paddr(task->file, 0)) {
+        return start;
+    }
+
+    size_t len = (phdr->p_memsz > phdr->p_filesz)
+                     ? ALIGN_DOWN(phdr->p_filesz, PAGE_SIZE)
+                     : ALIGN_UP(phdr->p_filesz, PAGE_SIZE);
+    return start + len;
+}
+
+// BootFS上のファイルのページを、uaddrから始まるnum_pages個のページとして直接マップする。
+// 同じファイルから起動した全てのタスクで物理ページを共有するので、書き込み可能なセグメント
+// も読み込み専用でマップし、書き込まれたときに複製する (コピーオンライト)。
+static error_t map_shared_pages(struct task *task, elf_phdr_t *phdr,
+                                uaddr_t uaddr, size_t num_pages,
+                                uaddr_t fault_uaddr, unsigned attrs) {
+    paddr_t paddr =
+        bootfs_paddr(task->file, phdr->p_offset + (uaddr - phdr->p_vaddr));
+    attrs &= ~PAGE_WRITABLE;
+
+    error_t err = sys_vm_map_range(task->tid, uaddr, paddr, num_pages, attrs);
+    if (err == ERR_ALREADY_EXISTS && num_pages > 1) {
+        // 範囲内に既にマップされているページがあった。フォルトしたページだけをマップする。
+        err = sys_vm_map(task->tid, fault_uaddr, paddr + (fault_uaddr - uaddr),
+                         attrs);
+    }
+
+    if (err == ERR_ALREADY_EXISTS) {
+        // ページフォルトを報告した後に、他の処理 (タスクの複製など) でマップされた。
+        // タスクにはもう一度アクセスしてもらう。
+        return OK;
+    }
+
+    return err;
+}
+
+// 物理ページを割り当ててセグメントの内容をコピーし、uaddrから始まるnum_pages個のページ
+// としてマップする。fault_uaddrはページフォルトが起きたページで、範囲内の他のページを
+// 用意できなくても、このページだけは用意する。
+static error_t map_private_pages(struct task *task, elf_phdr_t *phdr,
+                                 uaddr_t uaddr, size_t num_pages,
+                                 uaddr_t fault_uaddr, unsigned attrs) {
+    // 物理ページを用意する。
+    pfn_t pfn_or_err = sys_pm_alloc(task->tid, num_pages * PAGE_SIZE, 0);
+    if (IS_ERROR(pfn_or_err) && num_pages > 1) {
+        // 連続した物理ページを確保できなければ、フォルトしたページだけを用意する。
+        uaddr = fault_uaddr;
+        num_pages = 1;
+        pfn_or_err = sys_pm_alloc(task->tid, PAGE_SIZE, 0);
+    }
+
+    if (IS_ERROR(pfn_or_err)) {
+        return pfn_or_err;
+    }
+
+    // pm_allocは物理ページ番号を返すので、物理アドレスに変換する。
+    paddr_t paddr = PFN2PADDR(pfn_or_err);
+
+    // 割り当てた物理ページにセグメントの内容をELFイメージからコピーする。
+    fill_pages(task, phdr, uaddr, paddr, num_pages);
+
+    // ページをまとめてマップする。範囲はマップされていないページに絞り込み済み。
+    error_t err = sys_vm_map_range(task->tid, uaddr, paddr, num_pages, attrs);
+    if (err == ERR_ALREADY_EXISTS) {
+        // ページフォルトを報告した後に、他の処理 (タスクの複製など) でマップされた。
+        // タスクにはもう一度アクセスしてもらう。
+        ASSERT_OK(sys_pm_free(task->tid, paddr, num_pages * PAGE_SIZE));
+        return OK;
+    }
+
+    return err;
+}
+
+// [*start, *end) の範囲を、fault_uaddrを含み、まだマップされていないページだけが連続する
+// 範囲に絞り込む。ページ境界を共有するセグメントや、以前のページフォルトで既にマップした
+// ページを避けることで、使わないページを割り当ててコピーしないようにする。
+static void shrink_to_unmapped(struct task *task, uaddr_t fault_uaddr,
+                               uaddr_t *start, uaddr_t *end) {
+    uaddr_t first = fault_uaddr;
+    while (first > *start
+           && sys_vm_paddr(task->tid, first - PAGE_SIZE) == ERR_NOT_FOUND) {
+        first -= PAGE_SIZE;
+    }
+
+    uaddr_t last = fault_uaddr + PAGE_SIZE;
+    while (last < *end && sys_vm_paddr(task->tid, last) == ERR_NOT_FOUND) {
+        last += PAGE_SIZE;
+    }
+
+    *start = first;
+    *end = last;
+}
+
+// コピーオンライト: 他のタスクと読み込み専用で共有している、書き込み可能なセグメントの
+// ページに書き込まれた。ページを複製して、タスク専用の書き込み可能なページに置き換える。
+//
+// 共有しているのは、BootFS上のファイルのページか、タスクの複製 (fork) で親子が共有した
+// ページのいずれか。
+static error_t copy_on_write(struct task *task, uaddr_t uaddr,
+                             unsigned attrs) {
+    pfn_t src_pfn = sys_vm_paddr(task->tid, uaddr);
+    if (IS_ERROR(src_pfn)) {
+        return src_pfn;
+    }
+
+    pfn_t pfn_or_err = sys_pm_alloc(task->tid, PAGE_SIZE, 0);
+    if (IS_ERROR(pfn_or_err)) {
+        return pfn_or_err;
+    }
+
+    // 複製元と複製先をスクラッチウィンドウにマップして、ページの内容を複製する。
+    paddr_t src_paddr = PFN2PADDR(src_pfn);
+    paddr_t paddr = PFN2PADDR(pfn_or_err);
+    uint8_t *src_page = &scratch[0];
+    uint8_t *dst_page = &scratch[PAGE_SIZE];
+    ASSERT_OK(sys_vm_map(sys_task_self(), (uaddr_t) src_page, src_paddr,
+                         PAGE_READABLE));
+    ASSERT_OK(sys_vm_map(sys_task_self(), (uaddr_t) dst_page, paddr,
+                         PAGE_READABLE | PAGE_WRITABLE));
+    memcpy(dst_page, src_page, PAGE_SIZE);
+    ASSERT_OK(sys_vm_unmap_range(sys_task_self(), (uaddr_t) scratch, 2));
+
+    // 共有しているページを、複製したページに置き換える。
+    ASSERT_OK(sys_vm_unmap(task->tid, uaddr));
+    ASSERT_OK(sys_vm_map(task->tid, uaddr, paddr, attrs));
+
+    // 複製元のページをタスクが所有していれば手放す。他のタスクがまだマップしていれば、
+    // 最後にアンマップされたときに解放される。BootFSのページなど、所有していないページ
+    // であれば何もしない。
+    error_t err = sys_pm_free(task->tid, src_paddr, PAGE_SIZE);
+    DEBUG_ASSERT(err == OK || err == ERR_INVALID_PADDR);
+    return OK;
+}
+
 // ページフォルト処理。ページを用意してマップする。できなかった場合はエラーを返す。
 error_t handle_page_fault(struct task *task, uaddr_t uaddr, uaddr_t ip,
                           unsigned fault) {
@@ -20,7 +231,25 @@ error_t handle_page_fault(struct task *task, uaddr_t uaddr, uaddr_t ip,
     uaddr_t uaddr_original = uaddr;
     uaddr = ALIGN_DOWN(uaddr, PAGE_SIZE);
 
+    // ページフォルトが起きたアドレスを含むセグメントを探す。
+    elf_phdr_t *phdr = find_segment(task, uaddr);
+
+    // ページの属性をセグメント情報から決定する。
+    unsigned attrs = 0;
+    if (phdr) {
+        ASSERT(phdr->p_filesz <= phdr->p_memsz);
+        attrs |= (phdr->p_flags & PF_R) ? PAGE_READABLE : 0;
+        attrs |= (phdr->p_flags & PF_W) ? PAGE_WRITABLE : 0;
+        attrs |= (phdr->p_flags & PF_X) ? PAGE_EXECUTABLE : 0;
+    }
+
     if (fault & PAGE_FAULT_PRESENT) {
+        // 書き込み可能なセグメントのページは、他のタスクと共有しているときだけ読み込み専用
+        // でマップしている。
+        if ((fault & PAGE_FAULT_WRITE) && (attrs & PAGE_WRITABLE)) {
+            return copy_on_write(task, uaddr, attrs);
+        }
+
         // 既にページが存在する。アクセス権限が不正な場合、たとえば読み込み専用ページに
         // 書き込もうとした場合。
         WARN(
@@ -32,23 +261,6 @@ error_t handle_page_fault(struct task *task, uaddr_t uaddr, uaddr_t ip,
         return ERR_NOT_ALLOWED;
     }
 
-    // ページフォルトが起きたアドレスを踏むセグメントを探す。
-    elf_phdr_t *phdr = NULL;
-    for (unsigned i = 0; i < task->ehdr->e_phnum; i++) {
-        if (task->phdrs[i].p_type != PT_LOAD) {
-            // PT_LOAD以外の、メモリ上に展開されないセグメントは無視する。
-            continue;
-        }
-
-        // ページフォルトが起きたアドレスがセグメントの範囲内にあるかどうかを調べる。
-        uaddr_t start = task->phdrs[i].p_vaddr;
-        uaddr_t end = start + task->phdrs[i].p_memsz;
-        if (start <= uaddr && uaddr < end) {
-            phdr = &task->phdrs[i];
-            break;
-        }
-    }
-
     // 該当するセグメントがない場合は無効なアドレスとみなす。
     if (!phdr) {
         ERROR("unknown memory address (addr=%p, IP=%p), killing %s...",
@@ -56,43 +268,28 @@ error_t handle_page_fault(struct task *task, uaddr_t uaddr, uaddr_t ip,
         return ERR_INVALID_ARG;
     }
 
-    // 物理ページを用意する。
-    pfn_t pfn_or_err = sys_pm_alloc(task->tid, PAGE_SIZE, 0);
-    if (IS_ERROR(pfn_or_err)) {
-        return pfn_or_err;
-    }
-
-    // pm_allocは物理ページ番号を返すので、物理アドレスに変換する。
-    paddr_t paddr = PFN2PADDR(pfn_or_err);
-
-    // 割り当てた物理ページにセグメントの内容をELFイメージからコピーする。
-    size_t offset = uaddr - phdr->p_vaddr;
-    if (offset < phdr->p_filesz) {
-        // セグメントの内容をコピーするための仮想アドレス領域。ここで確保したメモリ領域が
-        // 実際に使われず、この領域の仮想アドレスが他の物理ページにマップされる。
-        static __aligned(PAGE_SIZE) uint8_t tmp_page[PAGE_SIZE];
-
-        // tmp_pageを一旦アンマップする。カーネルによって起動時にマップされているため。
-        ASSERT_OK(sys_vm_unmap(sys_task_self(), (uaddr_t) tmp_page));
+    // フォールトアラウンド: フォルトしたページを含む、FAULT_AROUND_SIZEでアラインされた
+    // 範囲のうち、セグメント内にあるページをまとめて用意する。近くのページもすぐにアクセス
+    // されることが多いので、ページフォルトの回数を減らせる。
+    uaddr_t window = ALIGN_DOWN(uaddr, FAULT_AROUND_SIZE);
+    uaddr_t start = MAX(window, ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE));
+    uaddr_t end = MIN(window + FAULT_AROUND_SIZE,
+                      ALIGN_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE));
 
-        // tmp_pageをpaddrにマップする。これにより、tmp_pageの仮想アドレスを介して
-        // paddrの内容にアクセスできるようになる。
-        ASSERT_OK(sys_vm_map(sys_task_self(), (uaddr_t) tmp_page, paddr,
-                             PAGE_READABLE | PAGE_WRITABLE));
-
-        // BootFSからセグメントの内容を読み込む。
-        size_t copy_len = MIN(PAGE_SIZE, phdr->p_filesz - offset);
-        bootfs_read(task->file, phdr->p_offset + offset, tmp_page, copy_len);
+    // BootFS上のページを直接マップできる範囲とそうでない範囲は分けて処理する。
+    error_t err;
+    uaddr_t boundary = shared_end(task, phdr);
+    if (uaddr < boundary) {
+        end = MIN(end, boundary);
+        shrink_to_unmapped(task, uaddr, &start, &end);
+        err = map_shared_pages(task, phdr, start, (end - start) / PAGE_SIZE,
+                               uaddr, attrs);
+    } else {
+        start = MAX(start, boundary);
+        shrink_to_unmapped(task, uaddr, &start, &end);
+        err = map_private_pages(task, phdr, start, (end - start) / PAGE_SIZE,
+                                uaddr, attrs);
     }
 
-    // ページの属性をセグメント情報から決定する。
-    unsigned attrs = 0;
-    attrs |= (phdr->p_flags & PF_R) ? PAGE_READABLE : 0;
-    attrs |= (phdr->p_flags & PF_W) ? PAGE_WRITABLE : 0;
-    attrs |= (phdr->p_flags & PF_X) ? PAGE_EXECUTABLE : 0;
-
-    // ページをマップする。
-    ASSERT(phdr->p_filesz <= phdr->p_memsz);
-    ASSERT_OK(sys_vm_map(task->tid, uaddr, paddr, attrs));
-    return OK;
+    return err;
 }
@@ -1,7 +1,14 @@
 #pragma once
 #include <libs/common/types.h>
 
+// フォールトアラウンドで一度に用意するページ数。2のべき乗でなければならない。1にすると
+// フォルトしたページだけを用意する。
+#define FAULT_AROUND_PAGES 16
+// フォールトアラウンドで一度に用意する範囲のサイズ
+#define FAULT_AROUND_SIZE (FAULT_AROUND_PAGES * PAGE_SIZE)
+
 struct task;
 
+void page_fault_init(void);
 error_t handle_page_fault(struct task *task, uaddr_t vaddr, uaddr_t ip,
                           unsigned fault);
@@ -3,42 +3,58 @@
 #include <libs/common/print.h>
 #include <libs/user/syscall.h>
 
-// タスクで使われていない仮想アドレス領域を返す。仮想アドレスは割り当てっぱなしで解放はできない。
-static uaddr_t valloc(struct task *task, size_t size) {
-    if (task->valloc_next >= VALLOC_END) {
+// タスクで使われていない、alignでアラインされた仮想アドレス領域を返す。仮想アドレスは
+// 割り当てっぱなしで解放はできない。
+static uaddr_t valloc(struct task *task, size_t size, size_t align) {
+    uaddr_t uaddr = ALIGN_UP(task->valloc_next, align);
+    if (uaddr >= VALLOC_END || VALLOC_END - uaddr < size) {
         return 0;
     }
 
-    uaddr_t uaddr = task->valloc_next;
-    task->valloc_next += ALIGN_UP(size, PAGE_SIZE);
+    task->valloc_next = uaddr + ALIGN_UP(size, PAGE_SIZE);
     return uaddr;
 }
 
 // 物理アドレスをタスクのページテーブルにマップする。uaddrには割り当てた仮想アドレスが返る。
+//
+// map_flagsにPAGE_LARGEを指定すると、LARGE_PAGE_SIZE単位の大きなページでマップする。その
+// 場合、sizeとpaddrはLARGE_PAGE_SIZEでアラインされていなければならない。
 error_t map_pages(struct task *task, size_t size, int map_flags, paddr_t paddr,
                   uaddr_t *uaddr) {
     DEBUG_ASSERT(IS_ALIGNED(size, PAGE_SIZE));
-    *uaddr = valloc(task, size);
+    size_t page_size = (map_flags & PAGE_LARGE) ? LARGE_PAGE_SIZE : PAGE_SIZE;
+    if (!IS_ALIGNED(size, page_size) || !IS_ALIGNED(paddr, page_size)) {
+        return ERR_INVALID_ARG;
+    }
+
+    *uaddr = valloc(task, size, page_size);
     if (!*uaddr) {
         return ERR_NO_RESOURCES;
     }
 
-    // 各ページをマップする。
-    for (offset_t offset = 0; offset < size; offset += PAGE_SIZE) {
-        error_t err =
-            sys_vm_map(task->tid, *uaddr + offset, paddr + offset, map_flags);
-        if (err != OK) {
-            WARN("vm_map failed: %s", err2str(err));
-            return err;
-        }
+    // 全てのページを1回のシステムコールでマップする。
+    error_t err = sys_vm_map_range(task->tid, *uaddr, paddr, size / PAGE_SIZE,
+                                   map_flags);
+    if (err != OK) {
+        WARN("vm_map_range failed: %s", err2str(err));
+        return err;
     }
 
     return OK;
 }
 
 // 物理ページを割り当てて、タスクのページテーブルにマップする。uaddrには割り当てた仮想アドレスが返る。
+//
+// map_flagsにPAGE_LARGEを指定すると、sizeをLARGE_PAGE_SIZEに切り上げて大きなページで
+// マップする。DMAバッファや大きなヒープ領域で、TLBミスを減らすのに使う。
 error_t alloc_pages(struct task *task, size_t size, int alloc_flags,
                     int map_flags, paddr_t *paddr, uaddr_t *uaddr) {
+    if (map_flags & PAGE_LARGE) {
+        // バディアロケータのブロックはその大きさでアラインされているので、
+        // LARGE_PAGE_SIZE以上を割り当てれば物理アドレスもアラインされる。
+        size = ALIGN_UP(size, LARGE_PAGE_SIZE);
+    }
+
     pfn_t pfn = sys_pm_alloc(task->tid, size,
                              alloc_flags | PM_ALLOC_ALIGNED | PM_ALLOC_ZEROED);
     if (IS_ERROR(pfn)) {
@@ -48,3 +64,24 @@ error_t alloc_pages(struct task *task, size_t size, int alloc_flags,
     *paddr = PFN2PADDR(pfn);
     return map_pages(task, size, map_flags, *paddr, uaddr);
 }
+
+// 物理ページを割り当てて、taskとpeerの両方のページテーブルにマップする (共有メモリ)。uaddr
+// とpeer_uaddrにはそれぞれのタスクで割り当てた仮想アドレスが返る。
+error_t alloc_shared_pages(struct task *task, struct task *peer, size_t size,
+                           uaddr_t *uaddr, uaddr_t *peer_uaddr) {
+    // 所有者はtaskとする。peerはtaskより長生きしてもマップが残るだけなので問題ない。
+    pfn_t pfn = sys_pm_alloc(task->tid, size, PM_ALLOC_ZEROED);
+    if (IS_ERROR(pfn)) {
+        return pfn;
+    }
+
+    paddr_t paddr = PFN2PADDR(pfn);
+    error_t err = map_pages(task, size, PAGE_READABLE | PAGE_WRITABLE, paddr,
+                            uaddr);
+    if (err != OK) {
+        return err;
+    }
+
+    return map_pages(peer, size, PAGE_READABLE | PAGE_WRITABLE, paddr,
+                     peer_uaddr);
+}
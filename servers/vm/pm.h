@@ -5,3 +5,5 @@ error_t alloc_pages(struct task *task, size_t size, int alloc_flags,
                     int map_flags, paddr_t *paddr, uaddr_t *uaddr);
 error_t map_pages(struct task *task, size_t size, int map_flags, paddr_t paddr,
                   uaddr_t *uaddr);
+error_t alloc_shared_pages(struct task *task, struct task *peer, size_t size,
+                           uaddr_t *uaddr, uaddr_t *peer_uaddr);
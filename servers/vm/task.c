@@ -98,6 +98,87 @@ task_t task_spawn(struct bootfs_file *file) {
     return task->tid;
 }
 
+// parentを複製した子タスクを生成し、ipから実行させる。成功するとタスクID、失敗すると
+// エラーを返す。
+//
+// ELFセグメントの範囲にマップされているページは、全てコピーオンライトで共有する。書き込み
+// 可能なページは親子の両方で読み込み専用にしておき、書き込まれたときにページフォルト処理で
+// 複製する。動的に割り当てた仮想アドレス領域 (MMIO領域や共有メモリなど) は引き継がない。
+task_t task_clone(struct task *parent, uaddr_t ip) {
+    struct task *task = malloc(sizeof(*task));
+    if (!task) {
+        PANIC("too many tasks");
+    }
+
+    // プログラムヘッダは親タスクと同じものを使う。タスクの終了時に解放されるので複製する。
+    void *file_header = malloc(PAGE_SIZE);
+    memcpy(file_header, parent->file_header, PAGE_SIZE);
+
+    // 新しいタスクをカーネルに生成させる。
+    task_t tid_or_err = sys_task_create(parent->name, ip, task_self());
+    if (IS_ERROR(tid_or_err)) {
+        free(file_header);
+        free(task);
+        return tid_or_err;
+    }
+
+    // タスク管理構造体を初期化する。
+    elf_ehdr_t *ehdr = (elf_ehdr_t *) file_header;
+    task->file = parent->file;
+    task->file_header = file_header;
+    task->tid = tid_or_err;
+    task->pager = task_self();
+    task->ehdr = ehdr;
+    task->phdrs = (elf_phdr_t *) ((uaddr_t) file_header + ehdr->e_phoff);
+    task->valloc_next = parent->valloc_next;
+    task->watch_tasks = false;
+    strcpy_safe(task->waiting_for, sizeof(task->waiting_for), "");
+    strcpy_safe(task->name, sizeof(task->name), parent->name);
+    tasks[task->tid - 1] = task;
+
+    // 親タスクのページを子タスクにマップする。
+    for (unsigned i = 0; i < ehdr->e_phnum; i++) {
+        elf_phdr_t *phdr = &task->phdrs[i];
+        if (phdr->p_type != PT_LOAD) {
+            // メモリ上にないセグメントは無視する。
+            continue;
+        }
+
+        uaddr_t start = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+        uaddr_t end = ALIGN_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+        size_t num_pages = (end - start) / PAGE_SIZE;
+        unsigned attrs = 0;
+        attrs |= (phdr->p_flags & PF_R) ? PAGE_READABLE : 0;
+        attrs |= (phdr->p_flags & PF_X) ? PAGE_EXECUTABLE : 0;
+
+        // 書き込み可能なセグメントは、親タスクのページも読み込み専用にする。まだ1つも
+        // ページがマップされていなければ、子タスクは改めてページフォルトで用意する。
+        if (phdr->p_flags & PF_W) {
+            error_t err = sys_vm_protect(parent->tid, start, num_pages, attrs);
+            if (err == ERR_NOT_FOUND) {
+                continue;
+            }
+
+            if (err != OK) {
+                WARN("%s: failed to write-protect pages: %s", parent->name,
+                     err2str(err));
+                task_destroy(task);
+                return err;
+            }
+        }
+
+        error_t err =
+            sys_vm_share(parent->tid, task->tid, start, num_pages, attrs);
+        if (err != OK) {
+            WARN("%s: failed to share pages: %s", parent->name, err2str(err));
+            task_destroy(task);
+            return err;
+        }
+    }
+
+    return task->tid;
+}
+
 // タスクを終了させる。
 void task_destroy(struct task *task) {
     for (int i = 0; i < NUM_TASKS_MAX; i++) {
@@ -113,11 +194,11 @@ void task_destroy(struct task *task) {
 
     // タスクをカーネルに終了させる。
     OOPS_OK(sys_task_destroy(task->tid));
-    free(task->file_header);
-    free(task);
 
     // タスクIDテーブルからタスク管理構造体を削除する。
-    tasks[task_self() - 1] = NULL;
+    tasks[task->tid - 1] = NULL;
+    free(task->file_header);
+    free(task);
 }
 
 // タスクIDを指定してタスクを終了させる。
@@ -34,6 +34,7 @@ struct task {
 
 struct task *task_find(task_t tid);
 task_t task_spawn(struct bootfs_file *file);
+task_t task_clone(struct task *parent, uaddr_t ip);
 void task_destroy(struct task *task);
 error_t task_destroy_by_tid(task_t tid);
 void service_register(struct task *task, const char *name);
@@ -37,6 +37,10 @@ def test_write_file(run_hinaos):
     assert '[FILE] "lfg.txt"' in r.log
     assert '[shell] LFG' in r.log
 
+def test_write_large_file(run_hinaos):
+    r = run_hinaos("fscheck 2048", timeout=30)
+    assert "fscheck: 2048 KiB written and read back successfully" in r.log
+
 def test_ls(run_hinaos):
     r = run_hinaos("ls")
     assert "hello.txt" in r.log
@@ -50,6 +54,26 @@ def test_hinavm(run_hinaos):
     assert "hinavm_server: pc=7: 123" in r.log
     assert "reply value: 42" in r.log
 
+def test_ipcbench(run_hinaos):
+    r = run_hinaos("ipcbench 1")
+    assert "ipcbench: " in r.log
+    assert "ns/round trip" in r.log
+
+def test_ipcbatch(run_hinaos):
+    r = run_hinaos("ipcbatch 1", timeout=20)
+    assert "ipcbatch: batch size 8: " in r.log
+    assert "messages per receive" in r.log
+
+def test_pmbench(run_hinaos):
+    r = run_hinaos("pmbench 1", timeout=20)
+    assert "ns/pair" in r.log
+
+def test_fork(run_hinaos):
+    r = run_hinaos("fork")
+    assert "fork: child: value=1" in r.log
+    assert "fork: child: updated value=2" in r.log
+    assert "fork: parent: value=1" in r.log
+
 def test_crack(run_hinaos):
     # crackに成功するまでタイムアウトを伸ばしていく
     for i in range(1, 5):
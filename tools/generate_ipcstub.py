@@ -106,6 +106,10 @@ class IDLParser:
             rets = []
             reply_id = None
 
+        self.check_pages_field(name, args)
+        if rets:
+            self.check_pages_field(name, rets)
+
         msg_def = {
             "id": id,
             "reply_id": reply_id,
@@ -120,6 +124,16 @@ class IDLParser:
         self.message_context = None
         return msg_def
 
+    def check_pages_field(self, name, fields):
+        # カーネルはメッセージデータの先頭を見て添付されたページを移動するので、pages型の
+        # フィールドは先頭に1つだけ置ける。
+        for i, field in enumerate(fields["fields"]):
+            if field["type"]["name"] == "pages" and i > 0:
+                raise ParseError(
+                    f"{name}: '{field['name']}' must be the first field",
+                    "A message can have only one 'pages' field at the beginning",
+                )
+
     def visit_fields(self, tree):
         if len(tree.children) == 1 and tree.children[0].data == "any_fields":
             return {
@@ -190,6 +204,9 @@ def generate(args, idl):
             if type_["name"] == "bytes":
                 defs.append(f"uint8_t {field['name']}[{type_['nr']}]")
                 defs.append(f"size_t {field['name']}_len")
+            elif type_["name"] == "pages":
+                defs.append(f"uaddr_t {field['name']}")
+                defs.append(f"size_t {field['name']}_len")
             elif type_["name"] == "cstr":
                 defs.append(f"char {field['name']}[{type_['nr']}]")
             else:
@@ -200,6 +217,9 @@ def generate(args, idl):
                 defs.append(def_)
         return defs
 
+    def has_pages_field(fields):
+        return any(f["type"]["name"] == "pages" for f in fields["fields"])
+
     renderer = jinja2.Environment()
     renderer.filters["newlines_to_whitespaces"] = lambda text: text.replace("\n", " ")
     renderer.filters["field_defs"] = field_defs
@@ -262,6 +282,13 @@ struct {{ msg.name }}_reply_fields {{ "{" }}
     {% endfor %} \\
     {{ "}" }}
 
+#define IPCSTUB_PAGES_MSGIDS \\
+    (const bool[IPCSTUB_MSGID_MAX + 1]){{ "{" }} \\
+    {%- for id in pages_msgids %}
+        [{{ id }}] = true, \\
+    {%- endfor %}
+    {{ "}" }}
+
 #define IPCSTUB_STATIC_ASSERTIONS \\
 {%- for msg in messages %}
     _Static_assert( \\
@@ -280,8 +307,16 @@ struct {{ msg.name }}_reply_fields {{ "{" }}
 """
     )
 
+    # pages型のフィールドを持つメッセージのID
+    pages_msgids = []
+    for msg in idl["messages"]:
+        if has_pages_field(msg["args"]):
+            pages_msgids.append(msg["id"])
+        if not msg["oneway"] and has_pages_field(msg["rets"]):
+            pages_msgids.append(msg["reply_id"])
+
     msgid_max = next_msg_id - 1
-    text = template.render(msgid_max=msgid_max, **idl)
+    text = template.render(msgid_max=msgid_max, pages_msgids=pages_msgids, **idl)
 
     with open(args.out, "w") as f:
         f.write(text)